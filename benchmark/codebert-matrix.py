@@ -0,0 +1,280 @@
+"""Benchmark matrix of inference backends for a RoBERTa-like masked language
+model. It sweeps backend, number of threads, batch size, and sequence length
+bucket, writes structured timings with environment metadata to JSON, and
+regenerates the report plot (see codebert-plot.py).
+"""
+
+import json
+import os
+import platform
+import subprocess
+import sys
+
+from argparse import ArgumentParser, Namespace
+from dataclasses import asdict, dataclass
+from datetime import datetime, timezone
+from importlib.metadata import PackageNotFoundError, version
+from itertools import product
+from pathlib import Path
+from time import perf_counter
+from typing import Any, Callable, Dict, List
+
+import numpy as np
+import torch as T
+
+from transformers import AutoModelForMaskedLM, AutoTokenizer
+
+# PyTorch eager, TorchScript (traced and frozen graph executed by native
+# runtime), dynamically quantised PyTorch (int8 linear layers), ONNX Runtime,
+# and ONNX Runtime with dynamically quantised graph.
+BACKENDS = ('pt', 'pt-jit', 'pt-int8', 'onnx', 'onnx-int8')
+
+ISA_FLAGS = ('sse4_2', 'avx', 'avx2', 'fma', 'f16c', 'avx512f', 'avx512bw',
+             'avx512_vnni', 'avx512_bf16', 'avx_vnni', 'amx_bf16', 'amx_int8',
+             'asimd', 'sve')
+
+PACKAGES = ('numpy', 'onnx', 'onnxruntime', 'tokenizers', 'torch',
+            'transformers')
+
+Apply = Callable[[np.ndarray, np.ndarray], Any]
+
+
+@dataclass
+class Timing:
+
+    backend: str
+
+    num_threads: int
+
+    batch_size: int
+
+    seq_len: int
+
+    num_repeats: int
+
+    mean: float
+
+    std: float
+
+    min: float
+
+    median: float
+
+    p95: float
+
+
+def describe_environment() -> Dict[str, Any]:
+    """Function describe_environment collects CPU model, ISA extensions, and
+    versions of libraries so that timings of different machines and runs are
+    comparable.
+    """
+    cpu_model, flags = platform.processor(), set()
+    try:
+        with open('/proc/cpuinfo') as fin:
+            for line in fin:
+                key, _, value = line.partition(':')
+                if key.strip() == 'model name':
+                    cpu_model = value.strip()
+                elif key.strip() in ('flags', 'Features'):
+                    flags.update(value.split())
+    except OSError:
+        pass
+
+    packages = {}
+    for name in PACKAGES:
+        try:
+            packages[name] = version(name)
+        except PackageNotFoundError:
+            packages[name] = None
+
+    try:
+        commit = subprocess.run(['git', 'rev-parse', 'HEAD'],
+                                capture_output=True, text=True,
+                                check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        commit = None
+
+    return {
+        'timestamp': datetime.now(timezone.utc).isoformat(),
+        'commit': commit,
+        'machine': platform.machine(),
+        'system': platform.platform(),
+        'python': platform.python_version(),
+        'cpu_model': cpu_model,
+        'cpu_count': os.cpu_count(),
+        'isa': sorted(flags.intersection(ISA_FLAGS)),
+        'packages': packages,
+    }
+
+
+def make_inputs(tokenizer, sample: str, batch_size: int, seq_len: int):
+    """Function make_inputs builds a batch of exactly seq_len tokens from
+    sample text repeated as many times as needed.
+    """
+    ids = tokenizer(sample, add_special_tokens=False)['input_ids']
+    ids = (ids * (seq_len // max(len(ids), 1) + 1))[:seq_len - 2]
+    ids = [tokenizer.cls_token_id] + ids + [tokenizer.sep_token_id]
+    input = np.tile(np.array(ids, dtype=np.int64), (batch_size, 1))
+    mask = np.ones_like(input)
+    return input, mask
+
+
+def export_onnx(model, path: Path, opset: int):
+    input = T.ones((1, 8), dtype=T.int64)
+    T.onnx.export(model=model,
+                  args=(input, T.ones_like(input)),
+                  f=str(path),
+                  export_params=True,
+                  input_names=['input', 'mask'],
+                  output_names=['output'],
+                  do_constant_folding=True,
+                  opset_version=opset,
+                  dynamic_axes={
+                      'input': {0: 'batch_size', 1: 'sequence_length'},
+                      'mask': {0: 'batch_size', 1: 'sequence_length'},
+                  })
+
+
+def quantise_onnx(path: Path) -> Path:
+    from onnxruntime.quantization import QuantType, quantize_dynamic
+    quantised_path = path.with_suffix('.int8.onnx')
+    if not quantised_path.exists():
+        quantize_dynamic(str(path), str(quantised_path),
+                         weight_type=QuantType.QInt8)
+    return quantised_path
+
+
+def make_backend(name: str, model, num_threads: int, workdir: Path,
+                 opset: int) -> Apply:
+    """Function make_backend prepares model for a backend and returns
+    function which applies it to numpy inputs.
+    """
+    T.set_num_threads(num_threads)
+    if name in ('onnx', 'onnx-int8'):
+        import onnxruntime as ort
+        path = workdir / f'codebert.opset{opset}.onnx'
+        if not path.exists():
+            export_onnx(model, path, opset)
+        if name == 'onnx-int8':
+            path = quantise_onnx(path)
+        opts = ort.SessionOptions()
+        opts.intra_op_num_threads = num_threads
+        opts.inter_op_num_threads = 1
+        sess = ort.InferenceSession(str(path), opts,
+                                    providers=['CPUExecutionProvider'])
+        return lambda input, mask: sess.run(['output'], {'input': input,
+                                                         'mask': mask})
+
+    if name == 'pt-int8':
+        model = T.quantization.quantize_dynamic(model, {T.nn.Linear},
+                                                dtype=T.qint8)
+    elif name == 'pt-jit':
+        input = T.ones((1, 8), dtype=T.int64)
+        traced = T.jit.trace(model, (input, T.ones_like(input)), strict=False)
+        model = T.jit.freeze(traced.eval())
+
+    def apply(input, mask):
+        with T.inference_mode():
+            return model(T.from_numpy(input), T.from_numpy(mask))
+
+    return apply
+
+
+def measure(apply: Apply, input, mask, num_warmups: int, num_repeats: int,
+            max_time: float) -> np.ndarray:
+    for _ in range(num_warmups):
+        apply(input, mask)
+    elapsed = []
+    started_at = perf_counter()
+    for _ in range(num_repeats):
+        timestamp = perf_counter()
+        apply(input, mask)
+        elapsed.append(perf_counter() - timestamp)
+        if perf_counter() - started_at > max_time:
+            break
+    return np.array(elapsed) * 1e3
+
+
+def run(args: Namespace) -> List[Timing]:
+    tokenizer = AutoTokenizer.from_pretrained(args.model)
+    model = AutoModelForMaskedLM.from_pretrained(args.model, torchscript=True)
+    model.eval()
+    sample = Path(args.sample).read_text()
+    args.workdir.mkdir(parents=True, exist_ok=True)
+
+    timings = []
+    for backend, num_threads in product(args.backend, args.num_threads):
+        print(f'prepare backend {backend} with {num_threads} threads',
+              file=sys.stderr)
+        apply = make_backend(backend, model, num_threads, args.workdir,
+                             args.opset)
+        for batch_size, seq_len in product(args.batch_size, args.seq_len):
+            input, mask = make_inputs(tokenizer, sample, batch_size, seq_len)
+            elapsed = measure(apply, input, mask, args.num_warmups,
+                              args.num_repeats, args.max_time)
+            timing = Timing(backend=backend,
+                            num_threads=num_threads,
+                            batch_size=batch_size,
+                            seq_len=seq_len,
+                            num_repeats=len(elapsed),
+                            mean=float(elapsed.mean()),
+                            std=float(elapsed.std()),
+                            min=float(elapsed.min()),
+                            median=float(np.median(elapsed)),
+                            p95=float(np.percentile(elapsed, 95)))
+            print(f'{backend:<10} threads={num_threads:<3} '
+                  f'batch={batch_size:<3} seq_len={seq_len:<4} '
+                  f'{timing.median:8.1f} ms ± {timing.std:.1f} ms',
+                  file=sys.stderr)
+            timings.append(timing)
+    return timings
+
+
+def main(args: Namespace):
+    environment = describe_environment()
+    timings = run(args)
+    with open(args.output, 'w') as fout:
+        json.dump({
+            'environment': environment,
+            'model': args.model,
+            'unit': 'ms',
+            'timings': [asdict(timing) for timing in timings],
+        }, fout, indent=2)
+    print(f'timings are written to {args.output}', file=sys.stderr)
+
+    if args.plot is not None:
+        plot_script = Path(__file__).with_name('codebert-plot.py')
+        subprocess.run([sys.executable, str(plot_script), '-o',
+                        str(args.plot), str(args.output)], check=True)
+
+
+def parse_ints(value: str) -> List[int]:
+    return [int(item) for item in value.split(',')]
+
+
+def parse_backends(value: str) -> List[str]:
+    backends = value.split(',')
+    if (unknown := set(backends) - set(BACKENDS)):
+        raise ValueError(f'Unknown backends: {", ".join(sorted(unknown))}.')
+    return backends
+
+
+parser = ArgumentParser(description=__doc__)
+parser.add_argument('-m', '--model', default='microsoft/codebert-base-mlm', help='Path to local checkpoint or model name.')  # noqa: E501
+parser.add_argument('-b', '--backend', default=','.join(BACKENDS), type=parse_backends, help='Comma-separated list of backends.')  # noqa: E501
+parser.add_argument('-t', '--num-threads', default='1,2,4', type=parse_ints, help='Comma-separated list of thread counts.')  # noqa: E501
+parser.add_argument('-B', '--batch-size', default='1,4', type=parse_ints, help='Comma-separated list of batch sizes.')  # noqa: E501
+parser.add_argument('-l', '--seq-len', default='64,128,256,512', type=parse_ints, help='Comma-separated list of sequence length buckets.')  # noqa: E501
+parser.add_argument('-n', '--num-repeats', default=20, type=int, help='Maximal number of measured runs per configuration.')  # noqa: E501
+parser.add_argument('-w', '--num-warmups', default=3, type=int, help='Number of warm-up runs per configuration.')  # noqa: E501
+parser.add_argument('--max-time', default=10.0, type=float, help='Time budget of measured runs per configuration (in seconds).')  # noqa: E501
+parser.add_argument('--opset', default=14, type=int, help='ONNX operator set.')  # noqa: E501
+parser.add_argument('--sample', default='codebert-sample.py', help='Text to tokenize into inputs.')  # noqa: E501
+parser.add_argument('--workdir', default=Path('.'), type=Path, help='Directory for exported ONNX models.')  # noqa: E501
+parser.add_argument('-o', '--output', default=Path('codebert-timings.json'), type=Path, help='Path to output timings.')  # noqa: E501
+parser.add_argument('--plot', default=Path('codebert-report.png'), type=Path, help='Path to regenerated report plot.')  # noqa: E501
+parser.add_argument('--no-plot', dest='plot', action='store_const', const=None, help='Do not regenerate report plot.')  # noqa: E501
+
+
+if __name__ == '__main__':
+    main(parser.parse_args())
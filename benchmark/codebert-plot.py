@@ -1,51 +1,73 @@
-import matplotlib as mpl
+"""Render report plot from structured timings of codebert-matrix.py. There
+is a subplot per batch size and number of threads where median latency of
+every backend is plotted against sequence length (the band spans from
+minimal to 95th percentile of latency).
+"""
+
+import json
+
+from argparse import ArgumentParser
+from pathlib import Path
+from textwrap import fill
+
 import matplotlib.pyplot as plt
-import numpy as np
 import pandas as pd
 
+# Desired inference time is about 33 ms (approximately 30 Hz).
+TARGET_LATENCY = 33
+
+
+def plot(timings_path: Path, output: Path):
+    with open(timings_path) as fin:
+        report = json.load(fin)
+    env = report['environment']
+    df = pd.DataFrame(report['timings'])
+    print(df.to_string(index=False))
+
+    batch_sizes = sorted(df.batch_size.unique())
+    thread_counts = sorted(df.num_threads.unique())
+    fig, axes = plt.subplots(len(batch_sizes), len(thread_counts),
+                             dpi=300, sharex=True, sharey=True, squeeze=False,
+                             figsize=(4 * len(thread_counts),
+                                      3 * len(batch_sizes)))
+    for row, batch_size in enumerate(batch_sizes):
+        for col, num_threads in enumerate(thread_counts):
+            ax = axes[row, col]
+            mask = (df.batch_size == batch_size) & \
+                (df.num_threads == num_threads)
+            for backend, group in df[mask].groupby('backend', sort=False):
+                group = group.sort_values('seq_len')
+                ax.plot(group.seq_len, group['median'], marker='o',
+                        label=backend)
+                ax.fill_between(group.seq_len, group['min'], group.p95,
+                                alpha=0.2)
+            ax.axhline(TARGET_LATENCY, color='gray', linestyle='--',
+                       linewidth=1)
+            ax.set_xscale('log', base=2)
+            ax.set_yscale('log')
+            ax.grid(which='both', alpha=0.3)
+            ax.set_title(f'batch {batch_size}, {num_threads} threads',
+                         fontsize='small')
+            if row == len(batch_sizes) - 1:
+                ax.set_xlabel('Sequence Length, tokens')
+            if col == 0:
+                ax.set_ylabel('Wall Time, ms')
+    axes[0, 0].legend(fontsize='small')
+
+    isa = ' '.join(env.get('isa', []))
+    fig.suptitle('Execution time for different execution backends on CPU.\n' +
+                 fill(f'{env.get("cpu_model")} ({isa})', width=80),
+                 fontsize='small')
+    fig.tight_layout()
+    fig.savefig(output)
+    print(f'report is written to {output}')
+
+
+parser = ArgumentParser(description=__doc__)
+parser.add_argument('-o', '--output', default=Path('codebert-report.png'), type=Path, help='Path to output plot.')  # noqa: E501
+parser.add_argument('timings', nargs='?', default=Path('codebert-timings.json'), type=Path, help='Path to timings (see codebert-matrix.py).')  # noqa: E501
+
 
-# Load measuremens.
-df = pd.read_csv('timings.csv')
-df['mean'] = df.measure.str.split(' ', 1, expand=True)[0].astype(int)
-df['std'] = df.measure.str.rsplit(' ', 2, expand=True)[1].astype(float)
-print(df)
-
-# Assign color to execution framework.
-colors_it = plt.rcParams['axes.prop_cycle'].by_key()['color']
-tf_color = colors_it[0]
-tf = df[:2]
-pt_color = colors_it[1]
-pt = df[2:3]
-onnx_color = colors_it[2]
-onnx = df[3:]
-colors = ([tf_color] * len(tf) + [pt_color] * len(pt) +
-          [onnx_color] * len(onnx))
-
-# Prepare labels for bars.
-labels = df.text.tolist()
-labels[0] = 'Default'
-labels[1] = 'w/ JIT'
-labels[2] = 'Default'
-for i in range(3, len(df)):
-    labels[i] = labels[i].removeprefix('ONNX ')
-
-# Render figure to file
-fig, ax = plt.subplots(dpi=300, figsize=(8, 6))
-plt.subplots_adjust(bottom=0.3)
-
-tf_handle = mpl.patches.Patch(color=tf_color, label='TensorFlow')
-pt_handle = mpl.patches.Patch(color=pt_color, label='PyTorch')
-onnx_handle = mpl.patches.Patch(color=onnx_color, label='ONNX')
-
-ax.legend(handles=[tf_handle, pt_handle, onnx_handle])
-ax.grid(axis='y')
-ax.bar(x=np.arange(len(df)),
-       height=df['mean'].values,
-       yerr=df['std'].values,
-       color=colors)
-ax.set_ylabel('Wall Time, ms')
-ax.set_xticks(np.arange(len(df)))
-ax.set_xticklabels(labels, rotation='vertical')
-
-fig.suptitle('Execution time for different execution backends on CPU.')
-fig.savefig('codebert-report.png')
+if __name__ == '__main__':
+    args = parser.parse_args()
+    plot(args.timings, args.output)
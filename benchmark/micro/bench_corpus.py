@@ -0,0 +1,52 @@
+#   encoding: utf8
+#   filename: bench_corpus.py
+"""Microbenchmarks of position lookup and document updates. Cursor is placed
+in the middle of the last line which is the worst case of a linear scan.
+"""
+
+from lsp.corpus import Corpus, Document, locate
+
+URI = 'file:///bench.py'
+
+
+def last_position(text: str):
+    lines = text.splitlines()
+    return len(lines) - 1, len(lines[-1]) // 2
+
+
+def bench_locate(benchmark, text: str):
+    line, char = last_position(text)
+    assert benchmark(locate, text, line, char) is not None
+
+
+def bench_document_window(benchmark, text: str):
+    line, char = last_position(text)
+    doc = Document(text)
+    prefix, _ = benchmark(doc.window, line, char)
+    assert prefix
+
+
+def bench_corpus_set(benchmark, text: str):
+    corpus = Corpus()
+    corpus.open(URI, '', 'python')
+    benchmark(corpus.set, URI, text)
+    assert corpus.get(URI).text == text
+
+
+def bench_corpus_apply(benchmark, text: str):
+    line, char = last_position(text)
+    position = {'line': line, 'character': char}
+    range_ = {'start': position, 'end': position}
+    corpus = Corpus()
+    corpus.open(URI, text, 'python')
+    # Keystroke inserts a character and the next one removes it so that
+    # document does not grow.
+    erase = {'start': position,
+             'end': {'line': line, 'character': char + 1}}
+
+    def type_and_erase():
+        corpus.apply(URI, range_, 'x')
+        corpus.apply(URI, erase, '')
+
+    benchmark(type_and_erase)
+    assert corpus.get(URI).text == text
@@ -0,0 +1,52 @@
+#   encoding: utf8
+#   filename: bench_rpc.py
+"""Microbenchmarks of framing and (de)serialisation of JSON-RPC messages.
+"""
+
+from io import BytesIO
+from types import SimpleNamespace
+
+from conftest import make_frame
+
+from lsp.lsp.syncio import LanguageServerProtocol
+from lsp.lsp.syncio.rpc import Packet, PacketReader, PacketWriter
+from lsp.lsp.syncio.session import Session
+
+
+def make_session() -> Session:
+    server = SimpleNamespace(recorder=None)
+    return Session(BytesIO(), BytesIO(), server,
+                   lambda session: LanguageServerProtocol())
+
+
+def bench_packet_reader_read(benchmark, content: bytes):
+    frame = make_frame(content)
+
+    def read():
+        return PacketReader(BytesIO(frame)).read()
+
+    packet = benchmark(read)
+    assert packet.content == content
+
+
+def bench_packet_writer_write(benchmark, content: bytes):
+    def write():
+        fout = BytesIO()
+        PacketWriter(fout).write(content)
+        return fout
+
+    fout = benchmark(write)
+    assert fout.getvalue().endswith(content)
+
+
+def bench_session_read_packet(benchmark, content: bytes):
+    session = make_session()
+    frame = Packet(len(content), None, content)
+    packet, _ = benchmark(session.read_packet, frame)
+    assert packet['id'] == 42
+
+
+def bench_session_write_packet(benchmark, packet: dict, content: bytes):
+    session = make_session()
+    result = benchmark(session.write_packet, packet, 'utf-8')
+    assert result == content
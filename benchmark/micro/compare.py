@@ -0,0 +1,58 @@
+#!/usr/bin/env python
+#   encoding: utf8
+#   filename: compare.py
+"""Compare two runs of microbenchmarks (JSON reports of pytest-benchmark) and
+flag regressions. Exit status is non-zero if any benchmark is slower than the
+baseline by more than a threshold.
+"""
+
+from argparse import ArgumentParser
+from json import load
+from pathlib import Path
+from sys import exit
+from typing import Dict
+
+
+def read_stats(path: Path, stat: str) -> Dict[str, float]:
+    with open(path) as fin:
+        report = load(fin)
+    return {bench['fullname']: bench['stats'][stat]
+            for bench in report['benchmarks']}
+
+
+def compare(baseline: Path, candidate: Path, stat: str,
+            threshold: float) -> int:
+    before = read_stats(baseline, stat)
+    after = read_stats(candidate, stat)
+    num_regressions = 0
+    print(f'{"benchmark":<64} {"before, us":>12} {"after, us":>12} '
+          f'{"change":>8}')
+    for name in sorted(before.keys() | after.keys()):
+        if name not in before or name not in after:
+            status = 'added' if name in after else 'removed'
+            print(f'{name:<64} {status:>34}')
+            continue
+        change = after[name] / before[name] - 1
+        flag = ''
+        if change > threshold:
+            flag, num_regressions = ' REGRESSION', num_regressions + 1
+        elif change < -threshold:
+            flag = ' improvement'
+        print(f'{name:<64} {before[name] * 1e6:>12.2f} '
+              f'{after[name] * 1e6:>12.2f} {change:>+8.1%}{flag}')
+    print(f'\n{num_regressions} regressions (threshold {threshold:.0%} on '
+          f'{stat})')
+    return num_regressions
+
+
+parser = ArgumentParser(description=__doc__)
+parser.add_argument('-s', '--stat', default='median', choices=('min', 'median', 'mean'), help='Statistic to compare.')  # noqa: E501
+parser.add_argument('-t', '--threshold', default=0.1, type=float, help='Relative slowdown to flag as regression.')  # noqa: E501
+parser.add_argument('baseline', type=Path, help='Report of baseline run.')
+parser.add_argument('candidate', type=Path, help='Report of candidate run.')
+
+
+if __name__ == '__main__':
+    args = parser.parse_args()
+    if compare(args.baseline, args.candidate, args.stat, args.threshold):
+        exit(1)
@@ -0,0 +1,56 @@
+#   encoding: utf8
+#   filename: conftest.py
+
+from json import dumps
+from random import Random
+
+import pytest
+
+# Number of lines in documents and number of items in completion lists which
+# approximate small, medium and large messages and documents.
+DOCUMENT_SIZES = (100, 1_000, 10_000)
+
+MESSAGE_SIZES = (10, 100, 1_000)
+
+
+def make_text(num_lines: int, seed: int = 42) -> str:
+    """Function make_text generates source-like text of a given number of
+    lines with realistic line lengths and indentation.
+    """
+    rng = Random(seed)
+    words = ['self', 'return', 'value', 'index', 'document', 'for', 'in',
+             'if', 'None', 'len', 'range', 'append', 'result', 'text']
+    lines = []
+    for _ in range(num_lines):
+        indent = ' ' * 4 * rng.randrange(4)
+        tokens = rng.choices(words, k=rng.randrange(1, 12))
+        lines.append(indent + ' '.join(tokens))
+    return '\n'.join(lines) + '\n'
+
+
+def make_completion(num_items: int) -> dict:
+    return {
+        'jsonrpc': '2.0',
+        'id': 42,
+        'result': [{'label': f'identifier_{i}', 'kind': 6}
+                   for i in range(num_items)],
+    }
+
+
+def make_frame(content: bytes) -> bytes:
+    return b'Content-Length: %d\r\n\r\n' % len(content) + content
+
+
+@pytest.fixture(params=DOCUMENT_SIZES, ids=lambda x: f'{x}-lines')
+def text(request) -> str:
+    return make_text(request.param)
+
+
+@pytest.fixture(params=MESSAGE_SIZES, ids=lambda x: f'{x}-items')
+def packet(request) -> dict:
+    return make_completion(request.param)
+
+
+@pytest.fixture
+def content(packet) -> bytes:
+    return dumps(packet).encode('utf-8')
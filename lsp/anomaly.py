@@ -0,0 +1,191 @@
+#   encoding: utf8
+#   filename: anomaly.py
+"""Model-based anomaly diagnostics. Every token of a block is scored in a
+single forward pass instead of one masked pass per token. Either a
+discriminator of replaced token detection (ELECTRA) predicts whether a token
+was replaced or a masked language model estimates pseudo-likelihood of
+observed tokens without masking (an upper bound of pseudo-log-likelihood
+which is still low for implausible tokens).
+"""
+
+import logging
+
+import torch as T
+
+from collections import OrderedDict
+from re import compile as compile_regex
+from threading import Lock
+from time import perf_counter, perf_counter_ns
+from typing import Dict, Iterable, List, Optional, Set, Tuple
+
+from .background import checkpoint
+from .corpus import positions
+from .diagnostics import Finding
+from .lsp.metrics import stage
+
+__all__ = ('AnomalyDetector', 'MODES', 'merge_spans')
+
+
+MODES = ('discriminator', 'mlm')
+
+WORD_REGEX = compile_regex(r'\w+')
+
+# Token ids and offsets of tokens of a window of a block.
+Window = Tuple[List[int], List[Tuple[int, int]]]
+
+# Default thresholds on probability that a token is replaced (discriminator)
+# and on probability of observed token (masked language model).
+THRESHOLDS = {
+    'discriminator': 0.5,
+    'mlm': 1e-4,
+}
+
+
+def merge_spans(text: str, spans: Iterable[Tuple[int, int]]
+                ) -> List[Tuple[int, int]]:
+    """Function merge_spans expands spans of subword tokens to enclosing
+    words and deduplicates them. Punctuation and whitespaces are not reported.
+    It returns sorted pairs of offset and length.
+    """
+    words: Set[Tuple[int, int]] = set()
+    for begin, end in spans:
+        if begin >= end:
+            continue
+        while begin > 0 and is_word_char(text[begin - 1]):
+            begin -= 1
+        while end < len(text) and is_word_char(text[end]):
+            end += 1
+        for match in WORD_REGEX.finditer(text, begin, end):
+            words.add((match.start(), match.end() - match.start()))
+    return sorted(words)
+
+
+def is_word_char(ch: str) -> bool:
+    return ch.isalnum() or ch == '_'
+
+
+class AnomalyDetector:
+    """Class AnomalyDetector flags suspicious tokens (likely typos or bugs)
+    of blocks of text. Blocks are tokenized and scored in batches. Blocks
+    longer than model context are split into overlapping windows.
+
+    :param tokenizer: HuggingFace fast tokenizer (offsets are required).
+    :param model: ELECTRA discriminator or masked language model.
+    :param mode: Either discriminator or mlm.
+    :param threshold: Probability threshold (see THRESHOLDS).
+    :param max_length: Maximal number of tokens in a window.
+    :param batch_size: Maximal number of windows in a forward pass.
+    :param cache_size: Maximal number of blocks with cached tokenization.
+    """
+
+    def __init__(self, tokenizer, model, mode: str = 'mlm',
+                 threshold: Optional[float] = None, max_length: int = 256,
+                 batch_size: int = 16, cache_size: int = 4096):
+        if mode not in MODES:
+            raise ValueError(f'Unknown anomaly detection mode: {mode}.')
+        self.tokenizer = tokenizer
+        self.model = model
+        self.mode = mode
+        self.threshold = THRESHOLDS[mode] if threshold is None else threshold
+        self.max_length = max_length
+        self.batch_size = batch_size
+        self.cache_size = cache_size
+        self.cache: OrderedDict = OrderedDict()
+        self.lock = Lock()
+        self.histogram = stage('anomaly_forward')
+        self.model.eval()
+
+    def __str__(self) -> str:
+        return (f'AnomalyDetector(mode={self.mode}, '
+                f'threshold={self.threshold})')
+
+    def __call__(self, blocks: List[str]) -> List[List[Finding]]:
+        started_at = perf_counter()
+        windows, offsets = [], []
+        for index, block_windows in enumerate(self.tokenize(blocks)):
+            for window_ids, window_offsets in block_windows:
+                windows.append((index, window_ids))
+                offsets.append(window_offsets)
+
+        flags = []
+        with T.inference_mode():
+            for begin in range(0, len(windows), self.batch_size):
+                checkpoint()
+                batch = self.tokenizer.pad(
+                    {'input_ids': [window_ids for _, window_ids
+                                   in windows[begin:begin + self.batch_size]]},
+                    return_tensors='pt')
+                scored_at = perf_counter_ns()
+                flags.extend(self.score(batch).tolist())
+                self.histogram.since(scored_at)
+
+        spans: List[List[Tuple[int, int]]] = [[] for _ in blocks]
+        for (index, _), row_offsets, row_flags in zip(windows, offsets, flags):
+            # Special tokens have empty offsets so they are skipped on merge.
+            # Padding is beyond offsets of a window.
+            spans[index].extend(offset for offset, flag
+                                 in zip(row_offsets, row_flags) if flag)
+
+        result = []
+        for block, block_spans in zip(blocks, spans):
+            words = merge_spans(block, block_spans)
+            locations = positions(block, (offset for offset, _ in words))
+            findings = []
+            for (offset, length), (line, char) in zip(words, locations):
+                word = block[offset:offset + length]
+                findings.append((line, char, length, 4,
+                                 f'Unexpected word: {word}.'))
+            result.append(findings)
+        logging.info('score %d blocks (%d windows) for anomalies in %.1f ms',
+                     len(blocks), len(windows),
+                     (perf_counter() - started_at) * 1e3)
+        return result
+
+    def tokenize(self, blocks: List[str]) -> List[List[Window]]:
+        """Method tokenize returns windows of blocks as pairs of token ids and
+        offsets of tokens. Windows are cached by block hash (as results of
+        diagnostics are) and blocks missed by cache are tokenized together.
+        """
+        result: List[Optional[List[Window]]] = []
+        missed: Dict[int, str] = {}
+        with self.lock:
+            for block in blocks:
+                if (windows := self.cache.get(hash(block))) is not None:
+                    self.cache.move_to_end(hash(block))
+                else:
+                    missed[hash(block)] = block
+                result.append(windows)
+        if not missed:
+            return result
+
+        inputs = self.tokenizer(list(missed.values()), truncation=True,
+                                max_length=self.max_length,
+                                stride=self.max_length // 8,
+                                return_overflowing_tokens=True,
+                                return_offsets_mapping=True)
+        tokenized: Dict[int, List[Window]] = {key: [] for key in missed}
+        keys = list(missed)
+        for index, window_ids, window_offsets in zip(
+                inputs['overflow_to_sample_mapping'], inputs['input_ids'],
+                inputs['offset_mapping']):
+            tokenized[keys[index]].append((window_ids, window_offsets))
+
+        with self.lock:
+            for key, windows in tokenized.items():
+                self.cache[key] = windows
+            while len(self.cache) > self.cache_size:
+                self.cache.popitem(last=False)
+        return [windows if windows is not None else tokenized[hash(block)]
+                for windows, block in zip(result, blocks)]
+
+    def score(self, inputs) -> T.Tensor:
+        """Method score returns boolean mask of suspicious tokens.
+        """
+        logits = self.model(**inputs).logits
+        if self.mode == 'discriminator':
+            return logits.sigmoid() > self.threshold
+        # Probability of observed token is estimated without masking.
+        input_ids = inputs['input_ids']
+        logprobs = logits.log_softmax(-1)
+        observed = logprobs.gather(-1, input_ids.unsqueeze(-1)).squeeze(-1)
+        return observed.exp() < self.threshold
@@ -3,15 +3,40 @@
 
 import logging
 
+from hashlib import blake2b
 from io import StringIO
 from json import dump
-from os import getppid
+from os import getpid, getppid
+from pathlib import Path
+from re import escape as escape_regex, search as search_regex
+from signal import SIGUSR1, signal
 from string import ascii_letters
-
-from .completion import AbstractCompletor, make_completor_loader
-from .corpus import Corpus
+from tempfile import gettempdir
+from threading import Event, Thread
+from time import perf_counter, perf_counter_ns, time
+from typing import List, Optional
+
+from .anomaly import AnomalyDetector
+from .background import BackgroundExecutor
+from .collector import IdleCollector, watch_pauses
+from .completion import (AbstractCompletor, load_pretrained,
+                         make_completor_loader)
+from .corpus import Corpus, Document, utf16_length
+from .diagnostics import Diagnostics
 from .lsp import Addr, ErrorCode, LSPError
-from .lsp.syncio import LanguageServerProtocol, Server
+from .lsp.metrics import REGISTRY, MetricsServer, stage
+from .lsp.syncio import (Base, LanguageServerProtocol, Server, protocol,
+                         request)
+from .lsp.syncio.record import Recorder
+from .lsp.trace import TRACER
+from .memory import MemoryAccountant
+from .profiler import SamplingProfiler
+from .retrieval import WorkspaceIndex, uri_to_path
+from .rules import RuleEngine
+from .semantic import SemanticIndex
+from .spelling import SpellChecker
+from .symbols import KIND_VARIABLE
+from .thesaurus import Thesaurus
 from .version import version
 
 
@@ -19,6 +44,24 @@ __all__ = (
     'Application',
 )
 
+# Default path templates of trace dumps and profiles.
+TRACE_OUTPUT = str(Path(gettempdir()) / 'lsp-lm-trace-{pid}-{time}.json')
+PROFILE_OUTPUT = str(Path(gettempdir()) /
+                     'lsp-lm-profile-{pid}-{time}.folded')
+
+# Age of memory report (in seconds) after which it is refreshed on request.
+MEMORY_REPORT_TTL = 10.0
+
+
+def dump_trace(output: Optional[str] = None) -> dict:
+    """Function dump_trace writes buffered trace events to a file. Path
+    template could refer to pid and Unix time.
+    """
+    path = (output or TRACE_OUTPUT).format(pid=getpid(), time=int(time()))
+    num_events = TRACER.dump(path)
+    logging.info('dump %d trace events to %s', num_events, path)
+    return {'path': path, 'events': num_events}
+
 
 def format_initialize_params(params):
     sio = StringIO()
@@ -32,12 +75,12 @@ def format_initialize_params(params):
     rootPath = params.get('rootPath')
     rootUri = params.get('rootUri', rootPath)
     print('Root URI:              ', rootUri, file=sio)
-    folders = params.get('WorkspaceFolder', [])
+    folders = params.get('workspaceFolders') or []
     print('Workspace Folders:', file=sio)
     for i, folder in enumerate(folders, 1):
         uri = folder.get('uri')
         name = folder.get('name')
-        print(f'[{i}:2d] {name} -> {uri}', file=sio)
+        print(f'[{i:2d}] {name} -> {uri}', file=sio)
     print('Initialization Options:', end=' ', file=sio)
     if (opts := params.get('initializationOptions')) is None:
         print(file=sio)
@@ -63,18 +106,68 @@ def format_initialize_params(params):
     return sio.getvalue()
 
 
-class CompletionProtocol(LanguageServerProtocol):
+def search_word(word: str, text: str):
+    return search_regex(rf'\b{escape_regex(word)}\b', text)
+
+
+@protocol('lsp-lm')
+class ExtensionProtocol(Base):
+    """Class ExtensionProtocol declares custom requests of the server which
+    are not part of LSP.
+    """
+
+    @request
+    def memory(self, *args, **kwargs):
+        raise NotImplementedError
+
+
+class CompletionProtocol(LanguageServerProtocol, ExtensionProtocol):
     """Class CompletionProtocol implements minimal values part of LSP to
     provide completion. It loads models and initialises document manager on
     initialize() request and maintains its internal state.
     """
 
-    def __init__(self, completor_loader, session):
+    def __init__(self, completor_loader, session, ir_opts=None,
+                 diag_opts=None, syntax_aware=False,
+                 background: Optional[BackgroundExecutor] = None,
+                 telemetry_interval: float = 0.0,
+                 trace_output: Optional[str] = None,
+                 profiler: Optional[SamplingProfiler] = None,
+                 accountant: Optional[MemoryAccountant] = None,
+                 collector: Optional[IdleCollector] = None):
         super().__init__()
 
         self.completor: AbstractCompletor
         self.completor_loader = completor_loader
         self.session = session
+        self.ir_opts = ir_opts or {}
+        self.diag_opts = diag_opts or {}
+        self.syntax_aware = syntax_aware
+        self.background = background or BackgroundExecutor()
+        self.index: Optional[WorkspaceIndex] = None
+        self.semantic: Optional[SemanticIndex] = None
+        self.thesaurus: Optional[Thesaurus] = None
+        self.speller: Optional[SpellChecker] = None
+        self.detector: Optional[AnomalyDetector] = None
+        self.rules: Optional[RuleEngine] = None
+        self.diagnostics: Optional[Diagnostics] = None
+        self.capabilities = {}
+        self.telemetry_interval = telemetry_interval
+        self.telemetry_stopped = Event()
+        self.trace_output = trace_output
+        self.profiler = profiler or SamplingProfiler()
+        self.accountant = accountant or MemoryAccountant()
+        self.collector = collector
+        self.memory_subsystems = []
+        self.commands = {
+            'lsp-lm.profile.start': self.start_profiling,
+            'lsp-lm.profile.stop': self.stop_profiling,
+            'lsp-lm.trace.start': self.start_tracing,
+            'lsp-lm.trace.stop': self.stop_tracing,
+            'lsp-lm.trace.dump': self.dump_trace,
+        }
+        self.retrieve_histogram = stage('retrieve')
+        self.semantic_histogram = stage('semantic')
 
     def watch_pid(self, pid: int):
         logging.info('watch for process with pid %d', pid)
@@ -85,7 +178,8 @@ class CompletionProtocol(LanguageServerProtocol):
                      format_initialize_params(params))
 
         logging.info('instantiate corpus manager')
-        self.corpus = Corpus()
+        self.corpus = Corpus(self.syntax_aware)
+        self.capabilities = params.get('capabilities') or {}
 
         logging.info('instantiate completor')
         try:
@@ -94,6 +188,48 @@ class CompletionProtocol(LanguageServerProtocol):
             logging.exception('failed to load completor')
             raise LSPError(ErrorCode.InternalError, 'completor loading error')
 
+        if (path := self.ir_opts.get('thesaurus')):
+            logging.info('load thesaurus from %s', path)
+            self.thesaurus = Thesaurus(path)
+            logging.info('thesaurus is loaded: %s', self.thesaurus)
+
+        if self.ir_opts.get('enabled') or self.ir_opts.get('semantic'):
+            self.start_indexing(params)
+
+        if (path := self.diag_opts.get('dictionary')):
+            logging.info('load spelling dictionary from %s', path)
+            self.speller = SpellChecker(path, self.is_identifier)
+            logging.info('spelling dictionary is loaded: %s', self.speller)
+
+        if (path := self.diag_opts.get('rules')):
+            logging.info('load rule pack from %s', path)
+            self.rules = RuleEngine(path)
+            logging.info('rule pack is loaded: %s', self.rules)
+
+        if (mode := self.diag_opts.get('anomaly')):
+            self.detector = self.load_detector(mode)
+            logging.info('anomaly detector is loaded: %s', self.detector)
+
+        if self.speller or self.rules or self.detector:
+            self.diagnostics = Diagnostics(self.publish_diagnostics,
+                                           self.diag_opts.get('delay', 0.2),
+                                           executor=self.background)
+        if self.speller is not None:
+            self.diagnostics.add_check('spelling', self.speller.diagnose)
+        if self.rules is not None:
+            self.diagnostics.add_check('grammar', self.rules.diagnose)
+        if self.detector is not None:
+            self.diagnostics.add_check('anomaly', self.detector, batched=True)
+
+        self.register_memory()
+
+        # Objects which survive loading and warmup live until exit, so they
+        # are frozen in order to exclude them from collections. It is done on
+        # initialization of the first session only.
+        if self.collector is not None and not self.collector.frozen:
+            self.warmup()
+            self.collector.freeze()
+
         pid = params.get('processId')
         if pid and not isinstance(pid, int):
             raise LSPError(ErrorCode.InvalidParams)
@@ -102,16 +238,26 @@ class CompletionProtocol(LanguageServerProtocol):
 
         return {
             'capabilities': {
+                # Columns are in UTF-16 code units which every client
+                # supports (see Document.offset).
+                'positionEncoding': 'utf-16',
                 'textDocumentSync': {
                     'change': 2,
                     'openClose': True,
                     'save': True,
                 },
+                'codeActionProvider': bool(self.speller or self.rules),
                 'completionProvider': {
                     'triggerCharacters': list(ascii_letters.split()),
                     'allCommitCharacters': list(' !?:;,.'),
                     'resolveProvider': False,
                 },
+                'definitionProvider': self.thesaurus is not None,
+                'executeCommandProvider': {
+                    'commands': sorted(self.commands),
+                },
+                'hoverProvider': self.thesaurus is not None,
+                'workspaceSymbolProvider': self.index is not None,
             },
             'serverInfo': {
                 'name': 'lsp-lm',
@@ -119,28 +265,403 @@ class CompletionProtocol(LanguageServerProtocol):
             },
         }
 
+    def warmup(self):
+        """Method warmup runs completion on a synthetic document so that
+        lazy initialisation of completor is done before heap is frozen.
+        """
+        started_at = perf_counter()
+        try:
+            doc = Document('def main():\n    return ')
+            self.completor.complete(doc, 1, 11)
+        except Exception:
+            logging.exception('failed to warm up completor')
+            return
+        logging.info('warm up completor in %.1f ms',
+                     (perf_counter() - started_at) * 1e3)
+
+    def register_memory(self):
+        """Method register_memory registers subsystems of a session in memory
+        accountant. Models go first since their weights are also reachable
+        from semantic index and anomaly detector.
+        """
+        self.memory_subsystems = [
+            self.accountant.register('models', lambda: [
+                self.completor, self.detector,
+            ]),
+            self.accountant.register('caches', lambda: [
+                getattr(self.diagnostics, 'cache', None),
+                getattr(self.speller, 'cache', None),
+            ], self.evict_caches),
+            self.accountant.register('documents', lambda: [self.corpus]),
+            self.accountant.register('indexes', lambda: [
+                self.index, self.semantic, self.thesaurus,
+            ]),
+            self.accountant.register('dictionaries', lambda: [
+                self.speller, self.rules,
+            ]),
+        ]
+
+    def evict_caches(self, nbytes: int) -> int:
+        released = 0
+        if self.diagnostics is not None:
+            released += self.diagnostics.evict(nbytes)
+        if self.speller is not None and released < nbytes:
+            released += self.speller.evict(nbytes - released)
+        return released
+
+    def load_detector(self, mode: str) -> Optional[AnomalyDetector]:
+        if mode == 'discriminator':
+            if (path := self.diag_opts.get('anomaly_model')) is None:
+                logging.warning('anomaly detection with discriminator '
+                                'requires path to model')
+                return None
+            logging.info('load discriminator from %s', path)
+            tokenizer, model = load_pretrained(path)
+        elif (model := getattr(self.completor, 'model', None)) is not None:
+            tokenizer = self.completor.tokenizer
+        else:
+            logging.warning('anomaly detection with mlm requires hf model')
+            return None
+        return AnomalyDetector(tokenizer, model, mode,
+                               self.diag_opts.get('anomaly_threshold'))
+
+    def start_indexing(self, params):
+        # Workspace folders supersede root URI if client supports them.
+        uris = [folder.get('uri')
+                for folder in params.get('workspaceFolders') or []]
+        if not uris:
+            uris = [params.get('rootUri') or params.get('rootPath')]
+        roots = []
+        for uri in uris:
+            if (root := uri_to_path(uri)) is None or not root.is_dir():
+                logging.warning('no workspace folder to index: %s', uri)
+            elif root not in roots:
+                roots.append(root)
+        if not roots:
+            return
+
+        # Index is cached in a directory keyed by workspace folders.
+        cache_path = None
+        if (cache_dir := self.ir_opts.get('cache_dir')):
+            key = blake2b(digest_size=8)
+            for root in sorted(roots):
+                key.update(root.as_uri().encode('utf-8') + b'\0')
+            cache_path = Path(cache_dir) / key.hexdigest() / 'index.bin'
+
+        logging.info('instantiate workspace index')
+        self.index = WorkspaceIndex(self.ir_opts.get('num_results', 3),
+                                    cache_path=cache_path)
+
+        # Semantic index requires embeddings of language model.
+        pooling = self.ir_opts.get('semantic')
+        if pooling and (model := getattr(self.completor, 'model', None)):
+            logging.info('instantiate semantic index')
+            self.semantic = SemanticIndex(
+                self.completor.tokenizer, model, pooling,
+                cache_path and cache_path.with_name('semantic.bin'))
+        elif pooling:
+            logging.warning('semantic completion requires hf model')
+
+        # Executor is shared by sessions, so a build of another session
+        # must not replace this one.
+        self.background.submit(self.build_indexes, roots,
+                               key=('index', id(self)))
+
+    def build_indexes(self, roots: List[Path]):
+        self.index.build(roots)
+        if self.semantic is not None:
+            terms = self.index.symbols.vocabulary(self.semantic.max_terms)
+            self.semantic.build(terms)
+
+    def is_identifier(self, word: str) -> bool:
+        return self.index is not None and word in self.index.symbols
+
+    def retrieve(self, uri: str, line: int, char: int) -> List[str]:
+        if self.index is None or not self.ir_opts.get('enabled'):
+            return []
+        started_at = perf_counter_ns()
+        doc = self.corpus.get(uri)
+        query = ''.join(doc.window(line, char))
+        snippets = self.index.search(query, exclude=uri)
+        logging.info('retrieve %d snippets from workspace', len(snippets))
+        result = [self.index.fetch(snippet, self.corpus)
+                  for snippet in snippets]
+        self.retrieve_histogram.since(started_at)
+        return result
+
     def initialized(self, params):
         logging.info('handle initialized() notification')
+        if self.telemetry_interval > 0:
+            logging.info('send telemetry every %.1f s',
+                         self.telemetry_interval)
+            Thread(target=self.report_telemetry, daemon=True,
+                   name='[lsp] telemetry').start()
+
+        if self.index is None:
+            return
+
+        # Ask client to watch workspace files in order to keep index in sync
+        # with filesystem.
+        caps = self.capabilities.get('workspace', {})
+        if caps.get('didChangeWatchedFiles', {}).get('dynamicRegistration'):
+            logging.info('register watcher for workspace files')
+            self.session.request('client/registerCapability', {
+                'registrations': [{
+                    'id': 'lsp-lm/watched-files',
+                    'method': 'workspace/didChangeWatchedFiles',
+                    'registerOptions': {
+                        'watchers': [{'globPattern': '**/*'}],
+                    },
+                }],
+            })
 
     def shutdown(self, params):
         logging.info('handle shutdown() procedure call')
+        if self.index is not None:
+            self.index.save()
+        logging.info('background executor: %s', self.background)
+        self.telemetry_stopped.set()
 
     def exit(self, params):
         logging.info('handle exit() notification')
 
+    def close(self):
+        """Method close is called by session once connection is closed. It
+        unregisters subsystems of the session in process-wide accountant, so
+        that they are neither charged nor kept alive.
+        """
+        logging.info('close session')
+        self.telemetry_stopped.set()
+        self.accountant.unregister(self.memory_subsystems)
+        self.memory_subsystems = []
+
     def completion(self, params):
         logging.info('handle completion() procedure call')
         uri = params['textDocument']['uri']
         line = params['position']['line']
         char = params['position']['character']
 
-        logging.info('complete at %d:%d for document %s', line, char, uri)
-        doc = self.corpus.get(uri)
-        labels = []
-        for item in self.completor.complete(doc, line, char):
-            labels.append({'label': item})
+        # Background tasks yield to completion until it is served.
+        with self.background.interactive():
+            logging.info('complete at %d:%d for document %s', line, char, uri)
+            doc = self.corpus.get(uri)
+            snippets = self.retrieve(uri, line, char)
+            labels = []
+            for item in self.completor.complete(doc, line, char, snippets):
+                labels.append({'label': item})
+
+            # Semantically related workspace identifiers follow predictions of
+            # language model.
+            if self.semantic is not None:
+                started_at = perf_counter_ns()
+                items = self.semantic.suggest(doc, line, char)
+                self.semantic_histogram.since(started_at)
+                logging.info('suggest %d related identifiers in %.1f ms',
+                             len(items),
+                             (perf_counter_ns() - started_at) / 1e6)
+                seen = {label['label'] for label in labels}
+                labels.extend({'label': item, 'kind': 6} for item in items
+                              if item not in seen)
+
+            return labels
+
+    def synonyms(self, params):
+        if self.thesaurus is None:
+            return None, []
+        uri = params['textDocument']['uri']
+        line = params['position']['line']
+        char = params['position']['character']
+        if (word := self.corpus.get(uri).word_at(line, char)) is None:
+            return None, []
+        started_at = perf_counter()
+        synonyms = self.thesaurus.neighbours(word[0])
+        logging.info('found %d synonyms of %r in %.1f ms', len(synonyms),
+                     word[0], (perf_counter() - started_at) * 1e3)
+        return word, synonyms
+
+    def hover(self, params):
+        logging.info('handle hover() procedure call')
+        word, synonyms = self.synonyms(params)
+        if not synonyms:
+            return None
+        name, begin = word
+        line = params['position']['line']
+        return {
+            'contents': {
+                'kind': 'markdown',
+                'value': f'**{name}**: ' + ', '.join(synonyms),
+            },
+            'range': {
+                'start': {'line': line, 'character': begin},
+                'end': {'line': line,
+                        'character': begin + utf16_length(name)},
+            },
+        }
 
-        return labels
+    def definition(self, params):
+        logging.info('handle definition() procedure call')
+        _, synonyms = self.synonyms(params)
+
+        # Synonyms are looked up in the current document first and then in
+        # workspace.
+        uri = params['textDocument']['uri']
+        doc = self.corpus.get(uri)
+        locations = []
+        for synonym in synonyms:
+            if (match := search_word(synonym, doc.text)):
+                line = doc.text.count('\n', 0, match.start())
+                char = doc.column(line, match.start())
+                locations.append((uri, line, char, synonym))
+            elif self.index is not None:
+                locations.extend((*location[:3], synonym) for location in
+                                 self.index.symbols.find(synonym)[:1])
+
+        result = []
+        for uri, line, char, synonym in locations:
+            result.append({
+                'uri': uri,
+                'range': {
+                    'start': {'line': line, 'character': char},
+                    'end': {'line': line,
+                            'character': char + utf16_length(synonym)},
+                },
+            })
+        return result
+
+    def publish_diagnostics(self, uri: str, diagnostics):
+        self.session.notify('textDocument/publishDiagnostics', {
+            'uri': uri,
+            'diagnostics': diagnostics,
+        })
+
+    def event(self, params):
+        # Telemetry flows from server to client, so events which a client
+        # sends are ignored.
+        logging.info('ignore telemetry event from client')
+
+    def send_telemetry(self, params):
+        self.session.notify('telemetry/event', params)
+
+    def report_telemetry(self):
+        """Method report_telemetry periodically sends quantiles of stage
+        latencies and load of background executor to a client until shutdown.
+        """
+        while not self.telemetry_stopped.wait(self.telemetry_interval):
+            try:
+                self.send_telemetry({
+                    'type': 'lsp-lm/metrics',
+                    'latency': REGISTRY.summary(),
+                    'background': self.background.metrics(),
+                })
+            except (OSError, ValueError):
+                logging.info('stop telemetry: connection is closed')
+                return
+
+    def memory(self, params):
+        """Method memory returns the last memory report. Walk of object
+        graphs is too slow for a session thread, so a stale report is
+        refreshed in background and the next request gets a fresh one.
+        """
+        logging.info('handle memory() procedure call')
+        report = self.accountant.report
+        if time() - report.measured_at > MEMORY_REPORT_TTL:
+            self.background.submit(self.accountant.snapshot,
+                                   key=('memory', 'snapshot'))
+        logging.info('memory usage is below\n%s', report)
+        return report.to_dict()
+
+    def execute_command(self, params):
+        logging.info('handle execute_command() procedure call')
+        command = params.get('command')
+        if (handler := self.commands.get(command)) is None:
+            logging.warning('unknown command %s: skipping', command)
+            return None
+        try:
+            return handler(*(params.get('arguments') or ()))
+        except (TypeError, ValueError) as exc:
+            raise LSPError(ErrorCode.InvalidParams,
+                           f'Wrong arguments of command {command}: {exc}')
+
+    def start_profiling(self, interval: Optional[float] = None):
+        """Method start_profiling starts sampling of stacks of all threads
+        every interval milliseconds.
+        """
+        if self.profiler.running:
+            logging.warning('profiler is already running')
+            return {'running': True}
+        if interval is not None:
+            # Non-positive interval makes sampler spin.
+            if not isinstance(interval, (int, float)) or not interval > 0:
+                raise ValueError(f'Sampling interval should be a positive '
+                                 f'number: {interval!r}.')
+            self.profiler.interval = interval / 1e3
+        self.profiler.start()
+        logging.info('start profiling: %s', self.profiler)
+        return {'running': True}
+
+    def stop_profiling(self, output: Optional[str] = None):
+        """Method stop_profiling stops sampling and writes collapsed stacks
+        to a file (see flamegraph.pl).
+        """
+        if not self.profiler.running:
+            logging.warning('profiler is not running')
+            return None
+        self.profiler.stop()
+        path = (output or PROFILE_OUTPUT).format(pid=getpid(),
+                                                 time=int(time()))
+        num_stacks = self.profiler.dump(path)
+        logging.info('write profile to %s: %s', path, self.profiler)
+        return {'path': path, 'samples': self.profiler.num_samples,
+                'stacks': num_stacks}
+
+    def start_tracing(self, capacity: Optional[int] = None):
+        TRACER.start(capacity)
+        logging.info('start tracing: %s', TRACER)
+        return {'enabled': True}
+
+    def stop_tracing(self):
+        TRACER.stop()
+        logging.info('stop tracing: %s', TRACER)
+        return {'enabled': False}
+
+    def dump_trace(self, output: Optional[str] = None):
+        return dump_trace(output or self.trace_output)
+
+    def code_action(self, params):
+        logging.info('handle code_action() procedure call')
+        suggesters = {}
+        if self.speller is not None:
+            suggesters['spelling'] = self.speller.suggest
+        if self.rules is not None:
+            suggesters['grammar'] = self.rules.suggest
+
+        # Corrections are suggested only on demand since suggestion is much
+        # more expensive than check.
+        uri = params['textDocument']['uri']
+        doc = self.corpus.get(uri)
+        actions = []
+        for diagnostic in params.get('context', {}).get('diagnostics', []):
+            if (suggest := suggesters.get(diagnostic.get('code'))) is None:
+                continue
+            range_ = diagnostic['range']
+            begin = doc.offset(range_['start']['line'],
+                               range_['start']['character'])
+            end = doc.offset(range_['end']['line'],
+                             range_['end']['character'])
+            if begin is None or end is None:
+                continue
+            for suggestion in suggest(doc.text[begin:end]):
+                actions.append({
+                    'title': f'Replace with {suggestion}',
+                    'kind': 'quickfix',
+                    'diagnostics': [diagnostic],
+                    'edit': {
+                        'changes': {
+                            uri: [{'range': range_, 'newText': suggestion}],
+                        },
+                    },
+                })
+        return actions
 
     def did_change(self, params):
         logging.info('handle did_change() notification')
@@ -149,21 +670,90 @@ class CompletionProtocol(LanguageServerProtocol):
         changes = params['contentChanges']
         logging.info('apply %d changes to %s:%d', len(changes), uri, ver)
         for change in changes:
-            if change.get('range'):
-                logging.warning('lsp does not support incremental changes')
-            else:
+            if (range_ := change.get('range')) is None:
                 self.corpus.set(uri, change['text'])
+                continue
+            try:
+                self.corpus.apply(uri, range_, change['text'])
+            except (KeyError, TypeError, ValueError):
+                # Changes are relative to each other, so the rest of them
+                # is skipped. Session goes on with text of the last change.
+                logging.exception('failed to apply change to %s:%d: %s',
+                                  uri, ver, range_)
+                break
+        # Reindexing of a large document takes a while, so it is done in
+        # background and only the latest version is indexed.
+        if self.index is not None:
+            self.background.submit(self.index.update, uri,
+                                   self.corpus.get(uri).text, version=ver,
+                                   key=('index', id(self), uri))
+        if self.diagnostics is not None:
+            self.diagnostics.update(uri, self.corpus.get(uri).text)
+
+    def did_change_watched_files(self, params):
+        logging.info('handle did_change_watched_files() notification')
+        if self.index is None:
+            return
+        # Checkout of a branch changes thousands of files, so they are
+        # reindexed in background. A queued update of a file is replaced
+        # by the latest change.
+        for change in params.get('changes', []):
+            uri = change['uri']
+            if uri in self.corpus.docs:
+                continue  # Opened documents are indexed from editor buffer.
+            elif change['type'] == 3:  # Deleted.
+                self.background.submit(self.index.remove, uri,
+                                       key=('index', id(self), uri))
+            else:  # Created or changed.
+                self.background.submit(self.index.update_file, uri,
+                                       key=('index', id(self), uri))
 
     def did_close(self, params):
         logging.info('handle did_close() notification')
+        if self.diagnostics is not None:
+            self.diagnostics.close(params['textDocument']['uri'])
 
     def did_open(self, params):
         logging.info('handle did_open() notification')
         self.corpus.open(params['textDocument']['uri'],
-                         params['textDocument']['text'])
+                         params['textDocument']['text'],
+                         params['textDocument'].get('languageId'))
+        if self.diagnostics is not None:
+            self.diagnostics.update(params['textDocument']['uri'],
+                                    params['textDocument']['text'],
+                                    debounce=False)
 
     def did_save(self, params):
         logging.info('handle did_save() notification')
+        uri = params['textDocument']['uri']
+        if self.index is not None:
+            self.background.submit(self.index.update_file, uri,
+                                   key=('index', id(self), uri))
+
+    def symbol(self, params):
+        logging.info('handle symbol() procedure call')
+        if self.index is None:
+            return []
+
+        started_at = perf_counter()
+        query = params.get('query', '')
+        matches = self.index.symbols.search(query)
+        logging.info('found %d symbols for query %r in %.1f ms',
+                     len(matches), query, (perf_counter() - started_at) * 1e3)
+
+        symbols = []
+        for name, _, uri, line, char, kind in matches:
+            position = {'line': line, 'character': char}
+            end = {'line': line, 'character': char + len(name)}
+            symbols.append({
+                'name': name,
+                'kind': kind or KIND_VARIABLE,
+                'location': {
+                    'uri': uri,
+                    'range': {'start': position, 'end': end},
+                },
+            })
+        return symbols
 
 
 class Application:
@@ -171,14 +761,100 @@ class Application:
     ownership tree for any runtime resource.
     """
 
-    def __init__(self, addr: Addr, tls_context, ir_opts, lm_opts):
+    def __init__(self, addr: Addr, tls_context, ir_opts, lm_opts,
+                 diag_opts=None, bg_opts=None, rec_opts=None,
+                 metrics_opts=None, trace_opts=None, mem_opts=None,
+                 gc_opts=None):
         self.ir_opts = ir_opts
         self.lm_opts = lm_opts
+        self.diag_opts = diag_opts or {}
+        self.bg_opts = bg_opts or {}
+        self.background = BackgroundExecutor(**self.bg_opts)
+        logging.info('start background executor: %s', self.background)
         self.loader = make_completor_loader(self.lm_opts)
-        self.server = Server(addr, self.make_protocol, tls_context)
+        self.rec_opts = rec_opts or {}
+        self.recorder: Optional[Recorder] = None
+        if (path := self.rec_opts.get('path')):
+            logging.info('record traffic to %s', path)
+            anonymise = self.rec_opts.get('anonymise', False)
+            self.recorder = Recorder(path, anonymise)
+        self.metrics_opts = metrics_opts or {}
+        self.metrics: Optional[MetricsServer] = None
+        REGISTRY.gauge('lsp_background', self.background.metrics,
+                       'Load of background executor.')
+        if (metrics_addr := self.metrics_opts.get('addr')):
+            self.metrics = MetricsServer(metrics_addr, REGISTRY)
+            logging.info('serve metrics on %s', metrics_addr)
+        self.trace_opts = trace_opts or {}
+        if self.trace_opts.get('enabled'):
+            TRACER.start(self.trace_opts.get('capacity'))
+            logging.info('start tracing: %s', TRACER)
+        signal(SIGUSR1, self.on_dump_trace)
+        self.profiler = SamplingProfiler()
+        self.mem_opts = mem_opts or {}
+        self.accountant = MemoryAccountant(self.mem_opts.get('budgets'),
+                                           self.mem_opts.get('high_water'))
+        self.accountant_stopped = Event()
+        REGISTRY.gauge('lsp_memory', self.accountant.metrics,
+                       'Memory held by subsystems and process (bytes).')
+        self.gc_opts = gc_opts or {}
+        self.collector: Optional[IdleCollector] = None
+        watch_pauses()
+        if self.gc_opts.get('freeze'):
+            self.collector = IdleCollector(self.background,
+                                           self.gc_opts.get('interval', 1.0),
+                                           self.gc_opts.get('full_interval',
+                                                            300.0))
+        self.server = Server(addr, self.make_protocol, tls_context,
+                             self.recorder)
+
+    def on_dump_trace(self, signum, frame):
+        # Signal handler interrupts main thread which serves a session, so
+        # dumping is done in a separate thread.
+        Thread(target=dump_trace, args=(self.trace_opts.get('output'), ),
+               daemon=True, name='[lsp] trace').start()
 
     def make_protocol(self, *args, **kwargs):
-        return CompletionProtocol(self.loader, *args, **kwargs)
+        syntax_aware = self.lm_opts.get('syntax_aware', False)
+        interval = self.metrics_opts.get('telemetry_interval', 0.0)
+        return CompletionProtocol(self.loader, *args, ir_opts=self.ir_opts,
+                                  diag_opts=self.diag_opts,
+                                  syntax_aware=syntax_aware,
+                                  background=self.background,
+                                  telemetry_interval=interval,
+                                  trace_output=self.trace_opts.get('output'),
+                                  profiler=self.profiler,
+                                  accountant=self.accountant,
+                                  collector=self.collector, **kwargs)
+
+    def account_memory(self):
+        """Method account_memory periodically measures memory in background
+        with low priority and enforces budgets.
+        """
+        interval = self.mem_opts['interval']
+        while not self.accountant_stopped.wait(interval):
+            self.background.submit(self.accountant.enforce, key='memory')
 
     def run(self):
-        return self.server.start()
+        if self.metrics is not None:
+            self.metrics.start()
+        if self.mem_opts.get('interval', 0) > 0:
+            logging.info('account memory every %.1f s: %s',
+                         self.mem_opts['interval'], self.accountant)
+            Thread(target=self.account_memory, daemon=True,
+                   name='[lsp] memory').start()
+        if self.collector is not None:
+            logging.info('collect garbage only while idle: %s',
+                         self.collector)
+            self.collector.start()
+        try:
+            return self.server.start()
+        finally:
+            self.accountant_stopped.set()
+            if self.collector is not None:
+                self.collector.stop()
+            if self.metrics is not None:
+                self.metrics.stop()
+            if self.recorder is not None:
+                logging.info('close traffic log: %s', self.recorder)
+                self.recorder.close()
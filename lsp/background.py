@@ -0,0 +1,219 @@
+#   encoding: utf8
+#   filename: background.py
+"""Background executor for non-interactive work (diagnostics, indexing, cache
+warming). Tasks run in low priority threads. Since Python threads share
+interpreter lock, OS priority is not enough to keep completion latency low,
+so tasks yield cooperatively: they call checkpoint() between units of work
+and checkpoint blocks while interactive requests are in flight and throttles
+a task which exceeds its share of CPU.
+"""
+
+import logging
+
+from collections import deque
+from concurrent.futures import Future
+from contextlib import contextmanager
+from dataclasses import dataclass, field
+from threading import Condition, Thread, local
+from time import perf_counter, perf_counter_ns, sleep, thread_time
+from typing import Any, Callable, Deque, Dict, Hashable, Optional, Tuple
+
+from .crawler import lower_priority
+from .lsp.metrics import stage
+
+__all__ = ('BackgroundExecutor', 'checkpoint')
+
+
+Task = Tuple[Optional[Hashable], Future, Callable[..., Any], tuple, dict,
+             int]
+
+# Worker state of a current thread: executor and CPU time and wall time of
+# the last checkpoint.
+current = local()
+
+
+def checkpoint():
+    """Function checkpoint is a cooperative yield point of background tasks.
+    It is no-op outside of background executor.
+    """
+    if (executor := getattr(current, 'executor', None)) is not None:
+        executor.checkpoint()
+
+
+@dataclass
+class ExecutorStats:
+
+    num_submitted: int = 0
+
+    num_completed: int = 0
+
+    num_failed: int = 0
+
+    num_replaced: int = 0
+
+    num_pauses: int = 0
+
+    busy_time: float = 0.0
+
+    paused_time: float = 0.0
+
+    throttled_time: float = 0.0
+
+    started_at: float = field(default_factory=perf_counter)
+
+
+class BackgroundExecutor:
+    """Class BackgroundExecutor runs background tasks in a pool of low
+    priority threads only when there is no interactive request in flight.
+
+    :param num_threads: Number of worker threads.
+    :param cpu_share: Maximal share of a CPU which a worker consumes.
+    """
+
+    def __init__(self, num_threads: int = 1, cpu_share: float = 0.5):
+        if not 0 < cpu_share <= 1:
+            raise ValueError(f'CPU share should be in (0, 1]: {cpu_share}.')
+        self.num_threads = num_threads
+        self.cpu_share = cpu_share
+        self.queue: Deque[Task] = deque()
+        self.keys: Dict[Hashable, Future] = {}
+        self.num_interactive = 0
+        self.num_running = 0
+        self.stats = ExecutorStats()
+        self.queue_histogram = stage('queue_wait')
+        self.cond = Condition()
+        self.threads = []
+        for index in range(num_threads):
+            thread = Thread(target=self.work, daemon=True,
+                            name=f'[lsp] background #{index}')
+            thread.start()
+            self.threads.append(thread)
+
+    def __str__(self) -> str:
+        metrics = self.metrics()
+        return (f'BackgroundExecutor(nothreads={self.num_threads}, '
+                f'cpu_share={self.cpu_share}, '
+                f'queue_depth={metrics["queue_depth"]}, '
+                f'utilisation={metrics["utilisation"]:.2f})')
+
+    def submit(self, fn: Callable[..., Any], *args,
+               key: Optional[Hashable] = None, **kwargs) -> Future:
+        """Method submit enqueues a task. A queued task with the same key is
+        cancelled and replaced with the new one (e.g. diagnostics of
+        outdated text of a document).
+        """
+        future: Future = Future()
+        with self.cond:
+            if key is not None and (prev := self.keys.get(key)) is not None:
+                if prev.cancel():
+                    self.stats.num_replaced += 1
+            if key is not None:
+                self.keys[key] = future
+            self.queue.append((key, future, fn, args, kwargs,
+                               perf_counter_ns()))
+            self.stats.num_submitted += 1
+            self.cond.notify()
+        return future
+
+    @contextmanager
+    def interactive(self):
+        """Method interactive marks a scope of interactive request. Background
+        tasks are not started and running ones are paused at checkpoints
+        until the scope is left.
+        """
+        with self.cond:
+            self.num_interactive += 1
+        try:
+            yield
+        finally:
+            with self.cond:
+                self.num_interactive -= 1
+                if not self.num_interactive:
+                    self.cond.notify_all()
+
+    def checkpoint(self):
+        # Pause while there are interactive requests in flight.
+        if self.num_interactive:
+            started_at = perf_counter()
+            with self.cond:
+                self.cond.wait_for(lambda: not self.num_interactive)
+                self.stats.num_pauses += 1
+                self.stats.paused_time += perf_counter() - started_at
+            current.wall_time = perf_counter()
+            current.cpu_time = thread_time()
+            return
+
+        # Throttle a task which consumed more than its share of CPU time
+        # since the last checkpoint.
+        cpu_time = thread_time() - current.cpu_time
+        wall_time = perf_counter() - current.wall_time
+        if (delay := cpu_time / self.cpu_share - wall_time) > 1e-3:
+            sleep(delay)
+            with self.cond:
+                self.stats.throttled_time += delay
+        current.wall_time = perf_counter()
+        current.cpu_time = thread_time()
+
+    def metrics(self) -> Dict[str, float]:
+        """Method metrics returns queue depth, utilisation of workers, and
+        counters of tasks.
+        """
+        with self.cond:
+            stats = self.stats
+            elapsed = max(perf_counter() - stats.started_at, 1e-9)
+            return {
+                'queue_depth': len(self.queue),
+                'running': self.num_running,
+                'interactive': self.num_interactive,
+                'submitted': stats.num_submitted,
+                'completed': stats.num_completed,
+                'failed': stats.num_failed,
+                'replaced': stats.num_replaced,
+                'pauses': stats.num_pauses,
+                'busy_seconds': stats.busy_time,
+                'paused_seconds': stats.paused_time,
+                'throttled_seconds': stats.throttled_time,
+                'utilisation': (stats.busy_time - stats.paused_time -
+                                stats.throttled_time) / elapsed /
+                               self.num_threads,
+            }
+
+    def work(self):
+        lower_priority()
+        current.executor = self
+        while True:
+            with self.cond:
+                self.cond.wait_for(lambda: self.queue and
+                                   not self.num_interactive)
+                key, future, fn, args, kwargs, submitted_at = \
+                    self.queue.popleft()
+                if key is not None and self.keys.get(key) is future:
+                    del self.keys[key]
+                if not future.set_running_or_notify_cancel():
+                    continue
+                self.num_running += 1
+
+            # Task waits in queue since submission on another thread.
+            dequeued_at = perf_counter_ns()
+            self.queue_histogram.span(submitted_at, dequeued_at, True)
+            name = getattr(fn, '__qualname__', None) or str(fn)
+            histogram = stage('background', task=name)
+
+            started_at = current.wall_time = perf_counter()
+            current.cpu_time = thread_time()
+            try:
+                result = fn(*args, **kwargs)
+            except BaseException as exc:
+                logging.exception('background task %s failed', fn)
+                future.set_exception(exc)
+                failed = True
+            else:
+                future.set_result(result)
+                failed = False
+            histogram.since(dequeued_at)
+
+            with self.cond:
+                self.num_running -= 1
+                self.stats.busy_time += perf_counter() - started_at
+                self.stats.num_completed += 1
+                self.stats.num_failed += failed
@@ -0,0 +1,445 @@
+#   encoding: utf8
+#   filename: bench.py
+"""End-to-end load generator for a language server. Every simulated editor
+has its own connection (or its own server process in case of stdio). It opens
+a document, types the rest of it at a realistic rate with incremental changes,
+requests completion on every identifier character and cancels a request which
+is outdated by the next keystroke. Latencies are measured on client side, so
+they include framing, JSON, routing, and queueing in the server.
+"""
+
+import logging
+
+from dataclasses import asdict, dataclass, field
+from io import StringIO
+from json import dumps, loads
+from pathlib import Path
+from random import Random
+from shlex import split as split_command
+from socket import AF_UNIX, IPPROTO_TCP, SOCK_STREAM, TCP_NODELAY, \
+    create_connection, socket
+from subprocess import DEVNULL, PIPE, Popen
+from threading import Event, Lock, Thread
+from time import perf_counter, sleep
+from typing import Any, Dict, Iterable, List, Optional, Tuple
+
+import numpy as np
+
+from .corpus import utf16_length
+from .lsp import Addr, Proto
+from .lsp.syncio.rpc import PacketReader, PacketWriter
+from .version import version
+
+__all__ = ('BenchReport', 'Client', 'Editor', 'MethodStats', 'Sample',
+           'bench')
+
+
+COLUMNS = ('method', 'count', 'cancelled', 'failed', 'throughput', 'mean',
+           'p50', 'p95', 'p99', 'p999', 'max')
+
+QUANTILES = (50, 95, 99, 99.9)
+
+# Characters which make an editor request completion.
+TRIGGERS = frozenset('_.')
+
+
+@dataclass
+class Sample:
+
+    method: str
+
+    latency: float
+
+    cancelled: bool = False
+
+    failed: bool = False
+
+
+@dataclass
+class MethodStats:
+    """Class MethodStats aggregates client-side latencies (in ms) of a
+    method.
+    """
+
+    method: str
+
+    count: int
+
+    cancelled: int
+
+    failed: int
+
+    throughput: float
+
+    mean: float
+
+    p50: float
+
+    p95: float
+
+    p99: float
+
+    p999: float
+
+    max: float
+
+    @classmethod
+    def from_samples(cls, method: str, samples: List[Sample],
+                     elapsed: float) -> 'MethodStats':
+        latencies = np.array([sample.latency for sample in samples]) * 1e3
+        quantiles = np.percentile(latencies, QUANTILES)
+        return cls(method=method,
+                   count=len(samples),
+                   cancelled=sum(sample.cancelled for sample in samples),
+                   failed=sum(sample.failed for sample in samples),
+                   throughput=round(len(samples) / elapsed, 2),
+                   mean=round(float(latencies.mean()), 3),
+                   p50=round(float(quantiles[0]), 3),
+                   p95=round(float(quantiles[1]), 3),
+                   p99=round(float(quantiles[2]), 3),
+                   p999=round(float(quantiles[3]), 3),
+                   max=round(float(latencies.max()), 3))
+
+
+@dataclass
+class BenchReport:
+
+    addr: str
+
+    num_editors: int
+
+    typing_rate: float
+
+    elapsed: float
+
+    num_keystrokes: int
+
+    methods: List[MethodStats] = field(default_factory=list)
+
+    def __str__(self) -> str:
+        lines = [f'benchmark {self.addr} with {self.num_editors} editors '
+                 f'typing {self.typing_rate:.1f} chars/s for '
+                 f'{self.elapsed:.1f} s ({self.num_keystrokes} keystrokes)',
+                 '',
+                 f'{"method":<28} {"count":>7} {"cancel":>7} {"fail":>5} '
+                 f'{"rps":>8} {"p50":>8} {"p95":>8} {"p99":>8} {"p99.9":>8}']
+        for stats in self.methods:
+            lines.append(f'{stats.method:<28} {stats.count:>7} '
+                         f'{stats.cancelled:>7} {stats.failed:>5} '
+                         f'{stats.throughput:>8.1f} {stats.p50:>8.2f} '
+                         f'{stats.p95:>8.2f} {stats.p99:>8.2f} '
+                         f'{stats.p999:>8.2f}')
+        return '\n'.join(lines)
+
+    def to_csv(self) -> str:
+        """Method to_csv renders a row per method in a fixed order of rows
+        and columns so that reports of different commits are diffable.
+        """
+        buf = StringIO()
+        buf.write(','.join(COLUMNS) + '\n')
+        for stats in self.methods:
+            row = asdict(stats)
+            buf.write(','.join(str(row[column]) for column in COLUMNS))
+            buf.write('\n')
+        return buf.getvalue()
+
+    def to_json(self) -> str:
+        obj = asdict(self)
+        obj['elapsed'] = round(self.elapsed, 3)
+        obj['version'] = version
+        return dumps(obj, indent=2) + '\n'
+
+
+class Client:
+    """Class Client is a minimal LSP client which measures latency of its
+    requests.
+
+    :param index: Index of a client.
+    :param addr: Address of a server.
+    :param command: Command to spawn a server for stdio transport.
+    :param timeout: Timeout of initialize and shutdown requests in seconds.
+    :param acknowledge: Respond to requests from server.
+    """
+
+    def __init__(self, index: int, addr: Addr, command: List[str],
+                 timeout: float = 60.0, acknowledge: bool = True):
+        self.index = index
+        self.addr = addr
+        self.command = command
+        self.timeout = timeout
+        self.acknowledge = acknowledge
+
+        self.samples: List[Sample] = []
+        self.pending: Dict[Any, Tuple[str, float, Event]] = {}
+        self.cancelled = set()
+        self.request_id = 0
+        self.lock = Lock()
+        self.process: Optional[Popen] = None
+        self.sock: Optional[socket] = None
+
+    def connect(self):
+        if self.addr.proto == Proto.STDIO:
+            self.process = Popen(self.command, stdin=PIPE, stdout=PIPE,
+                                 stderr=DEVNULL)
+            fin, fout = self.process.stdout, self.process.stdin
+        elif self.addr.proto == Proto.UNIX:
+            self.sock = socket(AF_UNIX, SOCK_STREAM)
+            self.sock.connect(self.addr.path)
+            fin = fout = self.sock.makefile('rwb')
+        else:
+            self.sock = create_connection((self.addr.host, self.addr.port))
+            self.sock.setsockopt(IPPROTO_TCP, TCP_NODELAY, 1)
+            fin = fout = self.sock.makefile('rwb')
+        self.reader = PacketReader(fin)
+        self.writer = PacketWriter(fout)
+        self.receiver = Thread(target=self.receive, daemon=True,
+                               name=f'[lsp] bench #{self.index}')
+        self.receiver.start()
+
+    def close(self):
+        if self.sock is not None:
+            self.sock.close()
+        if self.process is not None:
+            self.process.stdin.close()
+            try:
+                self.process.wait(self.timeout)
+            except Exception:
+                self.process.kill()
+
+    def send(self, packet: Dict[str, Any]):
+        self.write(dumps(packet).encode('utf-8'))
+
+    def write(self, content: bytes):
+        with self.lock:
+            self.writer.write(content)
+
+    def notify(self, method: str, params: Dict[str, Any]):
+        self.send({'jsonrpc': '2.0', 'method': method, 'params': params})
+
+    def request(self, method: str, params: Dict[str, Any]
+                ) -> Tuple[int, Event]:
+        with self.lock:
+            self.request_id += 1
+            request_id = self.request_id
+        done = self.track(request_id, method)
+        self.send({
+            'jsonrpc': '2.0',
+            'id': request_id,
+            'method': method,
+            'params': params,
+        })
+        return request_id, done
+
+    def track(self, request_id: Any, method: str) -> Event:
+        """Method track starts measuring latency of a request which is about
+        to be sent.
+        """
+        done = Event()
+        with self.lock:
+            self.pending[request_id] = (method, perf_counter(), done)
+        return done
+
+    def cancel(self, request_id: Any, notify: bool = True):
+        with self.lock:
+            if request_id not in self.pending:
+                return
+            self.cancelled.add(request_id)
+        if notify:
+            self.notify('$/cancelRequest', {'id': request_id})
+
+    def wait(self, timeout: float):
+        """Method wait waits for responses to all pending requests.
+        """
+        deadline = perf_counter() + timeout
+        while self.pending and perf_counter() < deadline:
+            sleep(0.01)
+
+    def receive(self):
+        for frame in self.reader:
+            received_at = perf_counter()
+            packet = loads(frame.content)
+            if 'method' in packet:
+                # Acknowledge requests from server (e.g. registration of
+                # capabilities) and skip notifications.
+                if 'id' in packet and self.acknowledge:
+                    self.send({'jsonrpc': '2.0', 'id': packet['id'],
+                               'result': None})
+                continue
+            with self.lock:
+                request_id = packet.get('id')
+                if (entry := self.pending.pop(request_id, None)) is None:
+                    continue
+                method, sent_at, done = entry
+                cancelled = request_id in self.cancelled
+                self.cancelled.discard(request_id)
+                self.samples.append(Sample(method, received_at - sent_at,
+                                           cancelled, 'error' in packet))
+            done.set()
+
+
+class Editor(Client):
+    """Class Editor simulates a user which types documents in an editor
+    connected to a language server.
+
+    :param index: Index of an editor (it seeds random generator).
+    :param addr: Address of a server.
+    :param command: Command to spawn a server for stdio transport.
+    :param documents: Documents to type.
+    :param typing_rate: Average number of typed characters per second.
+    :param num_chars: Number of characters typed in a document before it is
+                      closed and the next one is opened.
+    :param hover_prob: Probability to request hover after a keystroke.
+    :param timeout: Timeout of initialize and shutdown requests in seconds.
+    """
+
+    def __init__(self, index: int, addr: Addr, command: List[str],
+                 documents: List[Path], typing_rate: float = 8.0,
+                 num_chars: int = 256, hover_prob: float = 0.0,
+                 timeout: float = 60.0):
+        super().__init__(index, addr, command, timeout)
+        self.documents = documents
+        self.typing_rate = typing_rate
+        self.num_chars = num_chars
+        self.hover_prob = hover_prob
+        self.random = Random(index)
+        self.num_keystrokes = 0
+
+    def run(self, duration: float):
+        """Method run types documents for duration seconds.
+        """
+        self.connect()
+        root = self.documents[0].parent.resolve()
+        _, done = self.request('initialize', {
+            'processId': None,
+            'clientInfo': {'name': 'lsp-lm-bench', 'version': version},
+            'rootUri': root.as_uri(),
+            'capabilities': {},
+        })
+        if not done.wait(self.timeout):
+            raise RuntimeError(f'Editor #{self.index} is not initialized.')
+        self.notify('initialized', {})
+
+        deadline = perf_counter() + duration
+        while perf_counter() < deadline:
+            path = self.random.choice(self.documents)
+            self.type_document(path, deadline)
+
+        _, done = self.request('shutdown', None)
+        done.wait(self.timeout)
+        self.notify('exit', None)
+        self.close()
+
+    def type_document(self, path: Path, deadline: float):
+        text = path.read_text(errors='replace')
+        uri = path.resolve().as_uri()
+        start = self.random.randrange(max(len(text) - self.num_chars, 1))
+        prefix, typed = text[:start], text[start:start + self.num_chars]
+        self.notify('textDocument/didOpen', {
+            'textDocument': {
+                'uri': uri,
+                'languageId': 'python' if path.suffix == '.py' else 'text',
+                'version': 1,
+                'text': prefix,
+            },
+        })
+
+        line = prefix.count('\n')
+        # Editor counts columns in UTF-16 code units.
+        char = utf16_length(prefix[prefix.rfind('\n') + 1:])
+        outdated = None
+        typed_at = perf_counter()
+        for version_, ch in enumerate(typed, 2):
+            typed_at += self.random.expovariate(self.typing_rate)
+            if (delay := typed_at - perf_counter()) > 0:
+                sleep(delay)
+            if perf_counter() >= deadline:
+                break
+
+            position = {'line': line, 'character': char}
+            self.notify('textDocument/didChange', {
+                'textDocument': {'uri': uri, 'version': version_},
+                'contentChanges': [{
+                    'range': {'start': position, 'end': position},
+                    'text': ch,
+                }],
+            })
+            self.num_keystrokes += 1
+            if ch == '\n':
+                line, char = line + 1, 0
+            else:
+                char += utf16_length(ch)
+            position = {'line': line, 'character': char}
+
+            # An editor cancels completion which is outdated by keystroke.
+            if outdated is not None:
+                self.cancel(outdated)
+                outdated = None
+            if ch.isalnum() or ch in TRIGGERS:
+                outdated, _ = self.request('textDocument/completion', {
+                    'textDocument': {'uri': uri},
+                    'position': position,
+                })
+            if self.random.random() < self.hover_prob:
+                self.request('textDocument/hover', {
+                    'textDocument': {'uri': uri},
+                    'position': position,
+                })
+
+        self.notify('textDocument/didClose', {'textDocument': {'uri': uri}})
+
+
+def aggregate(samples: Iterable[List[Sample]], elapsed: float
+              ) -> List[MethodStats]:
+    """Function aggregate groups samples of clients by method and returns
+    statistics of methods in alphabetical order.
+    """
+    methods: Dict[str, List[Sample]] = {}
+    for client_samples in samples:
+        for sample in client_samples:
+            methods.setdefault(sample.method, []).append(sample)
+    return [MethodStats.from_samples(method, methods[method], elapsed)
+            for method in sorted(methods)]
+
+
+def bench(addr: Addr, command: str, documents: List[Path],
+          num_editors: int = 1, duration: float = 30.0,
+          typing_rate: float = 8.0, num_chars: int = 256,
+          hover_prob: float = 0.0, output: Optional[Path] = None,
+          output_format: str = 'csv') -> BenchReport:
+    """Function bench runs simulated editors concurrently against a server
+    and reports throughput and latency quantiles per method.
+    """
+    if not documents:
+        raise ValueError('At least one document to type is required.')
+    logging.info('run %d editors against %s for %.1f s', num_editors, addr,
+                 duration)
+    argv = split_command(command)
+    editors = [Editor(index, addr, argv, documents, typing_rate, num_chars,
+                      hover_prob) for index in range(num_editors)]
+    threads = [Thread(target=editor.run, args=(duration, ), daemon=True,
+                      name=f'[lsp] editor #{editor.index}')
+               for editor in editors]
+    started_at = perf_counter()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    elapsed = perf_counter() - started_at
+
+    report = BenchReport(addr=str(addr),
+                         num_editors=num_editors,
+                         typing_rate=typing_rate,
+                         elapsed=elapsed,
+                         num_keystrokes=sum(editor.num_keystrokes
+                                            for editor in editors))
+    report.methods = aggregate((editor.samples for editor in editors),
+                               elapsed)
+
+    if output is not None:
+        logging.info('write %s report to %s', output_format, output)
+        with open(output, 'w') as fout:
+            if output_format == 'json':
+                fout.write(report.to_json())
+            else:
+                fout.write(report.to_csv())
+    return report
@@ -7,11 +7,12 @@ import logging
 import inspect
 
 from argparse import ArgumentParser, ArgumentTypeError, FileType
+from os import getenv
 from pathlib import Path
 from socket import AF_INET, SOCK_STREAM, socket
 from ssl import SSLContext
 from sys import stderr
-from typing import Optional
+from typing import List, Optional, Tuple
 from urllib.parse import parse_qs, urlparse
 
 from .lsp import Addr, Proto
@@ -69,6 +70,18 @@ class AddrType:
                     opts=parse_qs(uri.query))
 
 
+class BudgetType:
+
+    def __call__(self, value: str) -> Tuple[str, int]:
+        name, sep, size = value.partition('=')
+        if not sep or not name:
+            raise ArgumentTypeError(f'budget should be NAME=MIB: {value}')
+        try:
+            return name, int(float(size) * 2**20)
+        except ValueError:
+            raise ArgumentTypeError(f'budget should be NAME=MIB: {value}')
+
+
 class PathType:
 
     def __init__(self, exists=False, not_dir=False, not_file=False):
@@ -97,6 +110,12 @@ class PathType:
         return path
 
 
+def default_cache_dir() -> Path:
+    if (cache_home := getenv('XDG_CACHE_HOME')):
+        return Path(cache_home) / 'lsp-lm'
+    return Path.home() / '.cache' / 'lsp-lm'
+
+
 def connect(addr: Addr):
     logging.info('connect to %s', addr)
     if addr.proto == Proto.STDIO:
@@ -118,8 +137,31 @@ def connect(addr: Addr):
         logging.error('connecting via unix sockets is not implemented yet')
 
 
+def replay(log: Path, addr: Addr, host: str, port: int, command: str,
+           speed: float, output: Optional[Path], output_format: str):
+    addr.update(host=host, port=port)
+    from . import replay as replayer
+    report = replayer.replay(log, addr, command, speed, output,
+                             output_format)
+    print(report)
+
+
 def serve(context_size: int, model: Path, model_type: str, vocab: Path,
-          num_results: int, hf_model: str, addr: Addr, host: str, port: int,
+          num_results: int, hf_model: str, latency_target: Optional[float],
+          exit_margin: Optional[float], exit_patience: int,
+          syntax_aware: bool, retrieval: bool, semantic: Optional[str],
+          thesaurus: Optional[Path], dictionary: Optional[Path],
+          rules: Optional[Path],
+          diagnostics_delay: float, anomaly: Optional[str],
+          anomaly_model: Optional[Path], anomaly_threshold: Optional[float],
+          background_threads: int, background_cpu_share: float,
+          record: Optional[Path], record_anonymise: bool,
+          metrics: Optional[Addr], telemetry_interval: float,
+          trace: bool, trace_buffer: int, trace_output: Optional[str],
+          memory_budget: List[Tuple[str, int]],
+          memory_high_water: Optional[float], memory_interval: float,
+          gc_freeze: bool, gc_interval: float, gc_full_interval: float,
+          cache_dir: Optional[Path], addr: Addr, host: str, port: int,
           tls_cert: Optional[Path], tls_key: Optional[Path],
           tls_pass: Optional[Path]):
     # Resolve address components.
@@ -127,18 +169,75 @@ def serve(context_size: int, model: Path, model_type: str, vocab: Path,
 
     # Combine all ranking (IR) related options together.
     ir_opts = {
+        'cache_dir': cache_dir,
+        'enabled': retrieval,
         'num_results': num_results,
+        'semantic': semantic,
+        'thesaurus': thesaurus,
     }
 
     # Combine all language model related options together.
     lm_opts = {
         'context_size': context_size,
+        'exit_margin': exit_margin,
+        'exit_patience': exit_patience,
+        'latency_target': latency_target and latency_target / 1e3,
         'model_path': model,
         'model_type': model_type,
         'num_results': num_results,
+        'syntax_aware': syntax_aware,
         'vocab_path': vocab,
     }
 
+    # Combine all diagnostics related options together.
+    diag_opts = {
+        'anomaly': anomaly,
+        'anomaly_model': anomaly_model,
+        'anomaly_threshold': anomaly_threshold,
+        'delay': diagnostics_delay / 1e3,
+        'dictionary': dictionary,
+        'rules': rules,
+    }
+
+    # Combine all background executor related options together.
+    bg_opts = {
+        'cpu_share': background_cpu_share,
+        'num_threads': background_threads,
+    }
+
+    # Combine all traffic recording related options together.
+    rec_opts = {
+        'anonymise': record_anonymise,
+        'path': record,
+    }
+
+    # Combine all metrics related options together.
+    metrics_opts = {
+        'addr': metrics,
+        'telemetry_interval': telemetry_interval,
+    }
+
+    # Combine all tracing related options together.
+    trace_opts = {
+        'capacity': trace_buffer,
+        'enabled': trace,
+        'output': trace_output,
+    }
+
+    # Combine all memory accounting related options together.
+    mem_opts = {
+        'budgets': dict(memory_budget),
+        'high_water': memory_high_water and int(memory_high_water * 2**20),
+        'interval': memory_interval,
+    }
+
+    # Combine all garbage collector related options together.
+    gc_opts = {
+        'freeze': gc_freeze,
+        'full_interval': gc_full_interval,
+        'interval': gc_interval,
+    }
+
     # Create TLS context if posssible.
     if tls_cert is None:
         tls_context = None
@@ -151,10 +250,87 @@ def serve(context_size: int, model: Path, model_type: str, vocab: Path,
 
     # Load lazily application controller and run application in blocking mode.
     from .app import Application
-    app = Application(addr, tls_context, ir_opts, lm_opts)
+    app = Application(addr, tls_context, ir_opts, lm_opts, diag_opts,
+                      bg_opts, rec_opts, metrics_opts, trace_opts, mem_opts,
+                      gc_opts)
     app.run()
 
 
+def prune_vocab(model: Path, output: Path, corpus: List[Path],
+                vocab_size: Optional[int], min_freq: int, num_samples: int,
+                top_k: int, suffix: List[str]):
+    from . import prune
+    report = prune.prune_vocab(model, output, corpus, vocab_size, min_freq,
+                               num_samples, top_k, set(suffix) or None)
+    print(report)
+
+
+def build_dictionary(corpus: List[Path], output: Path, max_distance: int,
+                     prefix_length: int, min_freq: int,
+                     max_words: Optional[int], suffix: List[str]):
+    from . import spelling
+    report = spelling.build_dictionary(corpus, output, max_distance,
+                                       prefix_length, min_freq, max_words,
+                                       set(suffix) or None)
+    print(report)
+
+
+def compile_rules(rules: List[Path], output: Path):
+    from . import rules as engine
+    report = engine.compile_rules(rules, output)
+    print(report)
+
+
+def bench(addr: Addr, host: str, port: int, command: str,
+          documents: List[Path], num_editors: int, duration: float,
+          typing_rate: float, num_chars: int, hover_prob: float,
+          output: Optional[Path], output_format: str):
+    addr.update(host=host, port=port)
+    from . import bench as benchmark
+    report = benchmark.bench(addr, command, documents, num_editors, duration,
+                             typing_rate, num_chars, hover_prob, output,
+                             output_format)
+    print(report)
+
+
+def build_thesaurus(vectors: Path, output: Path, num_subspaces: int,
+                    num_lists: int, num_iters: int, max_words: Optional[int],
+                    sample_size: int):
+    from . import thesaurus
+    report = thesaurus.build_thesaurus(vectors, output, num_subspaces,
+                                       num_lists, num_iters, max_words,
+                                       sample_size)
+    print(report)
+
+
+def evaluate(corpus: List[Path], model: Path, model_type: str, vocab: Path,
+             num_results: int, context_size: int,
+             latency_target: Optional[float], exit_margin: Optional[float],
+             exit_patience: int, num_samples: int, num_workers: int,
+             batch_size: int, label: Optional[str], output: Optional[Path],
+             suffix: List[str], seed: int):
+    lm_opts = {
+        'context_size': context_size,
+        'exit_margin': exit_margin,
+        'exit_patience': exit_patience,
+        'latency_target': latency_target and latency_target / 1e3,
+        'model_path': model,
+        'model_type': model_type,
+        'num_results': num_results,
+        'vocab_path': vocab,
+    }
+    from . import evaluate as evaluation
+    from .completion import make_completor_loader
+    completor = make_completor_loader(lm_opts).load()
+    label = label or f'{model_type or "vocab"}:{model or vocab}'
+    report = evaluation.evaluate(completor, corpus, num_samples, num_results,
+                                 num_workers, batch_size, label,
+                                 set(suffix) or None, seed)
+    if output is not None:
+        report.write_csv(output)
+    print(report)
+
+
 def help_():
     parser.print_help()
 
@@ -205,20 +381,124 @@ parser.add_argument('--log-output', default=stderr, metavar='FILENAME', type=Fil
 
 subparsers = parser.add_subparsers()
 
+parser_bench = subparsers.add_parser('bench', parents=[parser_opt_connection], help='Run simulated editors against language server and report latency per method.')  # noqa: E501
+parser_bench.set_defaults(func=bench)
+parser_bench.add_argument('-c', '--command', default='lsp-lm serve', help='Command to spawn a server per editor for stdio transport.')  # noqa: E501
+parser_bench.add_argument('-d', '--document', dest='documents', default=[], action='append', type=PathType(True, not_dir=True), help='Document to type (the option could be repeated).')  # noqa: E501
+parser_bench.add_argument('-n', '--num-editors', default=1, type=int, help='Number of concurrent editors (connections).')  # noqa: E501
+parser_bench.add_argument('-t', '--duration', default=30, type=float, help='Duration of benchmark (in seconds).')  # noqa: E501
+parser_bench.add_argument('-r', '--typing-rate', default=8, type=float, help='Average number of typed characters per second.')  # noqa: E501
+parser_bench.add_argument('-k', '--num-chars', default=256, type=int, help='Number of characters typed in a document before the next one is opened.')  # noqa: E501
+parser_bench.add_argument('--hover-prob', default=0.0, type=float, help='Probability to request hover after a keystroke.')  # noqa: E501
+parser_bench.add_argument('-o', '--output', type=PathType(), help='Path to output report.')  # noqa: E501
+parser_bench.add_argument('-f', '--format', dest='output_format', default='csv', choices=('csv', 'json'), help='Format of output report.')  # noqa: E501
+
+parser_dictionary = subparsers.add_parser('build-dictionary', help='Build spelling dictionary from frequency lists or text corpus.')  # noqa: E501
+parser_dictionary.set_defaults(func=build_dictionary)
+parser_dictionary.add_argument('-o', '--output', required=True, type=PathType(), help='Path to output dictionary file.')  # noqa: E501
+parser_dictionary.add_argument('-d', '--max-distance', default=2, type=int, help='Maximal edit distance of suggestions.')  # noqa: E501
+parser_dictionary.add_argument('-p', '--prefix-length', default=7, type=int, help='Length of word prefix to generate deletes from.')  # noqa: E501
+parser_dictionary.add_argument('-f', '--min-freq', default=1, type=int, help='Minimal word frequency in corpus to keep word.')  # noqa: E501
+parser_dictionary.add_argument('-n', '--max-words', type=int, help='Maximal number of the most frequent words to keep.')  # noqa: E501
+parser_dictionary.add_argument('-s', '--suffix', default=[], action='append', help='File suffix to read in corpus directories (e.g. .txt).')  # noqa: E501
+parser_dictionary.add_argument('corpus', nargs='+', type=PathType(True), help='Frequency lists (word and count per line) or corpus files or directories.')  # noqa: E501
+
+parser_thesaurus = subparsers.add_parser('build-thesaurus', help='Build thesaurus from word vectors (word2vec or GloVe text format).')  # noqa: E501
+parser_thesaurus.set_defaults(func=build_thesaurus)
+parser_thesaurus.add_argument('-o', '--output', required=True, type=PathType(), help='Path to output thesaurus file.')  # noqa: E501
+parser_thesaurus.add_argument('-m', '--num-subspaces', default=16, type=int, help='Number of subspaces of product quantizer (bytes per word).')  # noqa: E501
+parser_thesaurus.add_argument('-l', '--num-lists', default=1024, type=int, help='Number of inverted lists of coarse quantizer.')  # noqa: E501
+parser_thesaurus.add_argument('-i', '--num-iters', default=16, type=int, help='Number of k-means iterations.')  # noqa: E501
+parser_thesaurus.add_argument('-n', '--max-words', type=int, help='Maximal number of words to read (the most frequent go first).')  # noqa: E501
+parser_thesaurus.add_argument('-s', '--sample-size', default=65536, type=int, help='Number of vectors to train quantizers on.')  # noqa: E501
+parser_thesaurus.add_argument('vectors', type=PathType(True, not_dir=True), help='Path to word vectors.')  # noqa: E501
+
+parser_rules = subparsers.add_parser('compile-rules', help='Compile grammar and style rule packs into automaton.')  # noqa: E501
+parser_rules.set_defaults(func=compile_rules)
+parser_rules.add_argument('-o', '--output', required=True, type=PathType(), help='Path to output automaton file.')  # noqa: E501
+parser_rules.add_argument('rules', nargs='+', type=PathType(True, not_dir=True), help='Rule packs (phrase, replacement, and message separated with tabs).')  # noqa: E501
+
 parser_connect = subparsers.add_parser('connect', parents=[parser_opt_connection], help='Connect to language server.')  # noqa: E501
 parser_connect.set_defaults(func=connect)
 
+parser_evaluate = subparsers.add_parser('evaluate', help='Evaluate accuracy and latency of completion on a corpus.')  # noqa: E501
+parser_evaluate.set_defaults(func=evaluate)
+parser_evaluate.add_argument('-c', '--context-size', default=256, type=int, help='Number of tokens in context used to make predictions.')  # noqa: E501
+parser_evaluate.add_argument('-m', '--model-type', type=str, help='Type of language model to use (e.g. hf or vocab).')  # noqa: E501
+parser_evaluate.add_argument('-n', '--num-results', default=10, type=int, help='Number of completion items to rank (k of top-k and MRR@k).')  # noqa: E501
+parser_evaluate.add_argument('-M', '--model', type=PathType(True, not_file=True), help='Path to model file or directory.')  # noqa: E501
+parser_evaluate.add_argument('-V', '--vocab', type=PathType(True, not_dir=True), help='Path to vocabulary file.')  # noqa: E501
+parser_evaluate.add_argument('--latency-target', type=float, help='Adapt context size to keep p95 of completion latency under target (in ms).')  # noqa: E501
+parser_evaluate.add_argument('--exit-margin', type=float, help='Enable early exit if margin of top-1 and top-2 probabilities exceeds threshold (lower is faster).')  # noqa: E501
+parser_evaluate.add_argument('--exit-patience', default=2, type=int, help='Exit early if top-k predictions are stable for this number of layers.')  # noqa: E501
+parser_evaluate.add_argument('-N', '--num-samples', default=1000, type=int, help='Number of cursor positions to sample.')  # noqa: E501
+parser_evaluate.add_argument('-j', '--num-workers', default=1, type=int, help='Number of parallel requests (1 measures latency of idle server).')  # noqa: E501
+parser_evaluate.add_argument('-b', '--batch-size', default=16, type=int, help='Number of samples submitted at once.')  # noqa: E501
+parser_evaluate.add_argument('-l', '--label', type=str, help='Name of configuration in report.')  # noqa: E501
+parser_evaluate.add_argument('-o', '--output', type=PathType(), help='Append report as a row to CSV file.')  # noqa: E501
+parser_evaluate.add_argument('-s', '--suffix', default=[], action='append', help='File suffix to read in corpus directories (e.g. .py).')  # noqa: E501
+parser_evaluate.add_argument('--seed', default=42, type=int, help='Seed of sampling of cursor positions.')  # noqa: E501
+parser_evaluate.add_argument('corpus', nargs='+', type=PathType(True), help='Corpus files or directories (e.g. enwik8 or source tree).')  # noqa: E501
+
 parser_help = subparsers.add_parser('help', add_help=False, help='Show this message and exit.')  # noqa: E501
 parser_help.set_defaults(func=help_)
 
+parser_prune = subparsers.add_parser('prune-vocab', help='Prune vocabulary of a model with respect to a corpus.')  # noqa: E501
+parser_prune.set_defaults(func=prune_vocab)
+parser_prune.add_argument('-M', '--model', required=True, type=PathType(True, not_file=True), help='Path to model directory.')  # noqa: E501
+parser_prune.add_argument('-o', '--output', required=True, type=PathType(), help='Path to output directory for pruned model.')  # noqa: E501
+parser_prune.add_argument('-k', '--top-k', default=10, type=int, help='Number of predictions to compare models.')  # noqa: E501
+parser_prune.add_argument('-f', '--min-freq', default=1, type=int, help='Minimal token frequency in corpus to keep token.')  # noqa: E501
+parser_prune.add_argument('-n', '--num-samples', default=100, type=int, help='Number of masked samples to compare models.')  # noqa: E501
+parser_prune.add_argument('-s', '--suffix', default=[], action='append', help='File suffix to read in corpus directories (e.g. .py).')  # noqa: E501
+parser_prune.add_argument('-v', '--vocab-size', type=int, help='Maximal size of pruned vocabulary.')  # noqa: E501
+parser_prune.add_argument('corpus', nargs='+', type=PathType(True), help='Corpus files or directories (e.g. enwik8 or source tree).')  # noqa: E501
+
+parser_replay = subparsers.add_parser('replay', parents=[parser_opt_connection], help='Replay recorded traffic against language server and compare latency.')  # noqa: E501
+parser_replay.set_defaults(func=replay)
+parser_replay.add_argument('-c', '--command', default='lsp-lm serve', help='Command to spawn a server per session for stdio transport.')  # noqa: E501
+parser_replay.add_argument('-s', '--speed', default=1.0, type=float, help='Replay speed relative to original pace (e.g. 2 is twice faster).')  # noqa: E501
+parser_replay.add_argument('-o', '--output', type=PathType(), help='Path to output report.')  # noqa: E501
+parser_replay.add_argument('-f', '--format', dest='output_format', default='csv', choices=('csv', 'json'), help='Format of output report.')  # noqa: E501
+parser_replay.add_argument('-l', '--log', required=True, type=PathType(True, not_dir=True), help='Path to traffic log (see serve --record).')  # noqa: E501
+
 parser_serve = subparsers.add_parser('serve', parents=[parser_opt_connection], help='Run language server.')  # noqa: E501
 parser_serve.set_defaults(func=serve)
-parser_serve.add_argument('-c', '--context-size', default=3, type=int, help='Size of context used to make predictions.')  # noqa: E501
+parser_serve.add_argument('-c', '--context-size', default=256, type=int, help='Number of tokens in context used to make predictions.')  # noqa: E501
 parser_serve.add_argument('-m', '--model-type', type=str, help='Type of language model to use (e.g. hf or vocab).')  # noqa: E501
 parser_serve.add_argument('-n', '--num-results', default=10, type=int, help='Number of completion items in response.')  # noqa: E501
 parser_serve.add_argument('-M', '--model', type=PathType(True, not_file=True), help='Path to model file or directory.')  # noqa: E501
 parser_serve.add_argument('-V', '--vocab', type=PathType(True, not_dir=True), help='Path to vocabulary file.')  # noqa: E501
 parser_serve.add_argument('--hf-model', type=str, help='HuggingFace model.')
+parser_serve.add_argument('--latency-target', type=float, help='Adapt context size to keep p95 of completion latency under target (in ms).')  # noqa: E501
+parser_serve.add_argument('--exit-margin', type=float, help='Enable early exit if margin of top-1 and top-2 probabilities exceeds threshold (lower is faster).')  # noqa: E501
+parser_serve.add_argument('--exit-patience', default=2, type=int, help='Exit early if top-k predictions are stable for this number of layers.')  # noqa: E501
+parser_serve.add_argument('--retrieval', default=False, action='store_true', help='Index workspace and pack similar snippets into context.')  # noqa: E501
+parser_serve.add_argument('--semantic', choices=('embedding', 'encoder'), help='Propose workspace identifiers semantically related to context (embeddings from input embedding table or mean-pooled encoder states).')  # noqa: E501
+parser_serve.add_argument('--dictionary', type=PathType(True, not_dir=True), help='Publish spelling diagnostics with dictionary (see build-dictionary).')  # noqa: E501
+parser_serve.add_argument('--anomaly', choices=('discriminator', 'mlm'), help='Publish diagnostics for unlikely tokens scored in a single forward pass (ELECTRA discriminator or unmasked MLM pseudo-likelihood).')  # noqa: E501
+parser_serve.add_argument('--anomaly-model', type=PathType(True, not_file=True), help='Path to ELECTRA discriminator for --anomaly=discriminator.')  # noqa: E501
+parser_serve.add_argument('--anomaly-threshold', type=float, help='Probability threshold to flag a token (replaced probability for discriminator or token probability for mlm).')  # noqa: E501
+parser_serve.add_argument('--rules', type=PathType(True, not_dir=True), help='Publish grammar and style diagnostics with compiled rule pack (see compile-rules).')  # noqa: E501
+parser_serve.add_argument('--diagnostics-delay', default=200, type=float, help='Publish diagnostics after this delay since the last change (in ms).')  # noqa: E501
+parser_serve.add_argument('--background-threads', default=2, type=int, help='Number of low priority threads for diagnostics and indexing.')  # noqa: E501
+parser_serve.add_argument('--background-cpu-share', default=0.5, type=float, help='Maximal share of CPU which a background thread consumes.')  # noqa: E501
+parser_serve.add_argument('--record', type=PathType(), help='Record inbound frames of all sessions to traffic log (see replay).')  # noqa: E501
+parser_serve.add_argument('--record-anonymise', default=False, action='store_true', help='Mask text of documents and hash URIs in traffic log.')  # noqa: E501
+parser_serve.add_argument('--metrics', type=AddrType(), help='Serve latency histograms in Prometheus format over HTTP on address (e.g. tcp://127.0.0.1:9272 or unix:///tmp/lsp-lm.sock).')  # noqa: E501
+parser_serve.add_argument('--telemetry-interval', default=0.0, type=float, help='Period of telemetry/event notifications with latency quantiles (in seconds; 0 disables them).')  # noqa: E501
+parser_serve.add_argument('--trace', default=False, action='store_true', help='Record spans of request processing stages from start (see also command lsp-lm.trace.start).')  # noqa: E501
+parser_serve.add_argument('--trace-buffer', default=65536, type=int, help='Number of trace events kept per thread.')  # noqa: E501
+parser_serve.add_argument('--trace-output', help='Path template of trace dumped on SIGUSR1 or command lsp-lm.trace.dump (Chrome JSON or Perfetto protobuf for .pftrace suffix; {pid} and {time} are substituted).')  # noqa: E501
+parser_serve.add_argument('--memory-budget', default=[], action='append', type=BudgetType(), help='Evict caches of subsystem if it holds more private memory than budget in MiB (e.g. caches=256; the option could be repeated).')  # noqa: E501
+parser_serve.add_argument('--memory-high-water', type=float, help='Warn once resident set size exceeds this mark (in MiB).')  # noqa: E501
+parser_serve.add_argument('--memory-interval', default=60.0, type=float, help='Period of memory accounting and budget enforcement (in seconds; 0 disables it).')  # noqa: E501
+parser_serve.add_argument('--gc-freeze', default=False, action='store_true', help='Freeze heap after model loading and warmup and collect garbage only while no completion is in flight.')  # noqa: E501
+parser_serve.add_argument('--gc-interval', default=1.0, type=float, help='Period of checks for idle garbage collection (in seconds; see --gc-freeze).')  # noqa: E501
+parser_serve.add_argument('--gc-full-interval', default=300.0, type=float, help='Period of full garbage collections including frozen heap (in seconds; 0 disables them).')  # noqa: E501
+parser_serve.add_argument('--thesaurus', type=PathType(True, not_dir=True), help='Show synonyms on hover and go to them on definition (see build-thesaurus).')  # noqa: E501
+parser_serve.add_argument('--cache-dir', default=default_cache_dir(), type=PathType(), help='Directory to cache workspace indexes.')  # noqa: E501
+parser_serve.add_argument('--syntax-aware', default=False, action='store_true', help='Select context with incremental tree-sitter parser (if available).')  # noqa: E501
 parser_serve.add_argument('--tls-cert', type=PathType(True, not_dir=True), help='Path to TLS certificate.')  # noqa: E501
 parser_serve.add_argument('--tls-key', type=PathType(True, not_dir=True), help='Path to private key.')  # noqa: E501
 parser_serve.add_argument('--tls-pass', type=PathType(True, not_dir=True), help='Path to password to decrypt private key.')  # noqa: E501
@@ -0,0 +1,152 @@
+#   encoding: utf8
+#   filename: collector.py
+"""Control of cyclic garbage collector for stable tail latency. Pauses of
+collector are recorded into latency histograms in any mode. In pause-free
+mode objects which survive model loading and warmup are frozen (see
+gc.freeze), automatic collection is disabled, and garbage is collected by a
+thread only while no interactive request is in flight.
+"""
+
+import gc
+import logging
+
+from threading import Event, Lock, Thread
+from time import perf_counter, perf_counter_ns
+from typing import Any, Dict, Optional
+
+from .background import BackgroundExecutor
+from .lsp.metrics import REGISTRY
+
+__all__ = ('IdleCollector', 'watch_pauses')
+
+
+PAUSE_HELP = 'Pause of cyclic garbage collector by generation.'
+
+
+class PauseWatcher:
+    """Class PauseWatcher is a callback of garbage collector which records
+    duration of every collection. Collections do not overlap, so a single
+    timestamp is enough.
+    """
+
+    def __init__(self):
+        self.histograms = [REGISTRY.histogram('lsp_gc_pause_seconds',
+                                              PAUSE_HELP,
+                                              generation=str(generation))
+                           for generation in range(3)]
+        self.started_at = 0
+
+    def __call__(self, phase: str, info: Dict[str, Any]):
+        if phase == 'start':
+            self.started_at = perf_counter_ns()
+        else:
+            self.histograms[info['generation']].since(self.started_at)
+
+
+def gc_metrics() -> Dict[str, float]:
+    result: Dict[str, float] = {
+        'frozen_objects': gc.get_freeze_count(),
+        'enabled': int(gc.isenabled()),
+    }
+    for generation, stats in enumerate(gc.get_stats()):
+        result[f'gen{generation}_collections'] = stats['collections']
+        result[f'gen{generation}_collected'] = stats['collected']
+    for generation, count in enumerate(gc.get_count()):
+        result[f'gen{generation}_count'] = count
+    return result
+
+
+def watch_pauses():
+    """Function watch_pauses installs callback which records pauses of
+    garbage collector and registers gauges of its counters. It is
+    idempotent.
+    """
+    if any(isinstance(callback, PauseWatcher) for callback in gc.callbacks):
+        return
+    gc.callbacks.append(PauseWatcher())
+    REGISTRY.gauge('lsp_gc', gc_metrics, 'Counters of garbage collector.')
+
+
+class IdleCollector:
+    """Class IdleCollector moves work of garbage collector into idle periods.
+    Young generations are collected once they exceed threshold of collector
+    and the whole heap (including frozen objects) is collected rarely. Both
+    are postponed while an interactive request is in flight.
+
+    :param executor: Background executor which tracks interactive requests.
+    :param interval: Period of checks in seconds.
+    :param full_interval: Period of full collections in seconds.
+    """
+
+    def __init__(self, executor: BackgroundExecutor, interval: float = 1.0,
+                 full_interval: float = 300.0):
+        if interval <= 0:
+            raise ValueError(f'Collection interval should be positive: '
+                             f'{interval}.')
+        self.executor = executor
+        self.interval = interval
+        self.full_interval = full_interval
+        self.num_young = 0
+        self.num_full = 0
+        self.num_postponed = 0
+        self.frozen = False
+        self.lock = Lock()
+        self.stopped = Event()
+        self.thread: Optional[Thread] = None
+
+    def __str__(self) -> str:
+        return (f'IdleCollector(interval={self.interval}, '
+                f'full_interval={self.full_interval}, '
+                f'noyoung={self.num_young}, nofull={self.num_full}, '
+                f'nopostponed={self.num_postponed})')
+
+    def freeze(self):
+        """Method freeze collects garbage and moves survivors (e.g. models,
+        indexes, and caches populated by warmup) to permanent generation
+        which collector never traverses. Heap is frozen once per process;
+        objects of later sessions are frozen by full collections.
+        """
+        with self.lock:
+            if self.frozen:
+                return
+            self.frozen = True
+        started_at = perf_counter()
+        gc.collect()
+        gc.freeze()
+        logging.info('freeze %d objects in %.1f ms', gc.get_freeze_count(),
+                     (perf_counter() - started_at) * 1e3)
+
+    def start(self):
+        gc.disable()
+        self.stopped.clear()
+        self.thread = Thread(target=self.run, daemon=True,
+                             name='[lsp] collector')
+        self.thread.start()
+
+    def stop(self):
+        self.stopped.set()
+        if self.thread is not None:
+            self.thread.join()
+        gc.enable()
+        logging.info('stop idle collector: %s', self)
+
+    def run(self):
+        full_at = perf_counter() + self.full_interval
+        while not self.stopped.wait(self.interval):
+            full = self.full_interval > 0 and perf_counter() >= full_at
+            if not full and gc.get_count()[0] < gc.get_threshold()[0]:
+                continue
+            if self.executor.num_interactive:
+                self.num_postponed += 1
+                continue
+            if full:
+                # Objects frozen on start could become garbage later (e.g.
+                # closed documents), so they are revisited once in a while.
+                gc.unfreeze()
+                gc.collect()
+                gc.freeze()
+                full_at = perf_counter() + self.full_interval
+                self.num_full += 1
+            else:
+                gc.collect(1)
+                self.num_young += 1
@@ -3,18 +3,39 @@
 
 import logging
 
+import torch as T
 import transformers
 
 from transformers import AutoConfig, AutoModel, AutoTokenizer, pipeline
 
 from abc import ABC, abstractmethod
-from functools import partial
-from typing import List
+from time import perf_counter_ns
+from typing import List, Optional, Sequence
 
+from .context import ContextController
 from .corpus import Document
+from .lsp.metrics import stage
+from .lsp.trace import TRACER
 
 
-__all__ = ('AbstractCompletor', 'make_completor_loader')
+__all__ = ('AbstractCompletor', 'load_pretrained', 'make_completor_loader')
+
+
+def load_pretrained(model_path: str):
+    """Function load_pretrained loads tokenizer and model with architecture
+    from model config. It falls back to AutoModel if the architecture is not
+    known to transformers.
+    """
+    config = AutoConfig.from_pretrained(model_path)
+    model_class_name = config.architectures[0]
+    model_class = getattr(transformers, model_class_name, None)
+    if model_class is None:
+        logging.warning('failed to find model architecture %s: fallback',
+                        model_class_name)
+        model_class = AutoModel
+    tokenizer = AutoTokenizer.from_pretrained(model_path)
+    model = model_class.from_pretrained(model_path)
+    return tokenizer, model
 
 
 def make_completor_loader(lm_opts):
@@ -28,7 +49,11 @@ def make_completor_loader(lm_opts):
     # TODO: Use `match-case` syntax from Python 3.10.
     if model_type in ('hf', 'huggingface'):
         return HuggingFaceCompletorLoader(lm_opts['model_path'],
-                                          lm_opts['num_results'])
+                                          lm_opts['num_results'],
+                                          lm_opts.get('context_size', 256),
+                                          lm_opts.get('latency_target'),
+                                          lm_opts.get('exit_margin'),
+                                          lm_opts.get('exit_patience', 2))
     elif model_type == 'vocab':
         return VocabCompletorLoader(lm_opts['vocab_path'])
     else:
@@ -41,8 +66,12 @@ class AbstractCompletor(ABC):
     """
 
     @abstractmethod
-    def complete(self, doc: Document, line: int, char: int) -> List[str]:
-        pass
+    def complete(self, doc: Document, line: int, char: int,
+                 snippets: Sequence[str] = ()) -> List[str]:
+        """Method complete returns completion items at position line:char in
+        a document. Snippets retrieved from workspace could be used as an
+        additional context.
+        """
 
 
 class DummyCompletor(AbstractCompletor):
@@ -50,45 +79,173 @@ class DummyCompletor(AbstractCompletor):
     as a fallback interally.
     """
 
-    def complete(self, doc: Document, line: int, char: int) -> List[str]:
+    def complete(self, doc: Document, line: int, char: int,
+                 snippets: Sequence[str] = ()) -> List[str]:
         return []
 
 
 class HuggingFaceCompletor(AbstractCompletor):
 
-    def __init__(self, model_path: str, num_results: int):
-        config = AutoConfig.from_pretrained(model_path)
-        model_class_name = config.architectures[0]
-        model_class = getattr(transformers, model_class_name, None)
-        if model_class is None:
-            logging.warning('failed to find model architecture %s: fallback',
-                            model_class_name)
-            model_class = AutoModel
-        self.tokenizer = AutoTokenizer.from_pretrained(model_path)
-        self.model = model_class.from_pretrained(model_path)
+    def __init__(self, model_path: str, num_results: int,
+                 context_size: int = 256,
+                 latency_target: Optional[float] = None):
+        self.tokenizer, self.model = load_pretrained(model_path)
         self.pipeline = pipeline('fill-mask',
                                  model=self.model,
                                  tokenizer=self.tokenizer)
-        self.apply = partial(self.pipeline, top_k=num_results)
+        self.num_results = num_results
+        self.context = ContextController(self.tokenizer, context_size,
+                                         latency_target)
+        logging.info('use %s', self.context)
+
+        # Stages of inference are timed separately.
+        self.window_histogram = stage('window')
+        self.tokenize_histogram = stage('tokenize')
+        self.forward_histogram = stage('forward')
+        self.detokenize_histogram = stage('detokenize')
+
+    def complete(self, doc: Document, line: int, char: int,
+                 snippets: Sequence[str] = ()) -> List[str]:
+        # Pipeline is applied stage by stage as its __call__ does.
+        started_at = perf_counter_ns()
+        prefix, suffix = self.context.window(doc, line, char, snippets)
+        text = ''.join([prefix, self.tokenizer.mask_token, suffix])
+        windowed_at = perf_counter_ns()
+        inputs = self.pipeline.preprocess(text)
+        tokenized_at = perf_counter_ns()
+        outputs = self.pipeline.forward(inputs)
+        forwarded_at = perf_counter_ns()
+        suggest = [el['token_str'] for el in
+                   self.pipeline.postprocess(outputs, top_k=self.num_results)]
+        finished_at = perf_counter_ns()
+
+        self.window_histogram.span(started_at, windowed_at)
+        self.tokenize_histogram.span(windowed_at, tokenized_at)
+        self.forward_histogram.span(tokenized_at, forwarded_at)
+        self.detokenize_histogram.span(forwarded_at, finished_at)
+        self.context.observe((finished_at - started_at) / 1e9)
+        return suggest
+
 
-    def complete(self, doc: Document, line: int, char: int) -> List[str]:
-        prefix, suffix = doc.window(line, char)
-        text = ''.join([prefix, '<mask>', suffix])
-        suggest = [el['token_str'] for el in self.apply(text)]
+class EarlyExitCompletor(HuggingFaceCompletor):
+    """Class EarlyExitCompletor implements adaptive-depth inference. It
+    applies shared LM head to hidden states of masked token after each encoder
+    layer and stops as soon as top-k predictions are stable for several
+    consecutive layers or probability margin between top-1 and top-2 exceeds
+    a threshold.
+
+    :param margin: Threshold on probability margin between top-1 and top-2
+                   predictions. The lower the margin is the earlier inference
+                   stops (and the less accurate predictions are).
+    :param patience: Number of consecutive layers with the same top-k
+                     predictions to stop inference.
+    """
+
+    def __init__(self, model_path: str, num_results: int, margin: float,
+                 patience: int = 2, context_size: int = 256,
+                 latency_target: Optional[float] = None):
+        super().__init__(model_path, num_results, context_size,
+                         latency_target)
+        self.margin = margin
+        self.patience = patience
+        self.num_results = num_results
+        self.model.eval()
+
+        # Encoder layers and LM head are stored in different attributes for
+        # BERT-like (cls) and RoBERTa-like (lm_head) models.
+        self.base = self.model.base_model
+        self.layers = self.base.encoder.layer
+        self.head = getattr(self.model, 'lm_head', None) or self.model.cls
+
+    def complete(self, doc: Document, line: int, char: int,
+                 snippets: Sequence[str] = ()) -> List[str]:
+        started_at = perf_counter_ns()
+        prefix, suffix = self.context.window(doc, line, char, snippets)
+        text = ''.join([prefix, self.tokenizer.mask_token, suffix])
+        windowed_at = perf_counter_ns()
+        inputs = self.tokenizer(text, return_tensors='pt', truncation=True)
+        input_ids = inputs['input_ids']
+        tokenized_at = perf_counter_ns()
+        self.window_histogram.span(started_at, windowed_at)
+        self.tokenize_histogram.span(windowed_at, tokenized_at)
+        if not (positions := (input_ids[0] == self.tokenizer.mask_token_id)
+                .nonzero().flatten().tolist()):
+            # Window is longer than model input and truncation drops mask.
+            # Request is still timed and counted by context controller.
+            logging.warning('mask token is truncated: %d tokens in window',
+                            input_ids.shape[1])
+            self.context.observe((tokenized_at - started_at) / 1e9)
+            return []
+        with T.no_grad():
+            token_ids = self.predict(input_ids, inputs['attention_mask'],
+                                     positions[0])
+        forwarded_at = perf_counter_ns()
+        suggest = [self.tokenizer.decode([ix]) for ix in token_ids]
+        finished_at = perf_counter_ns()
+
+        self.forward_histogram.span(tokenized_at, forwarded_at)
+        self.detokenize_histogram.span(forwarded_at, finished_at)
+        self.context.observe((finished_at - started_at) / 1e9)
         return suggest
 
+    def predict(self, input_ids, attention_mask, pos: int) -> List[int]:
+        hidden = self.base.embeddings(input_ids=input_ids)
+        mask = self.model.get_extended_attention_mask(attention_mask,
+                                                      input_ids.shape)
+        prev: Optional[List[int]] = None
+        num_stable = 0
+        for depth, layer in enumerate(self.layers, 1):
+            started_at = perf_counter_ns()
+            hidden = layer(hidden, mask)[0]
+            probs = self.head(hidden[0, pos]).softmax(-1)
+            top = probs.topk(self.num_results)
+            token_ids = top.indices.tolist()
+            if TRACER.enabled:
+                TRACER.complete('layer', 'forward', started_at,
+                                perf_counter_ns(), {'depth': depth})
+
+            num_stable = num_stable + 1 if token_ids == prev else 0
+            prev = token_ids
+
+            if num_stable >= self.patience:
+                break
+            if len(top.values) > 1 and \
+                    top.values[0] - top.values[1] >= self.margin:
+                break
+
+        logging.debug('exit after %d of %d layers', depth, len(self.layers))
+        return token_ids
+
 
 class HuggingFaceCompletorLoader:
 
-    def __init__(self, model_path: str, num_results: int):
+    def __init__(self, model_path: str, num_results: int,
+                 context_size: int = 256,
+                 latency_target: Optional[float] = None,
+                 exit_margin: Optional[float] = None, exit_patience: int = 2):
         self.completor: HuggingFaceCompletor
         self.model_path = model_path
         self.num_results = num_results
+        self.context_size = context_size
+        self.latency_target = latency_target
+        self.exit_margin = exit_margin
+        self.exit_patience = exit_patience
 
     def load(self) -> HuggingFaceCompletor:
-        if not hasattr(self, 'completor'):
+        if hasattr(self, 'completor'):
+            return self.completor
+        if self.exit_margin is None:
             self.completor = HuggingFaceCompletor(self.model_path,
-                                                  self.num_results)
+                                                  self.num_results,
+                                                  self.context_size,
+                                                  self.latency_target)
+        else:
+            self.completor = EarlyExitCompletor(self.model_path,
+                                                self.num_results,
+                                                self.exit_margin,
+                                                self.exit_patience,
+                                                self.context_size,
+                                                self.latency_target)
         return self.completor
 
 
@@ -102,7 +259,8 @@ class VocabCompletor(AbstractCompletor):
     def __init__(self, vocab: List[str]):
         self.vocab = vocab
 
-    def complete(self, doc: Document, line: int, char: int) -> List[str]:
+    def complete(self, doc: Document, line: int, char: int,
+                 snippets: Sequence[str] = ()) -> List[str]:
         return self.vocab
 
 
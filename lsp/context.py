@@ -0,0 +1,141 @@
+#   encoding: utf8
+#   filename: context.py
+
+import logging
+
+from collections import deque
+from math import ceil
+from threading import Lock
+from typing import Deque, Optional, Sequence, Tuple
+
+from .corpus import Document
+
+__all__ = ('ContextController', )
+
+
+class ContextController:
+    """Class ContextController builds context window around cursor in tokens
+    rather than in characters. Total number of tokens in the window is bounded
+    by a budget. Since inference cost grows quadratically with sequence length,
+    the budget could be adapted at runtime in order to keep 95th percentile of
+    completion latency under target.
+
+    :param tokenizer: HuggingFace tokenizer (fast one is preferred since it
+                      provides offset mapping).
+    :param budget: Maximal number of tokens in context window.
+    :param latency_target: Target for p95 latency in seconds (optional).
+    :param prefix_ratio: Share of budget spent on text preceding cursor.
+    """
+
+    def __init__(self, tokenizer, budget: int,
+                 latency_target: Optional[float] = None,
+                 prefix_ratio: float = 0.75, min_budget: int = 16,
+                 num_samples: int = 64):
+        # Reserve room for special tokens and mask token itself.
+        max_budget = getattr(tokenizer, 'model_max_length', budget) - 3
+        self.tokenizer = tokenizer
+        self.max_budget = max(min_budget, min(budget, max_budget))
+        self.min_budget = min_budget
+        self.budget = self.max_budget
+        self.prefix_ratio = prefix_ratio
+        self.latency_target = latency_target
+
+        # Observed number of characters per token is used to estimate how
+        # many characters should be tokenized to fill the budget.
+        self.chars_per_token = 4.0
+
+        self.lock = Lock()
+        self.num_samples = num_samples
+        self.latencies: Deque[float] = deque(maxlen=num_samples)
+        self.num_observed = 0
+
+    def __str__(self) -> str:
+        return (f'ContextController(budget={self.budget}, '
+                f'max_budget={self.max_budget}, '
+                f'latency_target={self.latency_target})')
+
+    def window(self, doc: Document, line: int, char: int,
+               snippets: Sequence[str] = ()) -> Tuple[str, str]:
+        """Method window returns text preceding to and succeeding cursor
+        position at line:char so that both of them fit token budget. If
+        document has parse tree then headers of enclosing scopes and relevant
+        imports are prepended to the prefix. Retrieved snippets are prepended
+        to the prefix as well (the most relevant ones go first).
+        """
+        budget = self.budget
+        num_prefix = ceil(budget * self.prefix_ratio)
+        num_suffix = budget - num_prefix
+
+        # Take character window with some slack and cut it to token budget.
+        span = int(2 * self.chars_per_token * max(num_prefix, num_suffix)) + 16
+        prefix, suffix = doc.window(line, char, span)
+        suffix, _ = self.cut(suffix, num_suffix, tail=False)
+
+        # Retrieved snippets take up to a quarter of prefix budget.
+        context, num_context = '', 0
+        if snippets:
+            context, num_context = self.cut(''.join(snippets),
+                                            num_prefix // 4, tail=False)
+        prefix, _ = self.cut(prefix, num_prefix - num_context, tail=True)
+
+        if doc.syntax is None:
+            return context + prefix, suffix
+
+        # Outline takes up to half of the rest of prefix budget. The rest is
+        # spent on nearby lines.
+        num_prefix -= num_context
+        pos = doc.offset(line, char) or 0
+        outline = doc.outline(line, char, pos - len(prefix), prefix + suffix)
+        outline, num_outline = self.cut(outline, num_prefix // 2, tail=True)
+        if num_outline:
+            prefix, _ = self.cut(prefix, num_prefix - num_outline, tail=True)
+        return context + outline + prefix, suffix
+
+    def cut(self, text: str, num_tokens: int,
+            tail: bool) -> Tuple[str, int]:
+        """Method cut returns either head or tail of a text which consists of
+        at most num_tokens tokens and actual number of tokens.
+        """
+        if not text or num_tokens <= 0:
+            return '', 0
+
+        encoding = self.tokenizer(text, add_special_tokens=False,
+                                  return_offsets_mapping=True)
+        offsets = encoding['offset_mapping']
+        if offsets:
+            ratio = len(text) / len(offsets)
+            self.chars_per_token = 0.9 * self.chars_per_token + 0.1 * ratio
+
+        if len(offsets) <= num_tokens:
+            return text, len(offsets)
+        elif tail:
+            return text[offsets[-num_tokens][0]:], num_tokens
+        else:
+            return text[:offsets[num_tokens - 1][1]], num_tokens
+
+    def observe(self, elapsed: float):
+        """Method observe records latency of a completion request and adapts
+        token budget if latency target is set.
+        """
+        if self.latency_target is None:
+            return
+
+        with self.lock:
+            self.latencies.append(elapsed)
+            self.num_observed += 1
+            # Adapt budget once per a quarter of sample window in order to
+            # let new budget affect percentile.
+            if self.num_observed % max(1, self.num_samples // 4):
+                return
+            latencies = sorted(self.latencies)
+            p95 = latencies[int(0.95 * (len(latencies) - 1))]
+            budget = self.budget
+            if p95 > self.latency_target:
+                budget = max(self.min_budget, int(budget * 0.8))
+            elif p95 < 0.7 * self.latency_target:
+                budget = min(self.max_budget, int(budget * 1.1) + 1)
+
+            if budget != self.budget:
+                logging.info('adapt context budget %d -> %d tokens (p95 is '
+                             '%.1f ms)', self.budget, budget, p95 * 1e3)
+                self.budget = budget
@@ -1,9 +1,13 @@
 #   encoding: utf8
 #   filename: corpus.py
 
-from typing import Dict, Optional
+from typing import Any, Dict, Iterable, List, Optional, Tuple
 
-__all__ = ('Document', 'Corpus')
+import numpy as np
+
+from .syntax import SyntaxTree, make_syntax_tree
+
+__all__ = ('Document', 'Corpus', 'from_utf16', 'utf16_length')
 
 
 def locate(text: str, line: int, char: int) -> Optional[int]:
@@ -13,27 +17,142 @@ def locate(text: str, line: int, char: int) -> Optional[int]:
     pos = 0
 
     # Find line first.
-    cur_line = 0
-    while pos < len(text) and cur_line != line:
-        pos = text.index('\n', pos) + 1
-        cur_line += 1
-
-    # Find character in the line.
-    for cur_char, c in enumerate(text[pos:pos + char]):
-        pos += 1
-        if c in '\r\n':
+    for _ in range(line):
+        if (pos := text.find('\n', pos) + 1) == 0:
             return None
-    if cur_char + 1 != char:
+
+    # Find character in the line. Cursor is allowed to be right after the
+    # last character of a line.
+    if (end := text.find('\n', pos)) == -1:
+        end = len(text)
+    elif end > pos and text[end - 1] == '\r':
+        end -= 1
+    if pos + char > end:
         return None
 
-    return pos
+    return pos + char
+
+
+def positions(text: str, offsets: Iterable[int]) -> List[Tuple[int, int]]:
+    """Function positions converts sorted character offsets to pairs of line
+    and character in a single pass over text.
+    """
+    result = []
+    line, prev, line_start = 0, 0, 0
+    for offset in offsets:
+        line += text.count('\n', prev, offset)
+        line_start = text.rfind('\n', line_start, offset) + 1 or line_start
+        result.append((line, offset - line_start))
+        prev = offset
+    return result
+
+
+def utf16_length(text: str) -> int:
+    """Function utf16_length returns length of text in UTF-16 code units
+    which are units of LSP positions.
+    """
+    if text.isascii():
+        return len(text)
+    return len(text.encode('utf-16-le')) // 2
+
+
+def from_utf16(line: str, units: int) -> int:
+    """Function from_utf16 converts column of a line in UTF-16 code units to
+    column in characters. Column beyond the line stays beyond it and column
+    inside of surrogate pair points to the pair.
+    """
+    if line.isascii():
+        return units
+    data = line.encode('utf-16-le')
+    if 2 * units >= len(data):
+        return len(line) + units - len(data) // 2
+    return len(data[:2 * units].decode('utf-16-le', 'ignore'))
+
+
+def line_starts(lines: List[str], first: int = 0,
+                encode: bool = False) -> np.ndarray:
+    """Function line_starts returns offsets of beginnings of lines (in
+    characters or in UTF-8 bytes) provided that the first line starts at
+    offset first.
+    """
+    if encode:
+        lengths = [len(line.encode('utf-8')) + 1 for line in lines]
+    else:
+        lengths = [len(line) + 1 for line in lines]
+    starts = np.empty(len(lines), np.int64)
+    starts[0] = first
+    np.cumsum(lengths[:-1], out=starts[1:])
+    starts[1:] += first
+    return starts
+
+
+class LineIndex:
+    """Class LineIndex maintains offsets of line beginnings in characters
+    and in UTF-8 bytes. Position lookup costs a few array accesses and an
+    edit splices offsets of changed lines and shifts the following ones
+    without a pass over text in Python.
+    """
+
+    def __init__(self, text: str):
+        self.reset(text)
+
+    def __len__(self) -> int:
+        return len(self.chars)
+
+    def reset(self, text: str):
+        # Line breaks are found in encoded text with numpy. Offsets of
+        # characters and bytes are the same unless text is not ASCII.
+        data = text.encode('utf-8')
+        breaks = np.flatnonzero(np.frombuffer(data, np.uint8) == 0x0a)
+        self.bytes = np.concatenate([[0], breaks + 1]).astype(np.int64)
+        if len(data) == len(text):
+            self.chars = self.bytes.copy()
+        else:
+            self.chars = line_starts(text.split('\n'))
+
+    def edit(self, first: int, last: int, begin: int, begin_byte: int,
+             delta: int, delta_bytes: int, text: str):
+        """Method edit updates offsets after replacement of text between
+        lines first and last (inclusive) which starts at offset begin (and
+        byte offset begin_byte). Lengths of text change by delta characters
+        and delta_bytes bytes.
+        """
+        if first == last and '\n' not in text:
+            # Typing within a line shifts the following lines in place.
+            self.chars[last + 1:] += delta
+            self.bytes[last + 1:] += delta_bytes
+            return
+        if '\n' in text:
+            lines = text.split('\n')
+            # Offsets of lines which begin inside of inserted text.
+            chars = line_starts(lines, begin)[1:]
+            bytes_ = line_starts(lines, begin_byte, not text.isascii())[1:]
+        else:
+            chars = bytes_ = self.chars[:0]
+        self.chars = np.concatenate([self.chars[:first + 1], chars,
+                                     self.chars[last + 1:] + delta])
+        self.bytes = np.concatenate([self.bytes[:first + 1], bytes_,
+                                     self.bytes[last + 1:] + delta_bytes])
 
 
 class Document:
+    """Class Document holds text of a document opened in editor. It maintains
+    parse tree of the document if syntax layer is enabled.
+
+    :param content: Text of the document.
+    :param language: LSP language identifier (e.g. python).
+    :param syntax: Whether to build parse tree of the document.
+    """
 
-    def __init__(self, content: str):
+    def __init__(self, content: str, language: Optional[str] = None,
+                 syntax: bool = False):
         self.content = content
+        self.lines = LineIndex(content)
         self.version = 0
+        self.language = language
+        self.syntax: Optional[SyntaxTree] = None
+        if syntax:
+            self.syntax = make_syntax_tree(language, content)
 
     @property
     def text(self) -> str:
@@ -41,22 +160,148 @@ class Document:
 
     def set(self, content: str):
         self.content = content
+        self.lines.reset(content)
+        if self.syntax:
+            self.syntax.reset(content)
+
+    def apply(self, range_: Dict[str, Any], text: str):
+        """Method apply replaces text in range (LSP Range object) with new
+        text. Parse tree is updated incrementally. Positions beyond the end
+        of a line or a document are clamped as LSP requires.
+        """
+        start, end = range_['start'], range_['end']
+        first, begin = self.clamp(start['line'], start['character'])
+        last, until = self.clamp(end['line'], end['character'])
+        if until < begin:
+            raise ValueError(f'Invalid range for document: {range_}.')
+        begin_byte = self.byte_offset(first, begin)
+        until_byte = self.byte_offset(last, until)
+        text_bytes = text.encode('utf-8')
+        if self.syntax:
+            self.syntax.edit(begin_byte, until_byte, text_bytes,
+                             (first, begin_byte -
+                              int(self.lines.bytes[first])),
+                             (last, until_byte - int(self.lines.bytes[last])))
+        self.lines.edit(first, last, begin, begin_byte,
+                        len(text) - (until - begin),
+                        len(text_bytes) - (until_byte - begin_byte), text)
+        self.content = ''.join([self.content[:begin], text,
+                                self.content[until:]])
+
+    def line_span(self, line: int) -> Tuple[int, int]:
+        # Line break (either \n or \r\n) is excluded.
+        pos = int(self.lines.chars[line])
+        if line + 1 < len(self.lines):
+            end = int(self.lines.chars[line + 1]) - 1
+        else:
+            end = len(self.content)
+        if end > pos and self.content[end - 1] == '\r':
+            end -= 1
+        return pos, end
+
+    def offset(self, line: int, char: int) -> Optional[int]:
+        """Method offset returns character offset of position line:char
+        (char is in UTF-16 code units) or None if there is no such position
+        (see locate).
+        """
+        if not 0 <= line < len(self.lines) or char < 0:
+            return None
+        pos, end = self.line_span(line)
+        char = from_utf16(self.content[pos:end], char)
+        if pos + char > end:
+            return None
+        return pos + char
+
+    def clamp(self, line: int, char: int) -> Tuple[int, int]:
+        """Method clamp returns line and character offset of position
+        line:char. Position beyond the end of a line or a document is moved
+        to the end.
+        """
+        if line < 0 or char < 0:
+            raise ValueError(f'Invalid position: {line}:{char}.')
+        if line >= len(self.lines):
+            line = len(self.lines) - 1
+            return line, len(self.content)
+        pos, end = self.line_span(line)
+        return line, min(pos + from_utf16(self.content[pos:end], char), end)
+
+    def column(self, line: int, pos: int) -> int:
+        """Method column returns column of character offset pos at a line in
+        UTF-16 code units.
+        """
+        return utf16_length(self.content[int(self.lines.chars[line]):pos])
+
+    def slice_lines(self, line: int, num_lines: int) -> str:
+        """Method slice_lines returns text of num_lines lines starting with
+        line (with line breaks).
+        """
+        starts = self.lines.chars
+        if not 0 <= line < len(starts):
+            return ''
+        begin = int(starts[line])
+        if line + num_lines < len(starts):
+            return self.content[begin:int(starts[line + num_lines])]
+        return self.content[begin:]
+
+    def byte_offset(self, line: int, pos: int) -> int:
+        """Method byte_offset converts character offset pos at a line to
+        offset in UTF-8 encoded text. Only prefix of the line is encoded.
+        """
+        start = int(self.lines.chars[line])
+        prefix = self.content[start:pos]
+        width = len(prefix) if prefix.isascii() else \
+            len(prefix.encode('utf-8'))
+        return int(self.lines.bytes[line]) + width
+
+    def positions(self, offsets: Iterable[int]) -> List[Tuple[int, int]]:
+        return positions(self.content, offsets)
 
     def window(self, line: int, char: int, window: int = 128):
         """Method window returns text preceding to and succeeding cursor
         position at line:char. Length of prefix and suffix are bounded.
         """
-        pos = locate(self.content, line, char)
+        pos = self.offset(line, char)
         begin, end = max(0, pos - window), min(pos + window, len(self.content))
         prefix = self.content[begin:pos]
         suffix = self.content[pos + 1:end]
         return prefix, suffix
 
+    def word_at(self, line: int, char: int) -> Optional[Tuple[str, int]]:
+        """Method word_at returns word under cursor and its starting
+        character in the line.
+        """
+        if (pos := self.offset(line, char)) is None:
+            return None
+        begin = end = pos
+        while begin > 0 and self.content[begin - 1].isalnum():
+            begin -= 1
+        while end < len(self.content) and self.content[end].isalnum():
+            end += 1
+        if begin == end:
+            return None
+        return self.content[begin:end], \
+            char - utf16_length(self.content[begin:pos])
+
+    def outline(self, line: int, char: int, begin: int, window: str) -> str:
+        """Method outline returns syntax-aware context (relevant imports and
+        headers of enclosing scopes) which precedes character offset begin.
+        It returns empty string if syntax layer is not available.
+        """
+        if not self.syntax:
+            return ''
+        if (pos := self.offset(line, char)) is None:
+            return ''
+        pos_bytes = self.byte_offset(line, pos)
+        begin_line = line - self.content.count('\n', begin, pos)
+        begin_bytes = self.byte_offset(begin_line, begin)
+        return self.syntax.outline(pos_bytes, begin_bytes, window)
+
 
 class Corpus:
 
-    def __init__(self):
+    def __init__(self, syntax: bool = False):
         self.docs: Dict[str, Document] = {}
+        self.syntax = syntax
 
     def __str__(self) -> str:
         return f'Corpus(nodocs={len(self.docs)})'
@@ -64,8 +309,11 @@ class Corpus:
     def get(self, uri: str) -> Document:
         return self.docs[uri]
 
-    def open(self, uri: str, text: str):
-        self.docs[uri] = Document(text)
+    def open(self, uri: str, text: str, language: Optional[str] = None):
+        self.docs[uri] = Document(text, language, self.syntax)
 
     def set(self, uri: str, text: str):
         self.docs[uri].set(text)
+
+    def apply(self, uri: str, range_: Dict[str, Any], text: str):
+        self.docs[uri].apply(range_, text)
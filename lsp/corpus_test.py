@@ -0,0 +1,35 @@
+#   encoding: utf8
+#   filename: corpus_test.py
+
+import pytest
+
+from .corpus import Document
+
+
+def make_range(line: int, char: int, end_line: int, end_char: int):
+    return {'start': {'line': line, 'character': char},
+            'end': {'line': end_line, 'character': end_char}}
+
+
+def test_apply_utf16():
+    # Astral characters take two UTF-16 code units in LSP positions.
+    doc = Document('x = "😀😀"\nprint(x)\n')
+    doc.apply(make_range(0, 7, 0, 9), '🙂')
+    assert doc.text == 'x = "😀🙂"\nprint(x)\n'
+    doc.apply(make_range(0, 9, 1, 5), '"\nlog')
+    assert doc.text == 'x = "😀🙂"\nlog(x)\n'
+    assert doc.offset(0, 9) == 7
+    assert doc.offset(0, 11) is None
+    assert doc.word_at(1, 1) == ('log', 0)
+    assert Document('😀 name').word_at(0, 4) == ('name', 3)
+
+
+def test_apply_clamp():
+    # Positions beyond the end of a line or a document are clamped.
+    doc = Document('ab\r\ncd')
+    doc.apply(make_range(0, 10, 0, 10), 'X')
+    assert doc.text == 'abX\r\ncd'
+    doc.apply(make_range(5, 0, 6, 0), 'Y')
+    assert doc.text == 'abX\r\ncdY'
+    with pytest.raises(ValueError):
+        doc.apply(make_range(1, 1, 0, 0), '')
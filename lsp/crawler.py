@@ -0,0 +1,325 @@
+#   encoding: utf8
+#   filename: crawler.py
+"""Parallel crawler of workspace folders. It walks directory trees with a pool
+of low priority threads, respects .gitignore files, skips binary files, and
+streams text files to consumer.
+"""
+
+import logging
+
+from dataclasses import dataclass, field
+from hashlib import blake2b
+from os import O_RDONLY, close, fstat, open as open_fd, read, scandir, sep
+from os.path import abspath
+from queue import Queue
+from re import compile as compile_regex, escape
+from threading import Lock, Thread, get_native_id
+from time import perf_counter
+from typing import (Callable, Iterable, Iterator, List, Optional, Pattern,
+                    Tuple)
+
+__all__ = (
+    'CrawledFile',
+    'Crawler',
+    'IgnoreRule',
+    'lower_priority',
+    'parse_gitignore',
+    'read_file',
+)
+
+
+MAX_FILE_SIZE = 1 << 20
+
+# The same heuristic as git uses: a file is binary if there is NUL byte among
+# first 8000 bytes.
+SNIFF_SIZE = 8000
+
+Meta = Tuple[int, int, int]
+
+Accept = Callable[[str, int, int], bool]
+
+
+@dataclass
+class CrawledFile:
+    """Class CrawledFile represents content of a text file and its metadata
+    (modification time, size, and content digest).
+    """
+
+    path: str
+
+    meta: Meta
+
+    text: str
+
+
+@dataclass
+class CrawlStats:
+
+    num_files: int = 0
+
+    num_bytes: int = 0
+
+    num_binaries: int = 0
+
+    num_ignored: int = 0
+
+    started_at: float = field(default_factory=perf_counter)
+
+    def __str__(self) -> str:
+        elapsed = max(perf_counter() - self.started_at, 1e-9)
+        return (f'crawled {self.num_files} files '
+                f'({self.num_bytes / 2**20:.1f} MiB) in {elapsed:.2f} s: '
+                f'{self.num_files / elapsed:.0f} files/s, '
+                f'{self.num_bytes / 2**20 / elapsed:.1f} MiB/s; '
+                f'skipped {self.num_binaries} binary and {self.num_ignored} '
+                'ignored files')
+
+
+def lower_priority():
+    """Function lower_priority lowers scheduling priority of a calling thread
+    (on Linux priority is per-thread) so that background work does not delay
+    interactive requests.
+    """
+    try:
+        from os import PRIO_PROCESS, setpriority
+        setpriority(PRIO_PROCESS, get_native_id(), 19)
+    except (ImportError, OSError):
+        pass
+    try:
+        from os import SCHED_IDLE, sched_param, sched_setscheduler
+        sched_setscheduler(0, SCHED_IDLE, sched_param(0))
+    except (ImportError, OSError):
+        pass
+
+
+def read_file(path: str, max_size: int = MAX_FILE_SIZE
+              ) -> Optional[Tuple[Meta, str]]:
+    """Function read_file reads a file with a single large sequential read.
+    It returns None if a file is binary or too large.
+    """
+    fd = open_fd(path, O_RDONLY)
+    try:
+        stat = fstat(fd)
+        if stat.st_size > max_size:
+            return None
+        chunks = []
+        while (chunk := read(fd, max(stat.st_size, 1 << 16))):
+            chunks.append(chunk)
+    finally:
+        close(fd)
+    data = b''.join(chunks)
+    if b'\0' in data[:SNIFF_SIZE]:
+        return None
+    digest = blake2b(data, digest_size=8).digest()
+    meta = (stat.st_mtime_ns, stat.st_size, int.from_bytes(digest, 'little'))
+    return meta, data.decode('utf-8', errors='ignore')
+
+
+@dataclass
+class IgnoreRule:
+    """Class IgnoreRule is a compiled pattern of .gitignore file which applies
+    to paths relative to base directory.
+    """
+
+    base: str
+
+    regex: Pattern
+
+    negate: bool
+
+    dir_only: bool
+
+    def match(self, path: str, is_dir: bool) -> bool:
+        if self.dir_only and not is_dir:
+            return False
+        return self.regex.match(path[len(self.base) + 1:]) is not None
+
+
+def translate(pattern: str) -> str:
+    """Function translate converts glob pattern of .gitignore to regular
+    expression.
+    """
+    result = []
+    i, n = 0, len(pattern)
+    while i < n:
+        if pattern.startswith('**/', i):
+            result.append('(?:.*/)?')
+            i += 3
+        elif pattern.startswith('/**', i) and i + 3 == n:
+            result.append('(?:/.*)?')
+            i += 3
+        elif pattern.startswith('**', i):
+            result.append('.*')
+            i += 2
+        elif (char := pattern[i]) == '*':
+            result.append('[^/]*')
+            i += 1
+        elif char == '?':
+            result.append('[^/]')
+            i += 1
+        elif char == '[' and (end := pattern.find(']', i + 2)) != -1:
+            body = pattern[i + 1:end]
+            if body[0] == '!':
+                body = '^' + body[1:]
+            result.append('[' + body.replace('\\', '\\\\') + ']')
+            i = end + 1
+        elif char == '\\' and i + 1 < n:
+            result.append(escape(pattern[i + 1]))
+            i += 2
+        else:
+            result.append(escape(char))
+            i += 1
+    return ''.join(result)
+
+
+def parse_gitignore(base: str, lines: Iterable[str]) -> List[IgnoreRule]:
+    rules = []
+    for line in lines:
+        line = line.rstrip('\n').rstrip()
+        if not line or line.startswith('#'):
+            continue
+        negate = line.startswith('!')
+        if negate:
+            line = line[1:]
+        dir_only = line.endswith('/')
+        line = line.rstrip('/')
+        # Pattern with slash in the beginning or in the middle is relative to
+        # the directory of .gitignore file.
+        anchored = '/' in line
+        line = line.lstrip('/')
+        if not line:
+            continue
+        regex = ('' if anchored else '(?:.*/)?') + translate(line) + '$'
+        rules.append(IgnoreRule(base, compile_regex(regex), negate, dir_only))
+    return rules
+
+
+def is_ignored(rules: List[IgnoreRule], path: str, is_dir: bool) -> bool:
+    # The last matching rule wins.
+    for rule in reversed(rules):
+        if rule.match(path, is_dir):
+            return not rule.negate
+    return False
+
+
+class Crawler:
+    """Class Crawler walks directory trees and reads text files in a pool of
+    threads. Directory listing and reading of files are pipelined: a thread
+    which lists a directory schedules its subdirectories and files as separate
+    tasks so that other threads read files while directories are listed.
+
+    :param num_threads: Number of crawling threads.
+    :param suffixes: File suffixes to crawl (all files by default).
+    :param accept: Predicate on path, modification time, and size of a file
+                   which decides whether a file should be read.
+    :param queue_size: Maximal number of read files which are not consumed.
+    """
+
+    def __init__(self, num_threads: int = 4,
+                 suffixes: Optional[Iterable[str]] = None,
+                 accept: Optional[Accept] = None,
+                 max_file_size: int = MAX_FILE_SIZE,
+                 queue_size: int = 256):
+        self.num_threads = num_threads
+        self.suffixes = tuple(suffixes or ())
+        self.accept = accept
+        self.max_file_size = max_file_size
+        self.queue_size = queue_size
+        self.stats = CrawlStats()
+
+    def crawl(self, roots: Iterable[str]) -> Iterator[CrawledFile]:
+        self.stats = CrawlStats()
+        self.tasks: Queue = Queue()
+        self.output: Queue = Queue(self.queue_size)
+        self.lock = Lock()
+        self.num_pending = 0
+
+        # Nested workspace folders are crawled as a part of enclosing ones.
+        prev = None
+        for root in sorted(abspath(root) for root in roots):
+            if prev is None or not root.startswith(prev.rstrip(sep) + sep):
+                self.schedule(('dir', root, []))
+                prev = root
+        if not self.num_pending:
+            return
+
+        threads = [Thread(target=self.work, name=f'[lsp] crawler/{i}',
+                          daemon=True) for i in range(self.num_threads)]
+        for thread in threads:
+            thread.start()
+
+        num_finished = 0
+        while num_finished < len(threads):
+            if (item := self.output.get()) is None:
+                num_finished += 1
+            else:
+                yield item
+        logging.info('%s', self.stats)
+
+    def schedule(self, task):
+        with self.lock:
+            self.num_pending += 1
+        self.tasks.put(task)
+
+    def work(self):
+        lower_priority()
+        while (task := self.tasks.get()) is not None:
+            try:
+                kind, path, rules = task
+                if kind == 'dir':
+                    self.list_dir(path, rules)
+                else:
+                    self.read_file(path)
+            except OSError as e:
+                logging.debug('failed to crawl %s: %s', task[1], e)
+            except Exception:
+                logging.exception('failed to crawl %s', task[1])
+            finally:
+                with self.lock:
+                    self.num_pending -= 1
+                    done = self.num_pending == 0
+                # Wake up all threads in order to stop them.
+                if done:
+                    for _ in range(self.num_threads):
+                        self.tasks.put(None)
+        self.output.put(None)
+
+    def list_dir(self, path: str, rules: List[IgnoreRule]):
+        with scandir(path) as it:
+            entries = list(it)
+
+        for entry in entries:
+            if entry.name == '.gitignore' and entry.is_file():
+                with open(entry.path, errors='ignore') as fin:
+                    rules = rules + parse_gitignore(path, fin)
+                break
+
+        for entry in entries:
+            if entry.name.startswith('.'):
+                continue
+            is_dir = entry.is_dir(follow_symlinks=False)
+            if is_ignored(rules, entry.path, is_dir):
+                with self.lock:
+                    self.stats.num_ignored += 1
+            elif is_dir:
+                self.schedule(('dir', entry.path, rules))
+            elif entry.is_file() and entry.name.endswith(self.suffixes or ''):
+                stat = entry.stat()
+                if stat.st_size > self.max_file_size:
+                    continue
+                if self.accept and not self.accept(entry.path,
+                                                   stat.st_mtime_ns,
+                                                   stat.st_size):
+                    continue
+                self.schedule(('file', entry.path, rules))
+
+    def read_file(self, path: str):
+        result = read_file(path, self.max_file_size)
+        with self.lock:
+            if result is None:
+                self.stats.num_binaries += 1
+                return
+            self.stats.num_files += 1
+            self.stats.num_bytes += result[0][1]
+        meta, text = result
+        self.output.put(CrawledFile(path, meta, text))
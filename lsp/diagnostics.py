@@ -0,0 +1,221 @@
+#   encoding: utf8
+#   filename: diagnostics.py
+"""Incremental diagnostics pipeline. Documents are split into blocks of lines
+(see split_blocks) and checks are applied to blocks rather than to whole
+documents. Results of a check are cached by block hash in block-relative
+coordinates so that an edit re-checks only the blocks it touched while
+diagnostics of the other blocks are just shifted to their new lines.
+"""
+
+import logging
+import sys
+
+from collections import OrderedDict
+from dataclasses import dataclass
+from threading import Lock, Timer
+from time import perf_counter
+from typing import Any, Callable, Dict, List, Optional, Set, Tuple, Union
+
+from .background import BackgroundExecutor, checkpoint
+from .corpus import utf16_length
+from .retrieval import split_blocks
+
+__all__ = ('BatchedCheck', 'Check', 'Diagnostics', 'Finding')
+
+
+# Finding is a block-relative diagnostic: line, character, length, severity,
+# and message.
+Finding = Tuple[int, int, int, int, str]
+
+# Check is a function which finds issues in a block of text. Batched check
+# takes a list of blocks and returns a list of findings per block.
+Check = Callable[[str], List[Finding]]
+
+BatchedCheck = Callable[[List[str]], List[List[Finding]]]
+
+Publisher = Callable[[str, List[Dict[str, Any]]], None]
+
+
+@dataclass
+class Pending:
+
+    timer: Timer
+
+    generation: int
+
+
+class Diagnostics:
+    """Class Diagnostics runs checks over changed blocks of documents and
+    publishes merged diagnostics after a debounce delay.
+
+    :param publish: Function which sends diagnostics of a document to client.
+    :param delay: Debounce delay in seconds.
+    :param cache_size: Maximal number of cached results of block checks.
+    :param executor: Background executor to run checks in.
+    """
+
+    def __init__(self, publish: Publisher, delay: float = 0.2,
+                 cache_size: int = 1 << 16,
+                 executor: Optional[BackgroundExecutor] = None):
+        self.publish = publish
+        self.executor = executor
+        self.delay = delay
+        self.cache_size = cache_size
+        self.checks: Dict[str, Union[Check, BatchedCheck]] = {}
+        self.batched: Set[str] = set()
+        self.cache: OrderedDict = OrderedDict()
+        self.pending: Dict[str, Pending] = {}
+        self.generations: Dict[str, int] = {}
+        self.lock = Lock()
+
+    def __str__(self) -> str:
+        return (f'Diagnostics(checks={",".join(self.checks)}, '
+                f'nocached={len(self.cache)})')
+
+    def add_check(self, code: str, check: Union[Check, BatchedCheck],
+                  batched: bool = False):
+        self.checks[code] = check
+        if batched:
+            self.batched.add(code)
+
+    def update(self, uri: str, text: str, debounce: bool = True):
+        """Method update schedules diagnostics of a document. Diagnostics are
+        published after debounce delay since the last update unless debounce
+        is disabled.
+        """
+        with self.lock:
+            generation = self.generations.get(uri, 0) + 1
+            self.generations[uri] = generation
+            if (pending := self.pending.pop(uri, None)) is not None:
+                pending.timer.cancel()
+            if debounce and self.delay > 0:
+                timer = Timer(self.delay, self.schedule,
+                              args=(uri, text, generation))
+                timer.name = '[lsp] diagnostics'
+                timer.daemon = True
+                self.pending[uri] = Pending(timer, generation)
+                timer.start()
+                return
+        self.schedule(uri, text, generation)
+
+    def close(self, uri: str):
+        with self.lock:
+            self.generations.pop(uri, None)
+            if (pending := self.pending.pop(uri, None)) is not None:
+                pending.timer.cancel()
+        self.publish(uri, [])
+
+    def schedule(self, uri: str, text: str, generation: int):
+        if self.executor is None:
+            self.run(uri, text, generation)
+        else:
+            self.executor.submit(self.run, uri, text, generation,
+                                 key=('diagnostics', uri))
+
+    def run(self, uri: str, text: str, generation: int):
+        try:
+            diagnostics = self.diagnose(uri, text)
+        except Exception:
+            logging.exception('failed to diagnose %s', uri)
+            return
+        with self.lock:
+            # Diagnostics of outdated text are dropped since newer ones are
+            # scheduled.
+            if self.generations.get(uri) != generation:
+                return
+            if (pending := self.pending.get(uri)) is not None and \
+                    pending.generation == generation:
+                del self.pending[uri]
+        self.publish(uri, diagnostics)
+
+    def diagnose(self, uri: str, text: str) -> List[Dict[str, Any]]:
+        """Method diagnose applies checks to blocks of text which are not
+        cached yet and returns diagnostics of the whole text. Blocks missed
+        by batched checks are passed to them at once.
+        """
+        started_at = perf_counter()
+        blocks = []
+        results: Dict[Tuple[str, int], List[Finding]] = {}
+        misses: Dict[str, Dict[int, str]] = {code: {} for code in self.checks}
+        for first_line, block in split_blocks(text):
+            # Cache lives in process memory so that salted builtin hash is
+            # enough and it is much faster than cryptographic one.
+            block_hash = hash(block)
+            blocks.append((first_line, block_hash, block))
+            for code in self.checks:
+                if (findings := self.lookup(code, block_hash)) is None:
+                    misses[code][block_hash] = block
+                else:
+                    results[code, block_hash] = findings
+
+        num_checked = 0
+        for code, missed in misses.items():
+            num_checked += len(missed)
+            if not missed:
+                continue
+            if code in self.batched:
+                batch = self.checks[code](list(missed.values()))
+            else:
+                batch = []
+                for block in missed.values():
+                    checkpoint()
+                    batch.append(self.checks[code](block))
+            for block_hash, findings in zip(missed, batch):
+                self.store(code, block_hash, findings)
+                results[code, block_hash] = findings
+
+        diagnostics = []
+        for first_line, block_hash, block in blocks:
+            # Columns of findings are in characters while LSP counts UTF-16
+            # code units.
+            lines = None if block.isascii() else block.split('\n')
+            for code in self.checks:
+                findings = results[code, block_hash]
+                for line, char, length, severity, message in findings:
+                    if lines is not None:
+                        text = lines[line]
+                        length = utf16_length(text[char:char + length])
+                        char = utf16_length(text[:char])
+                    line += first_line
+                    diagnostics.append({
+                        'range': {
+                            'start': {'line': line, 'character': char},
+                            'end': {'line': line,
+                                    'character': char + length},
+                        },
+                        'severity': severity,
+                        'code': code,
+                        'source': 'lsp-lm',
+                        'message': message,
+                    })
+        logging.info('found %d issues in %s in %.1f ms (%d of %d block '
+                     'checks missed cache)', len(diagnostics), uri,
+                     (perf_counter() - started_at) * 1e3, num_checked,
+                     len(blocks) * len(self.checks))
+        return diagnostics
+
+    def lookup(self, code: str, block_hash: int) -> Optional[List[Finding]]:
+        with self.lock:
+            if (findings := self.cache.get((code, block_hash))) is not None:
+                self.cache.move_to_end((code, block_hash))
+            return findings
+
+    def store(self, code: str, block_hash: int, findings: List[Finding]):
+        with self.lock:
+            self.cache[code, block_hash] = findings
+            while len(self.cache) > self.cache_size:
+                self.cache.popitem(last=False)
+
+    def evict(self, nbytes: int) -> int:
+        """Method evict drops least recently used results until about nbytes
+        are released and returns number of released bytes.
+        """
+        released = 0
+        with self.lock:
+            while self.cache and released < nbytes:
+                key, findings = self.cache.popitem(last=False)
+                released += sys.getsizeof(key) + sys.getsizeof(findings)
+                released += sum(sys.getsizeof(finding) +
+                                sys.getsizeof(finding[-1])
+                                for finding in findings)
+        return released
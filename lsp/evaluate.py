@@ -0,0 +1,193 @@
+#   encoding: utf8
+#   filename: evaluate.py
+"""Offline accuracy-versus-latency evaluation of completion backends. Cursor
+positions are sampled at word beginnings of a local corpus, the word is
+hidden, and a completor is asked to predict it. Accuracy and latency are
+reported together so that every configuration (quantisation, pruning, early
+exit, context size) is a point on accuracy-latency plane.
+"""
+
+import logging
+
+from concurrent.futures import ThreadPoolExecutor
+from dataclasses import asdict, dataclass, fields
+from pathlib import Path
+from random import Random
+from re import compile as compile_regex
+from time import perf_counter
+from typing import Iterable, List, Optional, Set, Tuple
+
+import numpy as np
+
+from .completion import AbstractCompletor
+from .corpus import Document, positions, utf16_length
+from .prune import read_corpus
+
+__all__ = ('EvaluationReport', 'Sample', 'evaluate', 'sample_positions')
+
+
+WORD_REGEX = compile_regex(r'\w+')
+
+
+@dataclass
+class Sample:
+    """Class Sample is a document with a hidden word and a cursor at the
+    place of the word.
+    """
+
+    text: str
+
+    line: int
+
+    char: int
+
+    target: str
+
+
+@dataclass
+class EvaluationReport:
+
+    label: str
+
+    num_samples: int
+
+    top_k: int
+
+    top1: float
+
+    topk: float
+
+    mrr: float
+
+    latency_mean: float
+
+    latency_p50: float
+
+    latency_p95: float
+
+    latency_p99: float
+
+    throughput: float
+
+    def __str__(self) -> str:
+        rows = [
+            ('Configuration', self.label),
+            ('Number of samples', self.num_samples),
+            ('Top-1 accuracy', f'{self.top1:.3f}'),
+            (f'Top-{self.top_k} accuracy', f'{self.topk:.3f}'),
+            (f'MRR@{self.top_k}', f'{self.mrr:.3f}'),
+            ('Latency p50, ms', f'{self.latency_p50:.1f}'),
+            ('Latency p95, ms', f'{self.latency_p95:.1f}'),
+            ('Latency p99, ms', f'{self.latency_p99:.1f}'),
+            ('Throughput, samples/s', f'{self.throughput:.1f}'),
+        ]
+        return '\n'.join(f'{name + ":":<24}{value}' for name, value in rows)
+
+    def write_csv(self, path: Path):
+        """Method write_csv appends report as a row to CSV file so that runs
+        of different configurations are collected in the same table.
+        """
+        columns = [field.name for field in fields(self)]
+        row = asdict(self)
+        exists = path.exists() and path.stat().st_size > 0
+        with open(path, 'a') as fout:
+            if not exists:
+                fout.write(','.join(columns) + '\n')
+            fout.write(','.join(str(row[column]) for column in columns))
+            fout.write('\n')
+
+
+def make_sample(text: str, begin: int, end: int, window: int) -> Sample:
+    start = max(0, begin - window)
+    start = text.find('\n', start, begin) + 1 or start
+    stop = min(len(text), end + window)
+    content = ''.join([text[start:begin], ' ', text[end:stop]])
+    (line, char), = positions(content, [begin - start])
+    # Completors take LSP columns in UTF-16 code units.
+    char = utf16_length(content[begin - start - char:begin - start])
+    return Sample(content, line, char, text[begin:end])
+
+
+def sample_positions(texts: Iterable[str], num_samples: int,
+                     window: int = 2048, min_length: int = 2,
+                     seed: int = 42) -> List[Sample]:
+    """Function sample_positions samples words of texts uniformly (with
+    reservoir sampling in order to bound memory on corpora like enwik8) and
+    makes samples of window characters around them. A hidden word is
+    replaced with a single space since completors treat character under
+    cursor as replaced by the prediction. A sample is cut out of a text as
+    soon as it fills a slot of reservoir, so texts are not retained.
+    """
+    rng = Random(seed)
+    reservoir: List[Sample] = []
+    num_words = 0
+    for text in texts:
+        for match in WORD_REGEX.finditer(text):
+            if match.end() - match.start() < min_length:
+                continue
+            num_words += 1
+            if len(reservoir) < num_samples:
+                reservoir.append(make_sample(text, match.start(),
+                                             match.end(), window))
+            elif (slot := rng.randrange(num_words)) < num_samples:
+                reservoir[slot] = make_sample(text, match.start(),
+                                              match.end(), window)
+    return reservoir
+
+
+def rank(target: str, items: List[str]) -> Optional[int]:
+    for index, item in enumerate(items):
+        if item.strip() == target:
+            return index
+    return None
+
+
+def evaluate(completor: AbstractCompletor, corpus: List[Path],
+             num_samples: int = 1000, top_k: int = 10, num_workers: int = 1,
+             batch_size: int = 16, label: str = '',
+             suffixes: Optional[Set[str]] = None,
+             seed: int = 42) -> EvaluationReport:
+    """Function evaluate runs completor over samples of a corpus in batches
+    of parallel requests and measures accuracy and latency together. Latency
+    of a request is inflated by concurrency, so num_workers=1 corresponds to
+    an idle server.
+    """
+    samples = sample_positions(read_corpus(corpus, suffixes), num_samples,
+                               seed=seed)
+    logging.info('sampled %d cursor positions from corpus', len(samples))
+    if not samples:
+        raise ValueError('There is no word to sample in corpus.')
+
+    def complete(sample: Sample) -> Tuple[Optional[int], float]:
+        doc = Document(sample.text)
+        started_at = perf_counter()
+        items = completor.complete(doc, sample.line, sample.char)
+        elapsed = perf_counter() - started_at
+        return rank(sample.target, items[:top_k]), elapsed
+
+    results = []
+    started_at = perf_counter()
+    with ThreadPoolExecutor(num_workers, '[lsp] evaluate') as executor:
+        for begin in range(0, len(samples), batch_size):
+            batch = samples[begin:begin + batch_size]
+            results.extend(executor.map(complete, batch))
+            logging.info('evaluated %d of %d samples',
+                         len(results), len(samples))
+    elapsed = perf_counter() - started_at
+
+    ranks = [index for index, _ in results]
+    latencies = np.array([latency for _, latency in results]) * 1e3
+    p50, p95, p99 = np.percentile(latencies, (50, 95, 99))
+    return EvaluationReport(
+        label=label,
+        num_samples=len(results),
+        top_k=top_k,
+        top1=sum(index == 0 for index in ranks) / len(ranks),
+        topk=sum(index is not None for index in ranks) / len(ranks),
+        mrr=sum(1 / (index + 1) for index in ranks
+                if index is not None) / len(ranks),
+        latency_mean=round(float(latencies.mean()), 3),
+        latency_p50=round(float(p50), 3),
+        latency_p95=round(float(p95), 3),
+        latency_p99=round(float(p99), 3),
+        throughput=round(len(results) / elapsed, 2))
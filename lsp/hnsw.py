@@ -0,0 +1,320 @@
+#   encoding: utf8
+#   filename: hnsw.py
+"""Hierarchical navigable small world (HNSW) graph for approximate nearest
+neighbour search over unit vectors with inner product similarity.
+
+Graph is built incrementally: a node is inserted by greedy descent from the
+entry point followed by beam search in the layers of the node, neighbours are
+diversified with HNSW selection heuristic, and lists of neighbours which
+overflow are shrunk with the same heuristic. Nodes are inserted in order of
+decreasing level so that upper layers are complete early. The graph is
+written to a single file which is memory-mapped on load.
+
+    header      magic, counters, entry point, digest, and table of sections
+    sections    vectors, levels, adjacency lists of layers, and labels
+"""
+
+import numpy as np
+
+from heapq import heapify, heappop, heappush, heapreplace
+from mmap import ACCESS_READ, mmap
+from os import replace
+from pathlib import Path
+from struct import Struct
+from typing import Callable, Dict, List, Sequence, Tuple
+
+from .background import checkpoint
+
+__all__ = ('HNSW', 'build_hnsw', 'write_hnsw')
+
+
+MAGIC = b'LSPLMHN1'
+
+HEADER = Struct('<8s7Q')
+
+SECTIONS = (
+    ('vectors', np.float32),
+    ('levels', np.uint8),
+    ('links0', np.int32),
+    ('upper_nodes', np.int32),
+    ('upper_offsets', np.uint64),
+    ('upper_links', np.int32),
+    ('labels', np.uint8),
+    ('label_offsets', np.uint64),
+)
+
+SECTION = Struct('<2Q')
+
+MAX_LEVEL = 8
+
+Graph = Tuple[np.ndarray, np.ndarray, List[Tuple[np.ndarray, np.ndarray]]]
+
+
+def search_layer(vectors: np.ndarray,
+                 neighbours_of: Callable[[int], List[int]], query: np.ndarray,
+                 entries: List[int], ef: int) -> List[Tuple[float, int]]:
+    """Function search_layer runs beam search in a layer of graph from entry
+    points and returns at most ef nearest nodes as pairs of similarity and
+    node sorted by decreasing similarity.
+    """
+    visited = set(entries)
+    sims = (vectors[entries] @ query).tolist()
+    candidates = [(-sim, node) for sim, node in zip(sims, entries)]
+    results = sorted(zip(sims, entries))[-ef:]
+    heapify(candidates)
+    while candidates:
+        sim, node = heappop(candidates)
+        if -sim < results[0][0] and len(results) >= ef:
+            break
+        neighbours = [n for n in neighbours_of(node) if n not in visited]
+        if not neighbours:
+            continue
+        visited.update(neighbours)
+        sims = (vectors[neighbours] @ query).tolist()
+        for neighbour, sim in zip(neighbours, sims):
+            if len(results) < ef:
+                heappush(results, (sim, neighbour))
+            elif sim > results[0][0]:
+                heapreplace(results, (sim, neighbour))
+            else:
+                continue
+            heappush(candidates, (-sim, neighbour))
+    return sorted(results, reverse=True)
+
+
+def select(vectors: np.ndarray, sims: Sequence[float],
+           candidates: Sequence[int], degree: int) -> List[int]:
+    """Function select implements neighbour selection heuristic of HNSW:
+    candidates (sorted by decreasing similarity to a node) are kept if they
+    are closer to the node than to any neighbour kept so far.
+    """
+    if not candidates:
+        return []
+    points = vectors[list(candidates)]
+    gram = points @ points.T
+    kept: List[int] = []
+    for i, sim in enumerate(sims):
+        if len(kept) == degree:
+            break
+        if not kept or gram[i, kept].max() < sim:
+            kept.append(i)
+    return [candidates[i] for i in kept]
+
+
+def descend(vectors: np.ndarray, layer: Dict[int, List[int]],
+            query: np.ndarray, node: int, best: float) -> Tuple[int, float]:
+    # Greedy search moves to the nearest neighbour while it is closer.
+    while (neighbours := layer[node]):
+        sims = vectors[neighbours] @ query
+        if sims[i := int(sims.argmax())] <= best:
+            break
+        node, best = neighbours[i], float(sims[i])
+    return node, best
+
+
+def build_hnsw(vectors: np.ndarray, m: int = 16, ef_construction: int = 64,
+               seed: int = 42) -> Graph:
+    """Function build_hnsw builds HNSW graph over unit vectors by insertion
+    of nodes one by one. Layer 0 has degree 2m and upper layers have degree
+    m. It returns levels of nodes, adjacency matrix of layer 0, and nodes and
+    adjacency matrices of upper layers.
+    """
+    rng = np.random.default_rng(seed)
+    num_nodes = len(vectors)
+    mult = 1 / np.log(m)
+    levels = np.floor(-np.log(1 - rng.random(num_nodes)) * mult)
+    levels = np.minimum(levels, MAX_LEVEL).astype(np.uint8)
+    max_level = int(levels.max(initial=0))
+    layers: List[Dict[int, List[int]]] = [{} for _ in range(max_level + 1)]
+
+    # Entry point is the first node of the top layer (see write_hnsw).
+    order = np.argsort(-levels.astype(np.int64), kind='stable').tolist()
+    for count, node in enumerate(order):
+        if count % 256 == 0:
+            checkpoint()
+        level = int(levels[node])
+        if count == 0:
+            for layer in layers:
+                layer[node] = []
+            entry_point = node
+            continue
+
+        query = vectors[node]
+        nearest = entry_point
+        best = float(vectors[nearest] @ query)
+        for layer in layers[max_level:level:-1]:
+            nearest, best = descend(vectors, layer, query, nearest, best)
+
+        entries = [nearest]
+        for depth in range(level, -1, -1):
+            layer = layers[depth]
+            degree = 2 * m if depth == 0 else m
+            found = search_layer(vectors, layer.__getitem__, query, entries,
+                                 ef_construction)
+            layer[node] = select(vectors, [sim for sim, _ in found],
+                                 [other for _, other in found], degree)
+            for neighbour in layer[node]:
+                reverse = layer[neighbour]
+                if len(reverse) < degree:
+                    reverse.append(node)
+                    continue
+                # Overflowing list of neighbours is shrunk with heuristic.
+                others = reverse + [node]
+                sims = vectors[others] @ vectors[neighbour]
+                ranks = np.argsort(-sims).tolist()
+                layer[neighbour] = select(vectors, sims[ranks].tolist(),
+                                          [others[i] for i in ranks], degree)
+            entries = [other for _, other in found]
+
+    links0 = np.full((num_nodes, 2 * m), -1, np.int32)
+    for node, neighbours in layers[0].items():
+        links0[node, :len(neighbours)] = neighbours
+    upper = []
+    for layer in layers[1:]:
+        nodes = np.array(sorted(layer), np.int32)
+        links = np.full((len(nodes), m), -1, np.int32)
+        for i, node in enumerate(nodes.tolist()):
+            links[i, :len(layer[node])] = layer[node]
+        upper.append((nodes, links))
+    return levels, links0, upper
+
+
+def write_hnsw(path: Path, vectors: np.ndarray, graph: Graph,
+               labels: Sequence[str], digest: int):
+    """Function write_hnsw serializes vectors, graph, and labels of vectors to
+    a file atomically.
+    """
+    levels, links0, upper = graph
+    num_nodes, dim = vectors.shape
+    max_level = len(upper)
+    m = upper[0][1].shape[1] if upper else links0.shape[1] // 2
+    entry_point = int(upper[-1][0][0]) if upper else 0
+
+    encoded = [label.encode('utf-8') for label in labels]
+    label_offsets = np.zeros(len(encoded) + 1, np.uint64)
+    label_offsets[1:] = np.cumsum([len(label) for label in encoded])
+    upper_offsets = np.zeros(max_level + 1, np.uint64)
+    upper_offsets[1:] = np.cumsum([len(nodes) for nodes, _ in upper])
+    columns = {
+        'vectors': vectors.astype(np.float32),
+        'levels': levels,
+        'links0': links0,
+        'upper_nodes': np.concatenate([nodes for nodes, _ in upper] or
+                                      [np.empty(0, np.int32)]),
+        'upper_offsets': upper_offsets,
+        'upper_links': np.concatenate([links.ravel() for _, links in upper] or
+                                      [np.empty(0, np.int32)]),
+        'labels': np.frombuffer(b''.join(encoded), np.uint8),
+        'label_offsets': label_offsets,
+    }
+
+    # Sections are aligned to 8 bytes so that they could be mapped in-place.
+    offset = HEADER.size + SECTION.size * len(SECTIONS)
+    table = []
+    for name, dtype in SECTIONS:
+        size = columns[name].astype(dtype).nbytes
+        table.append((offset, size))
+        offset += (size + 7) & ~7
+
+    tmp_path = path.with_suffix('.tmp')
+    with open(tmp_path, 'wb') as fout:
+        fout.write(HEADER.pack(MAGIC, num_nodes, dim, max_level, entry_point,
+                               m, links0.shape[1], digest))
+        for section in table:
+            fout.write(SECTION.pack(*section))
+        for (name, dtype), (_, size) in zip(SECTIONS, table):
+            fout.write(columns[name].astype(dtype).tobytes())
+            fout.write(b'\0' * (((size + 7) & ~7) - size))
+    replace(tmp_path, path)
+
+
+class HNSW:
+    """Class HNSW provides read-only nearest neighbour search over
+    memory-mapped HNSW graph.
+
+    :param ef: Size of dynamic candidate list on search in layer 0.
+    """
+
+    def __init__(self, path: Path, ef: int = 32):
+        self.path = path
+        self.ef = ef
+        with open(path, 'rb') as fin:
+            self.mmap = mmap(fin.fileno(), 0, access=ACCESS_READ)
+
+        magic, num_nodes, dim, max_level, entry_point, m, m0, digest = \
+            HEADER.unpack_from(self.mmap)
+        if magic != MAGIC:
+            raise ValueError(f'Unexpected HNSW format: {path}.')
+        self.num_nodes = num_nodes
+        self.dim = dim
+        self.max_level = max_level
+        self.entry_point = entry_point
+        self.digest = digest
+
+        for index, (name, dtype) in enumerate(SECTIONS):
+            offset, size = SECTION.unpack_from(self.mmap, HEADER.size +
+                                               index * SECTION.size)
+            count = size // np.dtype(dtype).itemsize
+            setattr(self, name, np.frombuffer(self.mmap, dtype, count,
+                                              offset))
+        self.vectors = self.vectors.reshape(num_nodes, dim)
+        self.links0 = self.links0.reshape(num_nodes, m0)
+
+        # Upper layers are small so their node indices are kept in memory.
+        self.layers: List[Tuple[Dict[int, int], np.ndarray]] = [({}, None)]
+        begin = 0
+        for level in range(1, max_level + 1):
+            end = int(self.upper_offsets[level])
+            nodes = self.upper_nodes[begin:end].tolist()
+            links = self.upper_links[begin * m:end * m].reshape(-1, m)
+            self.layers.append(({n: i for i, n in enumerate(nodes)}, links))
+            begin = end
+
+    def __len__(self) -> int:
+        return self.num_nodes
+
+    def __str__(self) -> str:
+        return (f'HNSW(nonodes={self.num_nodes}, dim={self.dim}, '
+                f'nolevels={self.max_level + 1})')
+
+    def close(self):
+        # Arrays should be released before memory map is closed.
+        for name, _ in SECTIONS:
+            setattr(self, name, None)
+        self.layers = []
+        self.mmap.close()
+
+    def label(self, node: int) -> str:
+        begin = int(self.label_offsets[node])
+        end = int(self.label_offsets[node + 1])
+        return self.labels[begin:end].tobytes().decode('utf-8')
+
+    def search(self, query: np.ndarray, k: int) -> List[Tuple[float, int]]:
+        """Method search returns k approximate nearest neighbours of a query
+        as pairs of similarity and node.
+        """
+        if not self.num_nodes:
+            return []
+        vectors = self.vectors
+        node = self.entry_point
+        best = float(vectors[node] @ query)
+
+        # Greedy descent through upper layers.
+        for level in range(self.max_level, 0, -1):
+            index, links = self.layers[level]
+            while True:
+                neighbours = links[index[node]]
+                neighbours = neighbours[neighbours >= 0]
+                if not len(neighbours):
+                    break
+                sims = vectors[neighbours] @ query
+                if sims[i := int(sims.argmax())] <= best:
+                    break
+                node, best = int(neighbours[i]), float(sims[i])
+
+        # Beam search in layer 0.
+        def neighbours_of(node: int) -> List[int]:
+            return [n for n in self.links0[node].tolist() if n >= 0]
+
+        return search_layer(vectors, neighbours_of, query, [node],
+                            max(self.ef, k))[:k]
@@ -0,0 +1,28 @@
+#   encoding: utf8
+#   filename: hnsw_test.py
+
+import numpy as np
+
+from .hnsw import HNSW, build_hnsw, write_hnsw
+
+
+def test_search_recall(tmp_path):
+    # Clustered vectors resemble embeddings of identifiers.
+    rng = np.random.default_rng(0)
+    centers = rng.normal(size=(16, 32))
+    points = centers[rng.integers(0, 16, 2100)] + \
+        0.5 * rng.normal(size=(2100, 32))
+    points /= np.linalg.norm(points, axis=1, keepdims=True)
+    vectors, queries = points[:2000].astype(np.float32), points[2000:]
+
+    graph = build_hnsw(vectors, m=8)
+    write_hnsw(tmp_path / 'hnsw.bin', vectors, graph,
+               [str(i) for i in range(len(vectors))], 0)
+    index = HNSW(tmp_path / 'hnsw.bin')
+    assert index.label(42) == '42'
+
+    exact = np.argsort(-(queries @ vectors.T), axis=1)[:, :10]
+    hits = sum(len({node for _, node in index.search(query, 10)} & set(row))
+               for query, row in zip(queries, exact))
+    assert hits >= 0.9 * exact.size
+    index.close()
@@ -0,0 +1,373 @@
+#   encoding: utf8
+#   filename: metrics.py
+"""Low-overhead latency instrumentation. Durations are recorded in HDR-style
+log-linear histograms: a power of two range is split into a fixed number of
+linear sub-buckets so that relative error is bounded (12.5% by default) and
+recording is a few integer operations. Every thread records into its own
+shard of counters, so recording takes no lock; shards are merged on read.
+"""
+
+from contextlib import contextmanager
+from dataclasses import dataclass
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from os import unlink
+from socketserver import ThreadingMixIn, UnixStreamServer
+from threading import Lock, Thread, local
+from time import perf_counter_ns
+from typing import Callable, Dict, Iterator, List, Optional, Sequence, Tuple
+
+from .trace import TRACER
+from .types import Addr, Proto
+
+__all__ = (
+    'Histogram',
+    'MetricsServer',
+    'REGISTRY',
+    'Registry',
+    'Snapshot',
+    'stage',
+    'timer',
+)
+
+
+# Number of bits of sub-bucket index: 2 ** 3 = 8 linear sub-buckets per power
+# of two.
+SUB_BITS = 3
+
+# Maximal recordable value is 2 ** MAX_EXP ns (about 18 minutes). Larger
+# values are clipped.
+MAX_EXP = 40
+
+# Upper bounds (in seconds) of cumulative buckets of Prometheus histogram
+# are powers of two from about 1 us to about 68 s.
+PROMETHEUS_BOUNDS = tuple(2 ** exp / 1e9 for exp in range(10, 37))
+
+QUANTILES = (0.5, 0.9, 0.95, 0.99, 0.999)
+
+Labels = Tuple[Tuple[str, str], ...]
+
+
+NUM_BUCKETS = (MAX_EXP + 2) << SUB_BITS
+
+
+def bucket_index(value: int) -> int:
+    """Function bucket_index maps value to bucket. Values below 2 ** SUB_BITS
+    have their own buckets. Larger values are split by exponent and then by
+    SUB_BITS leading bits of mantissa.
+    """
+    if value < (1 << SUB_BITS):
+        return value
+    if (exp := value.bit_length() - SUB_BITS - 1) > MAX_EXP:
+        return NUM_BUCKETS - 1
+    return (exp << SUB_BITS) + (value >> exp)
+
+
+def bucket_bounds(index: int) -> Tuple[int, int]:
+    """Function bucket_bounds returns half-open range [lower, upper) of
+    values (in ns) of a bucket.
+    """
+    if index < (1 << SUB_BITS):
+        return index, index + 1
+    exp = (index >> SUB_BITS) - 1
+    mantissa = index - (exp << SUB_BITS)
+    return mantissa << exp, (mantissa + 1) << exp
+
+
+@dataclass
+class Snapshot:
+    """Class Snapshot is a merged view of histogram shards.
+    """
+
+    counts: List[int]
+
+    count: int
+
+    total: int
+
+    def quantile(self, q: float) -> float:
+        """Method quantile returns estimate of quantile (in seconds) as the
+        middle of the bucket where it falls.
+        """
+        if not self.count:
+            return 0.0
+        rank, acc = q * self.count, 0
+        for index, count in enumerate(self.counts):
+            acc += count
+            if acc >= rank and count:
+                lower, upper = bucket_bounds(index)
+                return (lower + upper) / 2e9
+        return 0.0
+
+    def mean(self) -> float:
+        return self.total / self.count / 1e9 if self.count else 0.0
+
+    def cumulative(self, bounds: Sequence[float]) -> List[int]:
+        """Method cumulative returns number of values not greater than each
+        of bounds (in seconds) as Prometheus histogram does.
+        """
+        result, acc, index = [], 0, 0
+        for bound in bounds:
+            while index < len(self.counts) and \
+                    bucket_bounds(index)[1] <= bound * 1e9:
+                acc += self.counts[index]
+                index += 1
+            result.append(acc)
+        return result
+
+
+class Histogram:
+    """Class Histogram records durations in nanoseconds into thread-local
+    shards. Spans are also passed to tracer if it is enabled.
+
+    :param name: Name of metric family.
+    :param labels: Labels of histogram in the family.
+    """
+
+    def __init__(self, name: str = '', labels: Labels = ()):
+        self.local = local()
+        self.shards: List[List[int]] = []
+        self.lock = Lock()
+
+        # Span of stage histogram is named after stage while span of method
+        # histogram is named after method.
+        args = dict(labels)
+        self.trace_name = args.pop('stage', None) or \
+            args.get('method') or name
+        self.trace_cat = name
+        self.trace_args = args or None
+
+    def shard(self) -> List[int]:
+        # Counters of a shard are followed by count and total.
+        shard = [0] * (NUM_BUCKETS + 2)
+        with self.lock:
+            self.shards.append(shard)
+        self.local.shard = shard
+        return shard
+
+    def record(self, value: int):
+        """Method record records duration in nanoseconds.
+        """
+        try:
+            shard = self.local.shard
+        except AttributeError:
+            shard = self.shard()
+        # Function bucket_index is inlined since it is on hot path.
+        if value < (1 << SUB_BITS):
+            index = max(value, 0)
+        elif (exp := value.bit_length() - SUB_BITS - 1) > MAX_EXP:
+            index = NUM_BUCKETS - 1
+        else:
+            index = (exp << SUB_BITS) + (value >> exp)
+        shard[index] += 1
+        shard[NUM_BUCKETS] += 1
+        shard[NUM_BUCKETS + 1] += value
+
+    def span(self, begin: int, end: int, asynchronous: bool = False):
+        """Method span records duration of span [begin, end] (timestamps of
+        perf_counter_ns) and traces it. Asynchronous span begins on other
+        thread (e.g. waiting in a queue).
+        """
+        self.record(end - begin)
+        if TRACER.enabled:
+            TRACER.complete(self.trace_name, self.trace_cat, begin, end,
+                            self.trace_args, asynchronous)
+
+    def since(self, started_at: int):
+        """Method since records time elapsed since started_at (as returned
+        by perf_counter_ns).
+        """
+        self.span(started_at, perf_counter_ns())
+
+    def snapshot(self) -> Snapshot:
+        with self.lock:
+            shards = list(self.shards)
+        counts = [0] * (NUM_BUCKETS + 2)
+        for shard in shards:
+            for index, value in enumerate(shard):
+                if value:
+                    counts[index] += value
+        return Snapshot(counts[:NUM_BUCKETS], counts[NUM_BUCKETS],
+                        counts[NUM_BUCKETS + 1])
+
+
+class Registry:
+    """Class Registry holds named histograms with labels and gauges which are
+    evaluated lazily on export.
+    """
+
+    def __init__(self):
+        self.histograms: Dict[str, Dict[Labels, Histogram]] = {}
+        self.gauges: Dict[str, Callable[[], Dict[str, float]]] = {}
+        self.help: Dict[str, str] = {}
+        self.lock = Lock()
+
+    def histogram(self, name: str, help: str = '', **labels) -> Histogram:
+        key = tuple(sorted(labels.items()))
+        if (histogram := self.histograms.get(name, {}).get(key)) is None:
+            with self.lock:
+                family = self.histograms.setdefault(name, {})
+                histogram = family.setdefault(key, Histogram(name, key))
+                if help:
+                    self.help.setdefault(name, help)
+        return histogram
+
+    def gauge(self, prefix: str, collect: Callable[[], Dict[str, float]],
+              help: str = ''):
+        """Method gauge registers a function which returns a dictionary of
+        values. Every value is exported as a gauge prefix_key.
+        """
+        with self.lock:
+            self.gauges[prefix] = collect
+            if help:
+                self.help[prefix] = help
+
+    def summary(self) -> Dict[str, List[Dict[str, float]]]:
+        """Method summary returns count, mean, and quantiles (in ms) of every
+        non-empty histogram (e.g. for telemetry).
+        """
+        result = {}
+        for name, family in sorted(self.histograms.items()):
+            rows = []
+            for labels, histogram in sorted(family.items()):
+                if not (snapshot := histogram.snapshot()).count:
+                    continue
+                row = dict(labels)
+                row['count'] = snapshot.count
+                row['mean'] = round(snapshot.mean() * 1e3, 3)
+                for q in QUANTILES:
+                    row[f'p{q * 100:g}'] = \
+                        round(snapshot.quantile(q) * 1e3, 3)
+                rows.append(row)
+            result[name] = rows
+        return result
+
+    def render(self) -> str:
+        """Method render exports metrics in Prometheus text format.
+        """
+        lines = []
+        for name, family in sorted(self.histograms.items()):
+            if (help := self.help.get(name)):
+                lines.append(f'# HELP {name} {help}')
+            lines.append(f'# TYPE {name} histogram')
+            for labels, histogram in sorted(family.items()):
+                snapshot = histogram.snapshot()
+                cumulative = snapshot.cumulative(PROMETHEUS_BOUNDS)
+                for bound, count in zip(PROMETHEUS_BOUNDS, cumulative):
+                    lines.append(f'{name}_bucket'
+                                 f'{format_labels(labels, le=f"{bound:g}")} '
+                                 f'{count}')
+                lines.append(f'{name}_bucket'
+                             f'{format_labels(labels, le="+Inf")} '
+                             f'{snapshot.count}')
+                lines.append(f'{name}_sum{format_labels(labels)} '
+                             f'{snapshot.total / 1e9:g}')
+                lines.append(f'{name}_count{format_labels(labels)} '
+                             f'{snapshot.count}')
+        for prefix, collect in sorted(self.gauges.items()):
+            for key, value in sorted(collect().items()):
+                if (help := self.help.get(prefix)):
+                    lines.append(f'# HELP {prefix}_{key} {help}')
+                lines.append(f'# TYPE {prefix}_{key} gauge')
+                lines.append(f'{prefix}_{key} {value}')
+        return '\n'.join(lines) + '\n'
+
+
+def format_labels(labels: Labels, **extra) -> str:
+    pairs = list(labels) + list(extra.items())
+    if not pairs:
+        return ''
+    body = ','.join(f'{key}="{escape_label(value)}"' for key, value in pairs)
+    return '{' + body + '}'
+
+
+def escape_label(value: str) -> str:
+    return str(value).replace('\\', '\\\\').replace('"', '\\"') \
+        .replace('\n', '\\n')
+
+
+# Default registry of a process.
+REGISTRY = Registry()
+
+STAGE_HELP = 'Time spent in a stage of request processing.'
+
+
+def stage(name: str, **labels) -> Histogram:
+    """Function stage returns histogram of a processing stage (e.g. decode,
+    route, or forward) from default registry.
+    """
+    return REGISTRY.histogram('lsp_stage_seconds', STAGE_HELP, stage=name,
+                              **labels)
+
+
+@contextmanager
+def timer(histogram: Histogram) -> Iterator[None]:
+    started_at = perf_counter_ns()
+    try:
+        yield
+    finally:
+        histogram.since(started_at)
+
+
+class MetricsHandler(BaseHTTPRequestHandler):
+
+    registry: Registry = REGISTRY
+
+    def do_GET(self):
+        if self.path.split('?', 1)[0] not in ('/', '/metrics'):
+            self.send_error(404)
+            return
+        body = self.registry.render().encode('utf-8')
+        self.send_response(200)
+        self.send_header('Content-Type', 'text/plain; version=0.0.4')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def address_string(self) -> str:
+        # Peer address of unix socket is an empty string.
+        return str(self.client_address or 'unix')
+
+    def log_message(self, format, *args):
+        pass
+
+
+class UnixHTTPServer(ThreadingMixIn, UnixStreamServer):
+
+    daemon_threads = True
+
+
+class MetricsServer:
+    """Class MetricsServer exposes registry in Prometheus text format over
+    HTTP on a local TCP or unix domain socket in a background thread.
+
+    :param addr: Address to listen (tcp or unix).
+    :param registry: Registry to export.
+    """
+
+    def __init__(self, addr: Addr, registry: Registry = REGISTRY):
+        self.addr = addr
+        handler = type('Handler', (MetricsHandler, ), {'registry': registry})
+        self.server: Optional[ThreadingHTTPServer] = None
+        if addr.proto == Proto.UNIX:
+            try:
+                unlink(addr.path)
+            except FileNotFoundError:
+                pass
+            self.server = UnixHTTPServer(addr.path, handler)
+        elif addr.proto in (Proto.TCP, Proto.TCP4, Proto.TCP6):
+            self.server = ThreadingHTTPServer((addr.host or '127.0.0.1',
+                                               addr.port or 9272), handler)
+        else:
+            raise ValueError(f'Metrics could not be served on {addr}.')
+        self.thread = Thread(target=self.server.serve_forever, daemon=True,
+                             name='[lsp] metrics')
+
+    def __str__(self) -> str:
+        return f'MetricsServer(addr={self.addr})'
+
+    def start(self):
+        self.thread.start()
+
+    def stop(self):
+        self.server.shutdown()
+        self.server.server_close()
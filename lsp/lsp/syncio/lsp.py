@@ -11,9 +11,11 @@ from inspect import ismethod, getmembers, getmro
 from itertools import count
 from json import dumps
 from os.path import join
+from time import perf_counter_ns
 from typing import Any, Callable, Dict, IO, Optional, Type, Union
 
 from .rpc import PacketReader, PacketWriter
+from ..metrics import REGISTRY, Histogram
 
 
 __all__ = (
@@ -243,10 +245,18 @@ class TelemetryProtocol(Base):
 @protocol
 class TextDocumentProtocol(Base):
 
+    @request
+    def code_action(self, *args, **kwargs):
+        raise NotImplementedError
+
     @request
     def completion(self, *args, **kwargs):
         raise NotImplementedError
 
+    @request
+    def definition(self, *args, **kwargs):
+        raise NotImplementedError
+
     @notification
     def did_change(self, *args, **kwargs):
         raise NotImplementedError
@@ -377,6 +387,13 @@ class Route:
 
     reqres: bool = True
 
+    # Histogram of handler latency is resolved on registration rather than on
+    # every invocation.
+    histogram: Optional[Histogram] = None
+
+
+HANDLER_HELP = 'Time spent in a handler of a method.'
+
 
 class Router:
 
@@ -387,6 +404,7 @@ class Router:
         if not (route := self.routes.get(method)):
             raise ValueError(f'Method not found: {method}.')
 
+        started_at = perf_counter_ns()
         try:
             return route.func(*args, **kwargs)
         except NotImplementedError:
@@ -395,6 +413,8 @@ class Router:
         except Exception:
             logging.exception('failed to invoke method %s', method)
             raise
+        finally:
+            route.histogram.since(started_at)
 
     def register(self, method_or_protocol, handler=None):
         if handler:
@@ -408,7 +428,10 @@ class Router:
     def register_method(self, method, handler):
         if method in self.routes:
             logging.warning('duplicated route %s: replacing', method)
-        self.routes[method] = Route(method, handler, handler.reqres)
+        histogram = REGISTRY.histogram('lsp_handler_seconds', HANDLER_HELP,
+                                       method=method)
+        self.routes[method] = Route(method, handler, handler.reqres,
+                                    histogram)
 
     def register_protocol(self, protocol: Base):
         for name, func in getmembers(protocol, ishandler):
@@ -0,0 +1,191 @@
+#   encoding: utf8
+#   filename: record.py
+"""Traffic log of LSP sessions. Log is a gzip stream which starts with header
+and consists of records. Every record has monotonic timestamp (in ns since
+the start of recording), session identifier, kind, and content. Inbound
+frames are written as is while only identifiers of outbound responses are
+kept in order to restore original latency on replay.
+"""
+
+import logging
+
+from dataclasses import dataclass
+from enum import IntEnum
+from gzip import GzipFile
+from hashlib import blake2b
+from json import dumps, loads
+from pathlib import Path
+from re import compile as compile_regex
+from struct import Struct
+from threading import Lock
+from time import monotonic_ns
+from typing import Any, Iterator, Union
+from urllib.parse import urlparse
+
+__all__ = ('Kind', 'Record', 'Recorder', 'anonymise', 'read_records')
+
+
+MAGIC = b'LSPLMRC1'
+
+# Header consists of magic and flags.
+HEADER = Struct('<8sQ')
+
+# Record header consists of timestamp, session, kind, and content length.
+RECORD = Struct('<QIII')
+
+FLAG_ANONYMISED = 1
+
+# Flush buffered records to disk at least once in this period (in ns).
+FLUSH_PERIOD = 1_000_000_000
+
+WORD_REGEX = compile_regex(r'[^\W_]+')
+
+
+class Kind(IntEnum):
+
+    INBOUND = 0
+
+    RESPONSE = 1
+
+
+@dataclass
+class Record:
+
+    timestamp: int
+
+    session: int
+
+    kind: Kind
+
+    content: bytes
+
+
+def anonymise(obj: Any) -> Any:
+    """Function anonymise replaces letters and digits of document texts with
+    placeholders and hashes URIs. Lengths of texts (in UTF-16 code units)
+    and so positions in documents are preserved.
+    """
+    if isinstance(obj, list):
+        return [anonymise(item) for item in obj]
+    elif not isinstance(obj, dict):
+        return obj
+    result = {}
+    for key, value in obj.items():
+        if key == 'text' and isinstance(value, str):
+            result[key] = WORD_REGEX.sub(mask_word, value)
+        elif key in ('uri', 'rootUri') and isinstance(value, str):
+            result[key] = anonymise_uri(value)
+        elif key == 'rootPath' and isinstance(value, str):
+            result[key] = None
+        elif key == 'workspaceFolders' and isinstance(value, list):
+            result[key] = [{'uri': anonymise_uri(folder['uri']),
+                            'name': 'anonymous'} for folder in value]
+        else:
+            result[key] = anonymise(value)
+    return result
+
+
+def anonymise_uri(uri: str) -> str:
+    path = Path(urlparse(uri).path)
+    digest = blake2b(uri.encode('utf-8'), digest_size=8).hexdigest()
+    return f'file:///anonymous/{digest}{path.suffix}'
+
+
+def mask_char(char: str) -> str:
+    if char.isdigit():
+        return '0'
+    elif ord(char) > 0xffff:
+        return 'xx'  # Surrogate pair in UTF-16.
+    elif char.isupper():
+        return 'X'
+    else:
+        return 'x'
+
+
+def mask_word(match) -> str:
+    return ''.join(mask_char(char) for char in match.group())
+
+
+class Recorder:
+    """Class Recorder writes traffic of all sessions of a server to a log.
+
+    :param path: Path to log file.
+    :param anonymise: Mask text of documents and hash URIs.
+    """
+
+    def __init__(self, path: Union[str, Path], anonymise: bool = False):
+        self.path = path
+        self.anonymise = anonymise
+        self.lock = Lock()
+        self.num_sessions = 0
+        self.num_records = 0
+        self.started_at = monotonic_ns()
+        self.flushed_at = self.started_at
+        self.file = GzipFile(path, 'wb', compresslevel=6)
+        self.file.write(HEADER.pack(MAGIC, FLAG_ANONYMISED * anonymise))
+
+    def __str__(self) -> str:
+        return (f'Recorder(path={self.path}, anonymise={self.anonymise}, '
+                f'nosessions={self.num_sessions}, '
+                f'norecords={self.num_records})')
+
+    def open_session(self) -> int:
+        with self.lock:
+            self.num_sessions += 1
+            return self.num_sessions - 1
+
+    def inbound(self, session: int, content: bytes):
+        if self.anonymise:
+            try:
+                packet = anonymise(loads(content))
+                content = dumps(packet).encode('utf-8')
+            except ValueError:
+                logging.warning('failed to anonymise frame: it is skipped')
+                return
+        self.write(session, Kind.INBOUND, content)
+
+    def response(self, session: int, request_id: Any):
+        self.write(session, Kind.RESPONSE, dumps(request_id).encode('utf-8'))
+
+    def write(self, session: int, kind: Kind, content: bytes):
+        timestamp = monotonic_ns()
+        header = RECORD.pack(timestamp - self.started_at, session, kind,
+                             len(content))
+        with self.lock:
+            if self.file.closed:
+                return
+            self.file.write(header)
+            self.file.write(content)
+            self.num_records += 1
+            if timestamp - self.flushed_at > FLUSH_PERIOD:
+                self.file.flush()
+                self.flushed_at = timestamp
+
+    def close(self):
+        with self.lock:
+            self.file.close()
+
+
+def read_records(path: Union[str, Path]) -> Iterator[Record]:
+    """Function read_records reads records of a traffic log in order of
+    timestamps.
+    """
+    with GzipFile(path, 'rb') as fin:
+        magic, _ = HEADER.unpack(fin.read(HEADER.size))
+        if magic != MAGIC:
+            raise ValueError(f'Wrong magic of traffic log: {magic}.')
+        # Log of a killed server has no end of stream so that it is read
+        # up to the last complete record.
+        try:
+            while (header := fin.read(RECORD.size)):
+                if len(header) != RECORD.size:
+                    break
+                timestamp, session, kind, length = RECORD.unpack(header)
+                if len((content := fin.read(length))) != length:
+                    break
+                yield Record(timestamp, session, Kind(kind), content)
+            else:
+                return
+        except EOFError:
+            pass
+        logging.warning('traffic log is truncated')
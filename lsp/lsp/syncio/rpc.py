@@ -7,8 +7,14 @@
 # TODO: Parse content type "in-place".
 
 from dataclasses import dataclass
+from time import perf_counter_ns
 from typing import IO, Optional
 
+from ..metrics import stage
+
+# Maximal length of a header line. Longer lines are treated as corrupted.
+MAX_HEADER_LENGTH = 4096
+
 
 class PacketError(Exception):
     """Class PacketError inherited from Exception class. The type and its
@@ -36,6 +42,8 @@ class PacketReader:
         self.stop = False
         self.req: Packet
         self.err: PacketError
+        self.histogram = stage('frame_read')
+        self.started_at = 0
 
     def __iter__(self):
         return self
@@ -51,6 +59,7 @@ class PacketReader:
             self.req = Packet(0, None, b'')
             self._read_headers()
             self._read_content()
+            self.histogram.since(self.started_at)
             return self.req
         except StopIteration:
             self.stop = True
@@ -69,7 +78,11 @@ class PacketReader:
             raise PacketError('failed to read request content')
 
     def _read_headers(self):
-        while (line := self._read_until_eol()):
+        # Reading of the first header line blocks until a frame arrives so
+        # that time of frame reading is measured from the moment after it.
+        line = self._read_until_eol()
+        self.started_at = perf_counter_ns()
+        while line:
             split = line.decode('ascii').split(':', 1)
             if len(split) != 2:
                 raise PacketError('there is no colon in header')
@@ -82,18 +95,14 @@ class PacketReader:
             elif key == 'content-length':
                 self.req.content_length = int(val)
 
+            line = self._read_until_eol()
+
     def _read_until_eol(self):
-        if len(line := self.fin.read(2)) == 0:
+        # Header line is read at once rather than byte by byte.
+        if len(line := self.fin.readline(MAX_HEADER_LENGTH)) == 0:
             raise StopIteration
-        elif len(line) != 2:
-            raise PacketError('request header is corrupted')
-
-        while line[-2:] != b'\r\n':
-            if byte := self.fin.read(1):
-                line += byte
-            else:
-                raise PacketError('failed to read request header')
-
+        elif len(line) < 2 or line[-2:] != b'\r\n':
+            raise PacketError('failed to read request header')
         return line[:-2]
 
 
@@ -103,23 +112,11 @@ class PacketWriter:
         self.fout = fout
 
     def write(self, content: bytes):
-        self._write_headers([
-            ('Content-Length', str(len(content))),
-        ])
+        # Header is formatted at once rather than by a list of pairs.
+        self.fout.write(b'Content-Length: %d\r\n\r\n' % len(content))
         self.fout.write(content)
         self.fout.flush()
 
-    def _write_headers(self, headers):
-        for key, val in headers:
-            self._write_header(key, val)
-        self.fout.write(b'\r\n')
-
-    def _write_header(self, name: str, value: str):
-        self.fout.write(name.encode('ascii'))
-        self.fout.write(b': ')
-        self.fout.write(value.encode('ascii'))
-        self.fout.write(b'\r\n')
-
 
 __all__ = (
     'Packet',
@@ -4,18 +4,27 @@
 import logging
 
 from concurrent.futures import Future, ThreadPoolExecutor
+from itertools import count
 from json import dumps, loads
 from os import unlink
-from socket import AF_INET, AF_UNIX, SOCK_STREAM, SO_REUSEADDR, SOL_SOCKET, \
-    socket
+from socket import AF_INET, AF_UNIX, IPPROTO_TCP, SOCK_STREAM, SO_REUSEADDR, \
+    SOL_SOCKET, TCP_NODELAY, socket
 from sys import stdin, stdout
-from typing import IO, List, Tuple
+from threading import Lock
+from time import perf_counter_ns
+from typing import Any, Dict, IO, List, Optional, Tuple
 
 from .lsp import Router
+from .record import Recorder
 from .rpc import PacketReader, PacketWriter
+from ..error import LSPError
+from ..metrics import REGISTRY, Histogram, stage
 from ..types import Addr, Proto
 
 
+REQUEST_HELP = 'Time from receiving of a request to writing of a response.'
+
+
 def parse_mediatype(value: str):
     if not value:
         return 'application/vscode-jsonrpc', 'utf-8'
@@ -52,6 +61,20 @@ class Session:
         self.reader = PacketReader(sin)
         self.writer = PacketWriter(sout)
         self.router = Router()
+        self.lock = Lock()
+        self.request_id = count()
+
+        # Histograms of processing stages. Stage route is labeled by method.
+        self.decode_histogram = stage('decode')
+        self.encode_histogram = stage('encode')
+        self.write_histogram = stage('write')
+        self.route_histograms: Dict[str, Histogram] = {}
+        self.request_histograms: Dict[str, Histogram] = {}
+
+        # Register session in traffic log if recording is enabled.
+        self.recorder: Optional[Recorder] = server.recorder
+        if self.recorder is not None:
+            self.session_id = self.recorder.open_session()
 
         # Fabricate language protocol and register handlers.
         self.protocol = factory(self)
@@ -59,12 +82,89 @@ class Session:
 
     def start(self):
         logging.info('enter into communication loop')
+        try:
+            self.communicate()
+        finally:
+            self.close()
+        logging.info('leave communication loop')
+
+    def close(self):
+        """Method close lets protocol release resources of a session (e.g.
+        unregister them in process-wide registries) once connection is
+        closed.
+        """
+        if callable(close := getattr(self.protocol, 'close', None)):
+            close()
+
+    def communicate(self):
         for iframe in self.reader:
+            received_at = self.reader.started_at
+            if self.recorder is not None:
+                self.recorder.inbound(self.session_id, iframe.content)
+
+            started_at = perf_counter_ns()
             ipacket, charset = self.read_packet(iframe)
-            if (opacket := self.route(ipacket)):
-                oframe = self.write_packet(opacket, charset)
+            self.decode_histogram.since(started_at)
+
+            started_at = perf_counter_ns()
+            opacket = self.route(ipacket)
+            method = ipacket.get('method')
+            if isinstance(method, str):
+                self.route_histogram(method).since(started_at)
+            if not opacket:
+                continue
+
+            started_at = perf_counter_ns()
+            oframe = self.write_packet(opacket, charset)
+            self.encode_histogram.since(started_at)
+
+            # Time of writing includes waiting for output lock.
+            started_at = perf_counter_ns()
+            with self.lock:
                 self.writer.write(oframe)
-        logging.info('leave communication loop')
+            self.write_histogram.since(started_at)
+            self.request_histogram(method).since(received_at)
+
+            if self.recorder is not None:
+                self.recorder.response(self.session_id, opacket['id'])
+
+    def route_histogram(self, method: str) -> Histogram:
+        # Histograms are cached by method since lookup in registry allocates
+        # labels on every request.
+        if (histogram := self.route_histograms.get(method)) is None:
+            histogram = stage('route', method=method)
+            self.route_histograms[method] = histogram
+        return histogram
+
+    def request_histogram(self, method: str) -> Histogram:
+        if (histogram := self.request_histograms.get(method)) is None:
+            histogram = REGISTRY.histogram('lsp_request_seconds',
+                                           REQUEST_HELP, method=method)
+            self.request_histograms[method] = histogram
+        return histogram
+
+    def notify(self, method: str, params: Dict[str, Any]):
+        """Method notify sends a notification to a client. It is safe to call
+        it from any thread.
+        """
+        self.send({'jsonrpc': '2.0', 'method': method, 'params': params})
+
+    def request(self, method: str, params: Dict[str, Any]):
+        """Method request sends a request to a client. Responses are only
+        logged.
+        """
+        request_id = f'lsp-lm/{next(self.request_id)}'
+        self.send({
+            'jsonrpc': '2.0',
+            'id': request_id,
+            'method': method,
+            'params': params,
+        })
+
+    def send(self, opacket):
+        oframe = self.write_packet(opacket, 'utf-8')
+        with self.lock:
+            self.writer.write(oframe)
 
     def stop(self, timeout=None):
         raise NotImplementedError
@@ -87,7 +187,11 @@ class Session:
         if (version := ipacket.get('jsonrpc')) != '2.0':
             logging.warning('unsupported json rpc version: %s', version)
 
-        if not (method := ipacket.get('method')):
+        if 'method' not in ipacket and \
+                ('result' in ipacket or 'error' in ipacket):
+            self.handle_response(ipacket)
+            return
+        elif not (method := ipacket.get('method')):
             logging.error('no method to call')
             return  # TODO: Return an error.
         elif not isinstance(method, str):
@@ -99,12 +203,22 @@ class Session:
         if (request_id := ipacket.get('id')) is None:
             self.handle_notification(method, params)
             return
-        elif isinstance(request_id, (str, int)):
-            result = self.handle_request(method, params)
-        else:
+        elif not isinstance(request_id, (str, int)):
             logging.error('wrong type of request identifier')
             return  # TODO: Return an error.
 
+        # Handler reports a malformed request with an error response and
+        # session goes on.
+        try:
+            result = self.handle_request(method, params)
+        except LSPError as exc:
+            return {
+                'jsonrpc': '2.0',
+                'id': request_id,
+                'error': {'code': int(exc.code),
+                          'message': exc.desc or exc.code.name},
+            }
+
         # Construct output packet.
         opacket = {
             'jsonrpc': '2.0',
@@ -114,8 +228,19 @@ class Session:
 
         return opacket
 
+    def handle_response(self, ipacket):
+        if (error := ipacket.get('error')):
+            logging.warning('request %s failed: %s', ipacket.get('id'), error)
+        else:
+            logging.info('request %s succeeded', ipacket.get('id'))
+
     def handle_notification(self, method: str, params):
         logging.info('handle notification %s', method)
+        # Protocol-dependent notifications (e.g. $/cancelRequest) could be
+        # ignored if they are not implemented.
+        if method.startswith('$/') and method not in self.router.routes:
+            logging.info('ignore unsupported notification %s', method)
+            return
         self.router.invoke(method, params)
 
     def handle_request(self, method: str, params):
@@ -130,11 +255,14 @@ class Server:
     :param addr: Specification of communication channel.
     :param protocol: Factory which produce and object to handle session
                      (aka connection).
+    :param recorder: Traffic log to write inbound frames of all sessions to.
     """
 
-    def __init__(self, addr: Addr, protocol, tls_context=None):
+    def __init__(self, addr: Addr, protocol, tls_context=None,
+                 recorder: Optional[Recorder] = None):
         self.addr = addr
         self.protocol = protocol
+        self.recorder = recorder
         self.pool = ThreadPoolExecutor(4, '[lsp]')
         self.sessions: List[Session] = []
         self.tls_context = tls_context
@@ -157,6 +285,15 @@ class Server:
         """
         raise NotImplementedError
 
+    def serve(self, session: Session):
+        # Closed session is dropped from index so that its protocol state
+        # (documents, indexes, etc) is released.
+        self.sessions.append(session)
+        try:
+            session.start()
+        finally:
+            self.sessions.remove(session)
+
     def _accept_ipc_connections(self, addr: Addr):
         if (path := addr.path) is None:
             raise ValueError('Unix socket address should be specified.')
@@ -181,8 +318,7 @@ class Server:
             sin = stdin.buffer
             sout = stdout.buffer
             session = Session(sin, sout, self, self.protocol)
-            self.sessions.append(session)
-            session.start()
+            self.serve(session)
         except Exception:
             logging.exception('loose stdio connection')
         else:
@@ -205,7 +341,6 @@ class Server:
                 future.add_done_callback(self._close_tcp_connection)
 
     def _close_connection(self, future: Future):
-        # TODO: Remove from session index.
         if (exc := future.exception()):
             logging.error('connection handler raise an exception: %s', exc)
 
@@ -221,8 +356,7 @@ class Server:
             with sock:
                 fileobj = sock.makefile('rwb')
                 session = Session(fileobj, fileobj, self, self.protocol)
-                self.sessions.append(session)
-                session.start()
+                self.serve(session)
         except Exception:
             logging.exception('loose ipc connection')
         else:
@@ -230,6 +364,9 @@ class Server:
 
     def _open_tcp_connection(self, sock: socket, addr: Tuple[str, int]):
         logging.info('accept connection from %s:%d', *addr)
+        # Small frames (e.g. a notification followed by a response) should
+        # not wait for delayed acknowledgement of a client.
+        sock.setsockopt(IPPROTO_TCP, TCP_NODELAY, 1)
         try:
             # If there is a SSL context than we should wrap socket in the
             # SSL context.
@@ -241,8 +378,7 @@ class Server:
             with conn:
                 fileobj = conn.makefile('rwb')
                 session = Session(fileobj, fileobj, self, self.protocol)
-                self.sessions.append(session)
-                session.start()
+                self.serve(session)
         except Exception:
             logging.exception('loose connection from %s:%d', *addr)
         else:
@@ -0,0 +1,252 @@
+#   encoding: utf8
+#   filename: trace.py
+"""Opt-in tracer of request lifecycles. Every thread appends begin and end
+timestamps of spans into its own ring buffer, so the oldest events are
+dropped and recording takes no lock. Buffers are dumped on demand as Chrome
+trace JSON (chrome://tracing, ui.perfetto.dev) or Perfetto protobuf.
+"""
+
+from collections import deque
+from itertools import count
+from json import dump
+from os import getpid
+from pathlib import Path
+from threading import Lock, current_thread, get_native_id, local
+from typing import Any, Deque, Dict, List, Optional, Tuple, Union
+
+__all__ = ('TRACER', 'Tracer')
+
+
+# Event is a tuple of name, category, begin and end timestamps (in ns),
+# arguments, and flag of asynchronous span. Asynchronous spans (e.g. waiting
+# in a queue) could overlap on the same thread.
+Event = Tuple[str, str, int, int, Optional[Dict[str, Any]], bool]
+
+Buffer = Tuple[int, str, Deque[Event]]
+
+PERFETTO_SUFFIXES = ('.pb', '.perfetto-trace', '.pftrace')
+
+
+class Tracer:
+    """Class Tracer records spans into per-thread ring buffers. Recording is
+    disabled by default and costs a single attribute check.
+
+    :param capacity: Maximal number of events per thread.
+    """
+
+    def __init__(self, capacity: int = 65536):
+        self.enabled = False
+        self.capacity = capacity
+        self.generation = 0
+        self.buffers: List[Buffer] = []
+        self.local = local()
+        self.lock = Lock()
+
+    def __str__(self) -> str:
+        return (f'Tracer(enabled={self.enabled}, capacity={self.capacity}, '
+                f'noevents={self.num_events})')
+
+    @property
+    def num_events(self) -> int:
+        return sum(len(events) for _, _, events in self.buffers)
+
+    def start(self, capacity: Optional[int] = None):
+        """Method start clears buffers and enables recording.
+        """
+        with self.lock:
+            self.capacity = capacity or self.capacity
+            self.generation += 1
+            self.buffers = []
+            self.enabled = True
+
+    def stop(self):
+        self.enabled = False
+
+    def buffer(self) -> Deque[Event]:
+        events: Deque[Event] = deque(maxlen=self.capacity)
+        thread = current_thread()
+        with self.lock:
+            self.buffers.append((get_native_id(), thread.name, events))
+            self.local.buffer = (self.generation, events)
+        return events
+
+    def complete(self, name: str, cat: str, begin: int, end: int,
+                 args: Optional[Dict[str, Any]] = None,
+                 asynchronous: bool = False):
+        """Method complete records span [begin, end] (timestamps of
+        perf_counter_ns) which ends on a current thread.
+        """
+        if not self.enabled:
+            return
+        generation, events = getattr(self.local, 'buffer', (-1, None))
+        if generation != self.generation:
+            events = self.buffer()
+        events.append((name, cat, begin, end, args, asynchronous))
+
+    def snapshot(self) -> List[Tuple[int, str, List[Event]]]:
+        with self.lock:
+            buffers = list(self.buffers)
+        return [(tid, name, list(events)) for tid, name, events in buffers]
+
+    def dump(self, path: Union[str, Path]) -> int:
+        """Method dump writes events to a file and returns number of events.
+        Format is Perfetto protobuf if suffix is one of .pb, .pftrace, or
+        .perfetto-trace and Chrome trace JSON otherwise.
+        """
+        snapshot = self.snapshot()
+        if Path(path).suffix in PERFETTO_SUFFIXES:
+            with open(path, 'wb') as fout:
+                fout.write(to_perfetto(snapshot))
+        else:
+            with open(path, 'w') as fout:
+                dump(to_chrome(snapshot), fout)
+        return sum(len(events) for _, _, events in snapshot)
+
+
+def to_chrome(snapshot: List[Tuple[int, str, List[Event]]]) -> Dict:
+    pid = getpid()
+    events = [{'name': 'process_name', 'ph': 'M', 'pid': pid,
+               'args': {'name': 'lsp-lm'}}]
+    ids = count()
+    for tid, thread_name, spans in snapshot:
+        events.append({'name': 'thread_name', 'ph': 'M', 'pid': pid,
+                       'tid': tid, 'args': {'name': thread_name}})
+        for name, cat, begin, end, args, asynchronous in spans:
+            if asynchronous:
+                event_id = next(ids)
+                for phase, ts in (('b', begin), ('e', end)):
+                    events.append({'name': name, 'cat': cat, 'ph': phase,
+                                   'id': event_id, 'ts': ts / 1e3,
+                                   'pid': pid, 'tid': tid,
+                                   'args': args or {}})
+                continue
+            events.append({'name': name, 'cat': cat, 'ph': 'X',
+                           'ts': begin / 1e3, 'dur': (end - begin) / 1e3,
+                           'pid': pid, 'tid': tid, 'args': args or {}})
+    return {'traceEvents': events, 'displayTimeUnit': 'ms'}
+
+
+# Field numbers of Perfetto trace protos (see perfetto/protos/perfetto/trace).
+TRACE_PACKET = 1
+PACKET_TIMESTAMP = 8
+PACKET_SEQUENCE_ID = 10
+PACKET_TRACK_EVENT = 11
+PACKET_CLOCK_ID = 58
+PACKET_TRACK_DESCRIPTOR = 60
+TRACK_UUID = 1
+TRACK_NAME = 2
+TRACK_PARENT_UUID = 5
+TRACK_THREAD = 4
+THREAD_PID = 1
+THREAD_TID = 2
+THREAD_NAME = 5
+EVENT_ANNOTATIONS = 4
+EVENT_TYPE = 9
+EVENT_TRACK_UUID = 11
+EVENT_CATEGORIES = 22
+EVENT_NAME = 23
+ANNOTATION_STRING = 6
+ANNOTATION_NAME = 10
+
+SLICE_BEGIN, SLICE_END = 1, 2
+
+CLOCK_MONOTONIC = 3
+
+SEQUENCE_ID = 1
+
+
+def varint(value: int) -> bytes:
+    result = bytearray()
+    while True:
+        byte, value = value & 0x7f, value >> 7
+        if value:
+            result.append(byte | 0x80)
+        else:
+            result.append(byte)
+            return bytes(result)
+
+
+def field_varint(number: int, value: int) -> bytes:
+    return varint(number << 3) + varint(value)
+
+
+def field_bytes(number: int, value: Union[str, bytes]) -> bytes:
+    if isinstance(value, str):
+        value = value.encode('utf-8')
+    return varint(number << 3 | 2) + varint(len(value)) + value
+
+
+def to_perfetto(snapshot: List[Tuple[int, str, List[Event]]]) -> bytes:
+    """Function to_perfetto encodes events as Perfetto TrackEvent slices.
+    Synchronous spans of a thread are nested, so they share a thread track.
+    Asynchronous spans are spread over child tracks so that spans on the
+    same track do not overlap.
+    """
+    pid = getpid()
+    packets: List[Tuple[int, Tuple[int, int], bytes]] = []
+    uuids = count(1)
+
+    def descriptor(uuid: int, body: bytes):
+        body = field_varint(TRACK_UUID, uuid) + body
+        packets.append((0, (0, 0), field_bytes(PACKET_TRACK_DESCRIPTOR,
+                                               body)))
+
+    def add_slice(uuid: int, phase: int, ts: int, duration: int,
+                  name: str = '', cat: str = '',
+                  args: Optional[Dict[str, Any]] = None):
+        body = field_varint(EVENT_TYPE, phase)
+        body += field_varint(EVENT_TRACK_UUID, uuid)
+        if phase == SLICE_BEGIN:
+            body += field_bytes(EVENT_CATEGORIES, cat)
+            body += field_bytes(EVENT_NAME, name)
+            for key, value in (args or {}).items():
+                body += field_bytes(EVENT_ANNOTATIONS,
+                                    field_bytes(ANNOTATION_NAME, key) +
+                                    field_bytes(ANNOTATION_STRING,
+                                                str(value)))
+        # Ends precede begins of the same timestamp; outer (longer) spans
+        # begin first and end last.
+        if phase == SLICE_BEGIN:
+            order = (1, -duration)
+        else:
+            order = (0, duration)
+        packets.append((ts, order, field_bytes(PACKET_TRACK_EVENT, body)))
+
+    for tid, thread_name, spans in snapshot:
+        thread_uuid = next(uuids)
+        descriptor(thread_uuid, field_bytes(TRACK_THREAD, b''.join([
+            field_varint(THREAD_PID, pid),
+            field_varint(THREAD_TID, tid),
+            field_bytes(THREAD_NAME, thread_name),
+        ])))
+        lanes: List[Tuple[int, int]] = []  # Pairs of track and end of span.
+        for name, cat, begin, end, args, asynchronous in \
+                sorted(spans, key=lambda span: (span[2], -span[3])):
+            if not asynchronous:
+                uuid = thread_uuid
+            else:
+                for index, (uuid, busy_until) in enumerate(lanes):
+                    if busy_until <= begin:
+                        lanes[index] = (uuid, end)
+                        break
+                else:
+                    uuid = next(uuids)
+                    lanes.append((uuid, end))
+                    descriptor(uuid, field_varint(TRACK_PARENT_UUID,
+                                                  thread_uuid) +
+                               field_bytes(TRACK_NAME, name))
+            add_slice(uuid, SLICE_BEGIN, begin, end - begin, name, cat, args)
+            add_slice(uuid, SLICE_END, end, end - begin)
+
+    chunks = []
+    for ts, _, body in sorted(packets, key=lambda packet: packet[:2]):
+        packet = body + field_varint(PACKET_SEQUENCE_ID, SEQUENCE_ID)
+        if ts:
+            packet += field_varint(PACKET_TIMESTAMP, ts)
+            packet += field_varint(PACKET_CLOCK_ID, CLOCK_MONOTONIC)
+        chunks.append(field_bytes(TRACE_PACKET, packet))
+    return b''.join(chunks)
+
+
+# Default tracer of a process.
+TRACER = Tracer()
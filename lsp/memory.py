@@ -0,0 +1,312 @@
+#   encoding: utf8
+#   filename: memory.py
+"""Memory accounting of server subsystems (documents, caches, indexes,
+dictionaries, and model weights). Object graphs of subsystems are walked and
+every buffer (numpy array or torch tensor) is classified as private or mapped
+from a file with the help of /proc/self/maps, so that weights or indexes
+which are shared between processes through page cache are not mistaken for
+private memory. Subsystems which exceed their budgets are asked to evict.
+"""
+
+import logging
+import sys
+
+from bisect import bisect_right
+from dataclasses import dataclass, field
+from io import IOBase
+from mmap import mmap
+from threading import Lock, RLock, Thread
+from time import time
+from types import (BuiltinFunctionType, BuiltinMethodType, FunctionType,
+                   MethodType, ModuleType)
+from typing import Any, Callable, Dict, Iterable, List, Optional, Set, Tuple
+
+import numpy as np
+
+from .background import checkpoint
+
+__all__ = ('MemoryAccountant', 'MemoryReport', 'Usage', 'measure')
+
+
+# Objects of these types are not owned by a subsystem (e.g. bound method
+# refers to an object of another subsystem) or could not be measured.
+SKIP_TYPES = (type, ModuleType, FunctionType, MethodType, BuiltinFunctionType,
+              BuiltinMethodType, Thread, IOBase, mmap, type(Lock()),
+              type(RLock()))
+
+# Number of visited objects between cooperative yields.
+CHECKPOINT_PERIOD = 4096
+
+# Ranges of file-backed mappings of a process.
+Ranges = Tuple[List[int], List[int]]
+
+Evict = Callable[[int], int]
+
+
+@dataclass
+class Usage:
+    """Class Usage is a number of bytes which are allocated on heap (private)
+    or mapped from files (mapped).
+    """
+
+    private: int = 0
+
+    mapped: int = 0
+
+    @property
+    def total(self) -> int:
+        return self.private + self.mapped
+
+    def __iadd__(self, other: 'Usage') -> 'Usage':
+        self.private += other.private
+        self.mapped += other.mapped
+        return self
+
+
+@dataclass
+class MemoryReport:
+
+    # Resident set size of a process and its anonymous and file-backed parts.
+    process: Dict[str, int] = field(default_factory=dict)
+
+    subsystems: Dict[str, Usage] = field(default_factory=dict)
+
+    budgets: Dict[str, int] = field(default_factory=dict)
+
+    # Wall time of measurement (zero if nothing is measured yet).
+    measured_at: float = 0.0
+
+    def __str__(self) -> str:
+        lines = [f'{"subsystem":<16} {"private, MiB":>14} {"mapped, MiB":>14} '
+                 f'{"budget, MiB":>14}']
+        for name, usage in sorted(self.subsystems.items()):
+            budget = self.budgets.get(name)
+            budget_str = '-' if budget is None else f'{budget / 2**20:.1f}'
+            lines.append(f'{name:<16} {usage.private / 2**20:>14.1f} '
+                         f'{usage.mapped / 2**20:>14.1f} {budget_str:>14}')
+        for name, value in sorted(self.process.items()):
+            lines.append(f'{"process " + name:<16} {value / 2**20:>14.1f}')
+        return '\n'.join(lines)
+
+    def to_dict(self) -> Dict[str, Any]:
+        return {
+            'process': self.process,
+            'subsystems': {name: {'private': usage.private,
+                                  'mapped': usage.mapped}
+                           for name, usage in self.subsystems.items()},
+            'budgets': self.budgets,
+            'measuredAt': self.measured_at,
+        }
+
+
+def read_mapped_ranges() -> Ranges:
+    """Function read_mapped_ranges returns sorted starts and ends of
+    file-backed mappings of a process.
+    """
+    ranges = []
+    try:
+        with open('/proc/self/maps') as fin:
+            for line in fin:
+                fields = line.split(maxsplit=5)
+                # Anonymous mappings have zero inode.
+                if len(fields) < 6 or fields[4] == '0':
+                    continue
+                begin, end = fields[0].split('-')
+                ranges.append((int(begin, 16), int(end, 16)))
+    except OSError:
+        pass
+    ranges.sort()
+    return [begin for begin, _ in ranges], [end for _, end in ranges]
+
+
+def read_process_memory() -> Dict[str, int]:
+    """Function read_process_memory returns resident set size of a process
+    and its anonymous and file-backed parts in bytes.
+    """
+    values = {}
+    try:
+        with open('/proc/self/smaps_rollup') as fin:
+            for line in fin:
+                key, _, value = line.partition(':')
+                if value.strip().endswith('kB'):
+                    values[key] = int(value.split()[0]) * 1024
+    except OSError:
+        return {}
+    rss, anonymous = values.get('Rss', 0), values.get('Anonymous', 0)
+    return {'rss': rss, 'anonymous': anonymous, 'file': rss - anonymous}
+
+
+def is_mapped(ptr: int, ranges: Ranges) -> bool:
+    begins, ends = ranges
+    index = bisect_right(begins, ptr) - 1
+    return index >= 0 and ptr < ends[index]
+
+
+def measure(roots: Iterable[Any], seen: Set[int], buffers: Set[int],
+            ranges: Ranges) -> Usage:
+    """Function measure walks object graph from roots and sums sizes of
+    objects and buffers which are not seen yet. Buffers are identified by
+    data pointer, so views and tied weights are counted once.
+    """
+    usage = Usage()
+    stack = list(roots)
+    num_visited = 0
+    while stack:
+        obj = stack.pop()
+        if id(obj) in seen or obj is None or isinstance(obj, SKIP_TYPES):
+            continue
+        seen.add(id(obj))
+        if (num_visited := num_visited + 1) % CHECKPOINT_PERIOD == 0:
+            checkpoint()
+
+        if isinstance(obj, np.ndarray):
+            ptr, nbytes = obj.__array_interface__['data'][0], obj.nbytes
+        elif hasattr(obj, 'untyped_storage') and hasattr(obj, 'data_ptr'):
+            storage = obj.untyped_storage()
+            ptr, nbytes = storage.data_ptr(), storage.nbytes()
+        else:
+            ptr = None
+
+        if ptr is not None:
+            if ptr not in buffers:
+                buffers.add(ptr)
+                if is_mapped(ptr, ranges):
+                    usage.mapped += nbytes
+                else:
+                    usage.private += nbytes
+            continue
+
+        usage.private += sys.getsizeof(obj)
+        if isinstance(obj, (str, bytes, bytearray, int, float, bool)):
+            continue
+        elif isinstance(obj, dict):
+            stack.extend(obj.keys())
+            stack.extend(obj.values())
+        elif isinstance(obj, (list, tuple, set, frozenset)):
+            stack.extend(obj)
+        else:
+            if (attrs := getattr(obj, '__dict__', None)) is not None:
+                stack.append(attrs)
+            for slot in getattr(type(obj), '__slots__', ()):
+                stack.append(getattr(obj, slot, None))
+    return usage
+
+
+@dataclass(eq=False)
+class Subsystem:
+
+    name: str
+
+    roots: Callable[[], Iterable[Any]]
+
+    evict: Optional[Evict] = None
+
+
+class MemoryAccountant:
+    """Class MemoryAccountant measures memory held by registered subsystems,
+    evicts subsystems over their budgets, and warns when resident set size
+    of a process exceeds high-water mark.
+
+    :param budgets: Budgets of subsystems in bytes.
+    :param high_water: High-water mark of resident set size in bytes.
+    """
+
+    def __init__(self, budgets: Optional[Dict[str, int]] = None,
+                 high_water: Optional[int] = None):
+        self.budgets = budgets or {}
+        self.high_water = high_water
+        self.above_high_water = False
+        self.subsystems: List[Subsystem] = []
+        self.report = MemoryReport(budgets=self.budgets)
+        self.lock = Lock()
+
+    def __str__(self) -> str:
+        names = sorted({subsystem.name for subsystem in self.subsystems})
+        return (f'MemoryAccountant(subsystems={",".join(names)}, '
+                f'high_water={self.high_water})')
+
+    def register(self, name: str, roots: Callable[[], Iterable[Any]],
+                 evict: Optional[Evict] = None) -> Subsystem:
+        """Method register adds a source of subsystem objects. Sources are
+        walked in order of registration and an object reachable from several
+        subsystems is attributed to the first one (e.g. model weights shared
+        with indexes), so models should be registered first. Function evict
+        is called with number of bytes to release. Returned source should be
+        unregistered when its objects are released (e.g. on session close).
+        """
+        subsystem = Subsystem(name, roots, evict)
+        with self.lock:
+            self.subsystems.append(subsystem)
+        return subsystem
+
+    def unregister(self, subsystems: Iterable[Subsystem]):
+        """Method unregister removes sources of subsystem objects.
+        """
+        with self.lock:
+            for subsystem in subsystems:
+                if subsystem in self.subsystems:
+                    self.subsystems.remove(subsystem)
+
+    def snapshot(self) -> MemoryReport:
+        seen: Set[int] = set()
+        buffers: Set[int] = set()
+        ranges = read_mapped_ranges()
+        with self.lock:
+            subsystems = list(self.subsystems)
+        usages: Dict[str, Usage] = {}
+        for subsystem in subsystems:
+            usage = usages.setdefault(subsystem.name, Usage())
+            usage += measure(subsystem.roots(), seen, buffers, ranges)
+        self.report = MemoryReport(read_process_memory(), usages,
+                                   dict(self.budgets), time())
+        return self.report
+
+    def enforce(self) -> MemoryReport:
+        """Method enforce measures subsystems and asks ones over budget to
+        evict. It is supposed to run in background periodically.
+        """
+        report = self.snapshot()
+        for name, usage in report.subsystems.items():
+            if (budget := self.budgets.get(name)) is None or \
+                    usage.private <= budget:
+                continue
+            excess = usage.private - budget
+            with self.lock:
+                evicts = [subsystem.evict for subsystem in self.subsystems
+                          if subsystem.name == name and subsystem.evict]
+            if not evicts:
+                logging.warning('subsystem %s exceeds budget by %.1f MiB but '
+                                'it could not evict', name, excess / 2**20)
+                continue
+            released = 0
+            for evict in evicts:
+                if released >= excess:
+                    break
+                released += evict(excess - released)
+            logging.info('subsystem %s exceeds budget by %.1f MiB: evict '
+                         '%.1f MiB', name, excess / 2**20, released / 2**20)
+
+        rss = report.process.get('rss', 0)
+        if self.high_water is not None and rss > self.high_water:
+            if not self.above_high_water:
+                logging.warning('resident set size %.1f MiB exceeds '
+                                'high-water mark %.1f MiB\n%s', rss / 2**20,
+                                self.high_water / 2**20, report)
+            self.above_high_water = True
+        else:
+            self.above_high_water = False
+        return report
+
+    def metrics(self) -> Dict[str, float]:
+        """Method metrics returns gauges of the last report (metrics endpoint
+        does not walk object graphs on scrape).
+        """
+        report = self.report
+        result = {f'process_{name}_bytes': value
+                  for name, value in report.process.items()}
+        for name, usage in report.subsystems.items():
+            result[f'{name}_private_bytes'] = usage.private
+            result[f'{name}_mapped_bytes'] = usage.mapped
+        for name, budget in report.budgets.items():
+            result[f'{name}_budget_bytes'] = budget
+        return result
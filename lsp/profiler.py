@@ -0,0 +1,132 @@
+#   encoding: utf8
+#   filename: profiler.py
+"""In-process statistical profiler. A sampler thread periodically takes
+stacks of all threads and counts them. Stacks are written in collapsed
+format (one line of semicolon-separated frames and a count) which
+flamegraph.pl, speedscope, and inferno read. The sampler thread exists
+only while profiling, so there is no overhead while idle.
+"""
+
+import logging
+import sys
+
+from collections import Counter
+from dis import opmap
+from os.path import basename
+from threading import Event, Thread, enumerate as enumerate_threads, \
+    get_ident
+from time import perf_counter
+from types import FrameType
+from typing import Dict, List, Optional, Tuple
+
+__all__ = ('SamplingProfiler', )
+
+
+# Name of a pseudo-frame of native code. Python frame which is sampled in
+# the middle of call instruction with no Python frame above it runs a builtin
+# or an extension (e.g. torch operator, tokenizer, or blocking I/O).
+NATIVE = '[native]'
+
+CALL_OPCODES = frozenset(opmap[name] for name in (
+    'CALL', 'CALL_FUNCTION', 'CALL_FUNCTION_EX', 'CALL_FUNCTION_KW',
+    'CALL_METHOD', 'PRECALL') if name in opmap)
+
+
+def format_frame(frame: FrameType) -> str:
+    code = frame.f_code
+    name = getattr(code, 'co_qualname', code.co_name)
+    return f'{basename(code.co_filename)}:{name}'.replace(';', ':')
+
+
+def is_native_call(frame: FrameType) -> bool:
+    code = frame.f_code.co_code
+    return 0 <= frame.f_lasti < len(code) and \
+        code[frame.f_lasti] in CALL_OPCODES
+
+
+def collapse(frame: Optional[FrameType]) -> Tuple[str, ...]:
+    stack = []
+    if frame is not None and is_native_call(frame):
+        stack.append(NATIVE)
+    while frame is not None:
+        stack.append(format_frame(frame))
+        frame = frame.f_back
+    return tuple(reversed(stack))
+
+
+class SamplingProfiler:
+    """Class SamplingProfiler samples Python stacks of all threads but the
+    sampler itself.
+
+    :param interval: Sampling interval in seconds.
+    """
+
+    def __init__(self, interval: float = 0.005):
+        if interval <= 0:
+            raise ValueError(f'Sampling interval should be positive: '
+                             f'{interval}.')
+        self.interval = interval
+        self.samples: Counter = Counter()
+        self.num_samples = 0
+        self.elapsed = 0.0
+        self.stopped = Event()
+        self.thread: Optional[Thread] = None
+
+    def __str__(self) -> str:
+        return (f'SamplingProfiler(interval={self.interval}, '
+                f'running={self.running}, nosamples={self.num_samples}, '
+                f'nostacks={len(self.samples)})')
+
+    @property
+    def running(self) -> bool:
+        return self.thread is not None and self.thread.is_alive()
+
+    def start(self):
+        if self.running:
+            raise RuntimeError('Profiler is already running.')
+        self.samples.clear()
+        self.num_samples = 0
+        self.stopped.clear()
+        self.thread = Thread(target=self.sample, daemon=True,
+                             name='[lsp] profiler')
+        self.thread.start()
+
+    def stop(self) -> Counter:
+        if self.running:
+            self.stopped.set()
+            self.thread.join()
+        return self.samples
+
+    def sample(self):
+        started_at = perf_counter()
+        ident = get_ident()
+        names: Dict[int, str] = {}
+        while not self.stopped.wait(self.interval):
+            frames = sys._current_frames()
+            if len(names) != len(frames):
+                names = {thread.ident: thread.name
+                         for thread in enumerate_threads()}
+            for thread_id, frame in frames.items():
+                if thread_id == ident:
+                    continue
+                name = names.get(thread_id, str(thread_id))
+                self.samples[(name, ) + collapse(frame)] += 1
+            self.num_samples += 1
+            del frames
+        self.elapsed = perf_counter() - started_at
+        logging.info('profiler took %d samples in %.1f s',
+                     self.num_samples, self.elapsed)
+
+    def collapsed(self) -> List[str]:
+        return [f'{";".join(stack)} {count}'
+                for stack, count in sorted(self.samples.items())]
+
+    def dump(self, path: str) -> int:
+        """Method dump writes stacks in collapsed format and returns number
+        of distinct stacks.
+        """
+        with open(path, 'w') as fout:
+            for line in self.collapsed():
+                fout.write(line)
+                fout.write('\n')
+        return len(self.samples)
@@ -0,0 +1,387 @@
+#   encoding: utf8
+#   filename: prune.py
+"""Static vocabulary pruning of masked language models. Token frequencies are
+collected on a local corpus, rare rows of embedding matrix and LM head are
+dropped, and token identifiers are remapped in both model and tokenizer.
+"""
+
+import logging
+
+from collections import Counter
+from dataclasses import dataclass
+from json import dump, dumps, load, loads
+from pathlib import Path
+from random import Random
+from time import perf_counter
+from typing import Dict, Iterable, Iterator, List, Optional, Set, Tuple
+
+__all__ = (
+    'PruneReport',
+    'count_tokens',
+    'prune_model',
+    'prune_tokenizer',
+    'prune_vocab',
+    'read_corpus',
+    'select_tokens',
+)
+
+
+@dataclass
+class PruneReport:
+    """Class PruneReport summarises effect of vocabulary pruning.
+    """
+
+    vocab_size: int
+
+    pruned_vocab_size: int
+
+    model_bytes: int
+
+    pruned_model_bytes: int
+
+    latency: float
+
+    pruned_latency: float
+
+    top1_agreement: float
+
+    topk_agreement: float
+
+    def __str__(self) -> str:
+        saved_bytes = self.model_bytes - self.pruned_model_bytes
+        saved_time = self.latency - self.pruned_latency
+        return '\n'.join([
+            f'Vocabulary size:        {self.vocab_size} -> {self.pruned_vocab_size}',  # noqa: E501
+            f'Model size, MiB:        {self.model_bytes / 2**20:.1f} -> {self.pruned_model_bytes / 2**20:.1f}',  # noqa: E501
+            f'Memory saved, MiB:      {saved_bytes / 2**20:.1f}',
+            f'Latency, ms:            {self.latency * 1e3:.1f} -> {self.pruned_latency * 1e3:.1f}',  # noqa: E501
+            f'Latency saved, ms:      {saved_time * 1e3:.1f}',
+            f'Top-1 agreement:        {self.top1_agreement:.3f}',
+            f'Top-k agreement:        {self.topk_agreement:.3f}',
+        ])
+
+
+def read_corpus(paths: Iterable[Path], suffixes: Optional[Set[str]] = None,
+                chunk_size: int = 1 << 20) -> Iterator[str]:
+    """Function read_corpus reads files (or files in directories recursively)
+    and yields texts in chunks of about chunk_size characters split at line
+    boundaries. It is suitable for both huge single files like enwik8 and
+    source trees.
+    """
+    for path in paths:
+        if path.is_dir():
+            files = sorted(p for p in path.rglob('*') if p.is_file())
+        else:
+            files = [path]
+        for file in files:
+            if suffixes and file.suffix not in suffixes:
+                continue
+            logging.info('read corpus file %s', file)
+            with open(file, errors='ignore') as fin:
+                while (chunk := fin.read(chunk_size)):
+                    chunk += fin.readline()
+                    yield chunk
+
+
+def count_tokens(tokenizer, texts: Iterable[str],
+                 batch_size: int = 64) -> Counter:
+    """Function count_tokens counts occurrences of token identifiers in texts.
+    Texts are split into lines in order to avoid truncation.
+    """
+    counts: Counter = Counter()
+    batch: List[str] = []
+    for text in texts:
+        batch.extend(line for line in text.splitlines() if line.strip())
+        while len(batch) >= batch_size:
+            encoded = tokenizer(batch[:batch_size], add_special_tokens=False)
+            for ids in encoded['input_ids']:
+                counts.update(ids)
+            batch = batch[batch_size:]
+    if batch:
+        for ids in tokenizer(batch, add_special_tokens=False)['input_ids']:
+            counts.update(ids)
+    return counts
+
+
+def select_tokens(tokenizer, counts: Counter, vocab_size: Optional[int] = None,
+                  min_freq: int = 1) -> List[int]:
+    """Function select_tokens returns sorted list of token identifiers to keep.
+    Special tokens are kept always as well as tokens which are required by
+    tokenizer model in order to encode arbitrary text (e.g. byte alphabet of
+    BPE).
+    """
+    state = loads(tokenizer.backend_tokenizer.to_str())
+    required = set(tokenizer.all_special_ids)
+    required.update(find_required_tokens(state['model']))
+
+    budget = None
+    if vocab_size is not None:
+        budget = max(0, vocab_size - len(required))
+
+    keep = set(required)
+    for token_id, freq in counts.most_common():
+        if freq < min_freq or (budget is not None and budget <= 0):
+            break
+        if token_id not in keep:
+            keep.add(token_id)
+            if budget is not None:
+                budget -= 1
+
+    # BPE tokens are reachable only if all merges leading to them are kept.
+    if state['model']['type'] == 'BPE':
+        keep = close_bpe(state['model'], keep, required)
+
+    return sorted(keep)
+
+
+def find_required_tokens(model) -> Set[int]:
+    vocab: Dict[str, int] = model['vocab']
+    if model['type'] == 'BPE':
+        merged = {''.join(split_merge(m)) for m in model['merges']}
+        return {ix for tok, ix in vocab.items() if tok not in merged}
+    elif model['type'] == 'WordPiece':
+        prefix = model.get('continuing_subword_prefix', '##')
+        return {ix for tok, ix in vocab.items()
+                if len(tok) == 1 or (tok.startswith(prefix) and
+                                     len(tok) == len(prefix) + 1)}
+    else:
+        raise ValueError(f'Unsupported tokenizer model: {model["type"]}')
+
+
+def split_merge(merge) -> List[str]:
+    # Merges are serialized either as "a b" strings or as ["a", "b"] pairs
+    # depending on version of tokenizers.
+    return merge.split(' ', 1) if isinstance(merge, str) else list(merge)
+
+
+def close_bpe(model, keep: Set[int], required: Set[int]) -> Set[int]:
+    """Function close_bpe removes tokens which could not be produced by BPE
+    merges once merges with pruned operands are removed.
+    """
+    vocab: Dict[str, int] = model['vocab']
+    reachable = {ix for ix in keep if ix in required}
+    for merge in model['merges']:
+        lhs, rhs = split_merge(merge)
+        token_id = vocab.get(lhs + rhs)
+        if token_id is None or token_id not in keep:
+            continue
+        if vocab.get(lhs) in reachable and vocab.get(rhs) in reachable:
+            reachable.add(token_id)
+    return reachable
+
+
+def prune_tokenizer(tokenizer, keep: List[int], outdir: Path):
+    """Function prune_tokenizer saves tokenizer to output directory and
+    rewrites its vocabulary in order to use remapped token identifiers.
+    """
+    remap = {old: new for new, old in enumerate(keep)}
+    tokenizer.save_pretrained(outdir)
+
+    state = loads(tokenizer.backend_tokenizer.to_str())
+    model = state['model']
+    vocab = {tok: remap[ix] for tok, ix in model['vocab'].items()
+             if ix in remap}
+    model['vocab'] = vocab
+    if model['type'] == 'BPE':
+        model['merges'] = [m for m in model['merges']
+                           if ''.join(split_merge(m)) in vocab]
+    for token in state.get('added_tokens') or []:
+        token['id'] = remap[token['id']]
+    remap_post_processor(state.get('post_processor'), remap)
+
+    with open(outdir / 'tokenizer.json', 'w') as fout:
+        fout.write(dumps(state, ensure_ascii=False))
+
+    # Slow tokenizers read vocabulary and merges from separate files.
+    if (outdir / 'vocab.json').exists():
+        with open(outdir / 'vocab.json', 'w') as fout:
+            dump(vocab, fout, ensure_ascii=False)
+    if (outdir / 'merges.txt').exists():
+        with open(outdir / 'merges.txt', 'w') as fout:
+            print('#version: 0.2', file=fout)
+            for merge in model['merges']:
+                print(' '.join(split_merge(merge)), file=fout)
+    if (outdir / 'vocab.txt').exists():
+        with open(outdir / 'vocab.txt', 'w') as fout:
+            for tok, _ in sorted(vocab.items(), key=lambda x: x[1]):
+                print(tok, file=fout)
+    if (outdir / 'added_tokens.json').exists():
+        with open(outdir / 'added_tokens.json') as fin:
+            added = load(fin)
+        with open(outdir / 'added_tokens.json', 'w') as fout:
+            dump({k: remap[v] for k, v in added.items() if v in remap}, fout)
+
+
+def remap_post_processor(proc, remap: Dict[int, int]):
+    if not proc:
+        return
+    for key in ('sep', 'cls'):
+        if key in proc:
+            proc[key] = [proc[key][0], remap[proc[key][1]]]
+    for token in (proc.get('special_tokens') or {}).values():
+        token['ids'] = [remap[ix] for ix in token['ids']]
+    for child in proc.get('processors') or []:
+        remap_post_processor(child, remap)
+
+
+def prune_model(model, keep: List[int]):
+    """Function prune_model slices input embeddings and LM head in-place and
+    updates special token identifiers in model config.
+    """
+    import torch as T
+
+    remap = {old: new for new, old in enumerate(keep)}
+    index = T.tensor(keep, dtype=T.long)
+
+    config = model.config
+    for attr in ('pad_token_id', 'bos_token_id', 'eos_token_id',
+                 'sep_token_id', 'cls_token_id', 'mask_token_id'):
+        if (token_id := getattr(config, attr, None)) is not None:
+            setattr(config, attr, remap.get(token_id))
+
+    emb = model.get_input_embeddings()
+    padding_idx = remap.get(emb.padding_idx) \
+        if emb.padding_idx is not None else None
+    new_emb = T.nn.Embedding(len(keep), emb.embedding_dim,
+                             padding_idx=padding_idx)
+    new_emb.weight.data = emb.weight.data[index].clone()
+    model.set_input_embeddings(new_emb)
+
+    # Some models (e.g. RoBERTa) compute position identifiers with respect to
+    # padding index which is stored outside of embedding layer.
+    for module in model.modules():
+        if module is new_emb or not hasattr(module, 'padding_idx'):
+            continue
+        if isinstance(module, T.nn.Embedding):
+            continue
+        if module.padding_idx is not None:
+            module.padding_idx = padding_idx
+
+    if (head := model.get_output_embeddings()) is not None:
+        new_head = T.nn.Linear(head.in_features, len(keep),
+                               bias=head.bias is not None)
+        new_head.weight.data = head.weight.data[index].clone()
+        if head.bias is not None:
+            new_head.bias.data = head.bias.data[index].clone()
+        model.set_output_embeddings(new_head)
+        if hasattr(lm_head := getattr(model, 'lm_head', None), 'bias'):
+            lm_head.bias = new_head.bias
+
+    config.vocab_size = len(keep)
+    if getattr(config, 'tie_word_embeddings', False):
+        model.tie_weights()
+    return model
+
+
+def count_bytes(model) -> int:
+    # Tied parameters are counted once since parameters() deduplicates them.
+    return sum(p.numel() * p.element_size() for p in model.parameters())
+
+
+def sample_contexts(tokenizer, texts: Iterable[str], num_samples: int,
+                    window: int = 128,
+                    seed: int = 42) -> List[Tuple[str, str]]:
+    """Function sample_contexts samples lines from texts uniformly (with
+    reservoir sampling in order to bound memory) and hides a random token of
+    every line. Samples are pairs of text before and after the token.
+    Tokens are masked in text space so that original and pruned tokenizers
+    could produce different tokenizations.
+    """
+    rng = Random(seed)
+    reservoir: List[str] = []
+    num_lines = 0
+    for text in texts:
+        for line in text.splitlines():
+            if len(line.strip()) <= 8:
+                continue
+            num_lines += 1
+            if len(reservoir) < num_samples:
+                reservoir.append(line)
+            elif (slot := rng.randrange(num_lines)) < num_samples:
+                reservoir[slot] = line
+
+    samples = []
+    for line in reservoir:
+        encoding = tokenizer(line, add_special_tokens=False,
+                             return_offsets_mapping=True)
+        if not (offsets := encoding['offset_mapping']):
+            continue
+        begin, end = offsets[rng.randrange(len(offsets))]
+        samples.append((line[max(0, begin - window):begin],
+                        line[end:end + window]))
+    return samples
+
+
+def evaluate(tokenizer, model, samples: List[Tuple[str, str]], top_k: int):
+    import torch as T
+    from transformers import pipeline
+
+    fill_mask = pipeline('fill-mask', model=model, tokenizer=tokenizer)
+    predictions = []
+    elapsed = 0.0
+    with T.no_grad():
+        for prefix, suffix in samples:
+            # Text is not a format string since code is full of braces.
+            text = ''.join([prefix, tokenizer.mask_token, suffix])
+            started_at = perf_counter()
+            result = fill_mask(text, top_k=top_k)
+            elapsed += perf_counter() - started_at
+            predictions.append([el['token_str'] for el in result])
+    return predictions, elapsed / max(1, len(samples))
+
+
+def prune_vocab(model_path: Path, output: Path, corpus: List[Path],
+                vocab_size: Optional[int] = None, min_freq: int = 1,
+                num_samples: int = 100, top_k: int = 10,
+                suffixes: Optional[Set[str]] = None) -> PruneReport:
+    """Function prune_vocab is an entry point of vocabulary pruning. It reads
+    corpus, prunes model and tokenizer, saves them to output directory and
+    compares pruned model to the original one.
+    """
+    from transformers import AutoTokenizer
+
+    from .completion import load_pretrained
+
+    logging.info('load model from %s', model_path)
+    tokenizer, model = load_pretrained(str(model_path))
+    model.eval()
+
+    logging.info('count token frequencies in corpus')
+    counts = count_tokens(tokenizer, read_corpus(corpus, suffixes))
+    logging.info('found %d unique tokens out of %d', len(counts),
+                 len(tokenizer))
+
+    keep = select_tokens(tokenizer, counts, vocab_size, min_freq)
+    logging.info('keep %d tokens out of %d', len(keep), len(tokenizer))
+
+    samples = sample_contexts(tokenizer, read_corpus(corpus, suffixes),
+                              num_samples)
+    logging.info('evaluate original model on %d samples', len(samples))
+    model_bytes = count_bytes(model)
+    predictions, latency = evaluate(tokenizer, model, samples, top_k)
+
+    logging.info('prune model and tokenizer')
+    output.mkdir(parents=True, exist_ok=True)
+    prune_tokenizer(tokenizer, keep, output)
+    prune_model(model, keep)
+    model.save_pretrained(output)
+
+    logging.info('evaluate pruned model')
+    pruned_tokenizer = AutoTokenizer.from_pretrained(str(output))
+    pruned_predictions, pruned_latency = \
+        evaluate(pruned_tokenizer, model, samples, top_k)
+
+    top1 = topk = 0.0
+    for lhs, rhs in zip(predictions, pruned_predictions):
+        top1 += float(lhs[:1] == rhs[:1])
+        topk += len(set(lhs) & set(rhs)) / max(1, len(lhs))
+    num_samples = max(1, len(samples))
+
+    return PruneReport(vocab_size=len(tokenizer),
+                       pruned_vocab_size=len(keep),
+                       model_bytes=model_bytes,
+                       pruned_model_bytes=count_bytes(model),
+                       latency=latency,
+                       pruned_latency=pruned_latency,
+                       top1_agreement=top1 / num_samples,
+                       topk_agreement=topk / num_samples)
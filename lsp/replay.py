@@ -0,0 +1,208 @@
+#   encoding: utf8
+#   filename: replay.py
+"""Deterministic replay of recorded traffic (see serve --record). Every
+recorded session is replayed by its own client at original or scaled pace and
+latency distributions of the replay are compared to the recorded ones.
+"""
+
+import logging
+
+from dataclasses import asdict, dataclass, field
+from io import StringIO
+from json import dumps, loads
+from pathlib import Path
+from shlex import split as split_command
+from threading import Thread
+from time import perf_counter, sleep
+from typing import Any, Dict, List, Optional, Tuple
+
+from .bench import COLUMNS, Client, MethodStats, Sample, aggregate
+from .lsp import Addr
+from .lsp.syncio.record import Kind, Record, read_records
+from .version import version
+
+__all__ = ('ReplayReport', 'Replayer', 'replay')
+
+
+@dataclass
+class ReplayReport:
+
+    log: str
+
+    speed: float
+
+    num_sessions: int
+
+    num_frames: int
+
+    elapsed: float
+
+    original: List[MethodStats] = field(default_factory=list)
+
+    replayed: List[MethodStats] = field(default_factory=list)
+
+    def __str__(self) -> str:
+        lines = [f'replay {self.num_frames} frames of {self.num_sessions} '
+                 f'sessions from {self.log} at {self.speed:.1f}x in '
+                 f'{self.elapsed:.1f} s',
+                 '',
+                 f'{"method":<28} {"count":>7} {"p50":>17} {"p95":>17} '
+                 f'{"p99":>17}']
+        original = {stats.method: stats for stats in self.original}
+        for stats in self.replayed:
+            if (base := original.get(stats.method)) is None:
+                continue
+            line = f'{stats.method:<28} {stats.count:>7}'
+            for name in ('p50', 'p95', 'p99'):
+                before, after = getattr(base, name), getattr(stats, name)
+                line += f' {before:>8.2f}→{after:<8.2f}'
+            lines.append(line)
+        return '\n'.join(lines)
+
+    def to_csv(self) -> str:
+        buf = StringIO()
+        buf.write(','.join(('source', ) + COLUMNS) + '\n')
+        for source, methods in (('original', self.original),
+                                ('replay', self.replayed)):
+            for stats in methods:
+                row = asdict(stats)
+                buf.write(source + ',')
+                buf.write(','.join(str(row[column]) for column in COLUMNS))
+                buf.write('\n')
+        return buf.getvalue()
+
+    def to_json(self) -> str:
+        obj = asdict(self)
+        obj['elapsed'] = round(self.elapsed, 3)
+        obj['version'] = version
+        return dumps(obj, indent=2) + '\n'
+
+
+class Replayer(Client):
+    """Class Replayer sends recorded inbound frames of a session to a server
+    as is. Responses to requests of server are recorded as well so that they
+    are not acknowledged. Session clock starts on response to initialize
+    since start up of a server is not a part of traffic.
+    """
+
+    def __init__(self, index: int, addr: Addr, command: List[str],
+                 records: List[Record], timeout: float = 60.0):
+        super().__init__(index, addr, command, timeout, acknowledge=False)
+        self.records = records
+
+    @property
+    def num_frames(self) -> int:
+        return sum(record.kind == Kind.INBOUND for record in self.records)
+
+    def run(self, speed: float):
+        self.connect()
+        origin, started_at = self.records[0].timestamp, perf_counter()
+        initialize = None
+        for record in self.records:
+            if record.kind == Kind.RESPONSE:
+                if initialize is not None and \
+                        loads(record.content) == initialize[0]:
+                    initialize[1].wait(self.timeout)
+                    origin, started_at = record.timestamp, perf_counter()
+                continue
+            sent_at = started_at + (record.timestamp - origin) / 1e9 / speed
+            if (delay := sent_at - perf_counter()) > 0:
+                sleep(delay)
+            packet = loads(record.content)
+            if (method := packet.get('method')) is None:
+                pass
+            elif 'id' in packet:
+                done = self.track(packet['id'], method)
+                if method == 'initialize':
+                    initialize = (packet['id'], done)
+            elif method == '$/cancelRequest':
+                self.cancel((packet.get('params') or {}).get('id'),
+                            notify=False)
+            self.write(record.content)
+        self.wait(self.timeout)
+        self.close()
+
+
+def original_samples(records: List[Record]) -> List[Sample]:
+    """Function original_samples restores latencies of requests of a session
+    from timestamps of requests and responses.
+    """
+    samples = []
+    requests: Dict[Any, Tuple[str, int]] = {}
+    cancelled = set()
+    for record in records:
+        if record.kind == Kind.RESPONSE:
+            request_id = loads(record.content)
+            if (request := requests.pop(request_id, None)) is not None:
+                method, sent_at = request
+                samples.append(Sample(method,
+                                      (record.timestamp - sent_at) / 1e9,
+                                      request_id in cancelled))
+            continue
+        packet = loads(record.content)
+        if (method := packet.get('method')) is None:
+            continue
+        elif 'id' in packet:
+            requests[packet['id']] = (method, record.timestamp)
+        elif method == '$/cancelRequest':
+            cancelled.add((packet.get('params') or {}).get('id'))
+    return samples
+
+
+def replay(log: Path, addr: Addr, command: str, speed: float = 1.0,
+           output: Optional[Path] = None,
+           output_format: str = 'csv') -> ReplayReport:
+    """Function replay feeds recorded sessions to a server concurrently
+    (every session has its own connection) and reports latencies of
+    original and replayed requests per method.
+    """
+    if speed <= 0:
+        raise ValueError(f'Replay speed should be positive: {speed}.')
+    sessions: Dict[int, List[Record]] = {}
+    for record in read_records(log):
+        sessions.setdefault(record.session, []).append(record)
+    if not sessions:
+        raise ValueError(f'There is no traffic in log: {log}.')
+
+    # Original elapsed time spans from the first to the last record.
+    timestamps = [record.timestamp for records in sessions.values()
+                  for record in (records[0], records[-1])]
+    origin = min(timestamps)
+    original_elapsed = max((max(timestamps) - origin) / 1e9, 1e-9)
+
+    argv = split_command(command)
+    replayers = [Replayer(index, addr, argv, records)
+                 for index, records in sorted(sessions.items())]
+    num_frames = sum(replayer.num_frames for replayer in replayers)
+    logging.info('replay %d frames of %d sessions against %s at %.1fx',
+                 num_frames, len(replayers), addr, speed)
+
+    started_at = perf_counter()
+    threads = [Thread(target=replayer.run, args=(speed, ),
+                      daemon=True, name=f'[lsp] replay #{replayer.index}')
+               for replayer in replayers]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    elapsed = perf_counter() - started_at
+
+    report = ReplayReport(log=str(log),
+                          speed=speed,
+                          num_sessions=len(sessions),
+                          num_frames=num_frames,
+                          elapsed=elapsed)
+    report.original = aggregate(
+        (original_samples(records) for records in sessions.values()),
+        original_elapsed)
+    report.replayed = aggregate((replayer.samples for replayer in replayers),
+                                elapsed)
+
+    if output is not None:
+        logging.info('write %s report to %s', output_format, output)
+        with open(output, 'w') as fout:
+            if output_format == 'json':
+                fout.write(report.to_json())
+            else:
+                fout.write(report.to_csv())
+    return report
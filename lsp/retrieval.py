@@ -0,0 +1,671 @@
+#   encoding: utf8
+#   filename: retrieval.py
+"""Workspace retrieval engine. Files under workspace root are split into
+snippets (blocks of lines) which are indexed with inverted index and ranked
+with Okapi BM25.
+"""
+
+import logging
+
+from collections import Counter, OrderedDict, deque
+from concurrent.futures import Future, ProcessPoolExecutor
+from dataclasses import dataclass
+from hashlib import blake2b
+from heapq import heapify, heappop, nlargest
+from itertools import count
+from math import log
+from multiprocessing import get_context
+from pathlib import Path
+from re import compile as compile_regex
+from threading import Lock
+from time import perf_counter
+from typing import (Container, Deque, Dict, Iterable, Iterator, List,
+                    Optional, Sequence, Set, Tuple)
+from urllib.parse import unquote, urlparse
+
+from .background import checkpoint
+from .crawler import Crawler, lower_priority, read_file
+from .segment import FileRecord, Segment, write_segment
+from .symbols import Symbol, SymbolIndex, extract_symbols
+
+__all__ = (
+    'InvertedIndex',
+    'Snippet',
+    'WorkspaceIndex',
+    'split_blocks',
+    'tokenize',
+    'uri_to_path',
+)
+
+
+WORD_REGEX = compile_regex(r'[^\W\d]\w+')
+
+# Block is a sequence of lines. Blocks are split at blank lines (content
+# defined chunking) so that an edit invalidates only a block it touches.
+MIN_BLOCK_LINES = 4
+
+MAX_BLOCK_LINES = 32
+
+# Number of files which lines are cached to fetch snippets.
+MAX_CACHED_FILES = 64
+
+Block = Tuple[int, int, int, Optional[Dict[str, int]]]
+
+Meta = Tuple[int, int, int]
+
+NO_META: Meta = (0, 0, 0)
+
+Analysis = Tuple[str, Meta, List[Block], List[Symbol]]
+
+
+def tokenize(text: str) -> List[str]:
+    return [word.lower() for word in WORD_REGEX.findall(text)]
+
+
+def split_blocks(text: str) -> Iterator[Tuple[int, str]]:
+    """Function split_blocks splits text into blocks of lines and yields
+    number of the first line of a block and block text.
+    """
+    lines = text.splitlines(keepends=True)
+    begin = 0
+    for end, line in enumerate(lines, 1):
+        size = end - begin
+        if (size >= MIN_BLOCK_LINES and not line.strip()) or \
+                size >= MAX_BLOCK_LINES:
+            yield begin, ''.join(lines[begin:end])
+            begin = end
+    if begin < len(lines):
+        yield begin, ''.join(lines[begin:])
+
+
+def uri_to_path(uri: str) -> Optional[Path]:
+    if not uri:
+        return None
+    parsed = urlparse(uri)
+    if parsed.scheme not in ('', 'file'):
+        return None
+    return Path(unquote(parsed.path))
+
+
+def hash_block(block: str) -> int:
+    # Builtin hash() of strings is salted per process so that it could not be
+    # used to compare blocks analyzed in worker processes.
+    digest = blake2b(block.encode('utf-8'), digest_size=8).digest()
+    return int.from_bytes(digest, 'little')
+
+
+def analyze(text: str, known: Container[int] = ()) -> List[Block]:
+    """Function analyze splits text into blocks and returns tuples of block
+    hash, first line, number of lines, and term frequencies. Blocks which
+    hashes are known are not tokenized.
+    """
+    result = []
+    for line, block in split_blocks(text):
+        block_hash = hash_block(block)
+        terms = None if block_hash in known else Counter(tokenize(block))
+        result.append((block_hash, line, block.count('\n') + 1, terms))
+    return result
+
+
+def analyze_files(paths: List[str]) -> List[Analysis]:
+    """Function analyze_files reads and analyzes files. It returns path,
+    metadata (modification time, size, and digest of content), blocks, and
+    symbols for every text file.
+    """
+    result = []
+    for path in paths:
+        try:
+            if (content := read_file(path)) is None:
+                continue  # Binary or too large file.
+        except OSError:
+            continue
+        meta, text = content
+        result.append((path, meta, analyze(text), extract_symbols(text)))
+    return result
+
+
+def analyze_texts(docs: List[Tuple[str, Meta, str]]) -> List[Analysis]:
+    """Function analyze_texts analyzes files which are already read.
+    """
+    return [(path, meta, analyze(text), extract_symbols(text))
+            for path, meta, text in docs]
+
+
+@dataclass
+class Snippet:
+    """Class Snippet references a block of lines in a workspace file.
+    """
+
+    uri: str
+
+    line: int
+
+    num_lines: int
+
+    score: float = 0.0
+
+
+class InvertedIndex:
+    """Class InvertedIndex maps terms to postings (snippet identifier and term
+    frequency) and ranks snippets with BM25.
+
+    :param k1: BM25 term frequency saturation.
+    :param b: BM25 length normalization.
+    :param max_terms: Number of query terms with the highest IDF to use.
+    """
+
+    def __init__(self, k1: float = 1.2, b: float = 0.75, max_terms: int = 8,
+                 first_id: int = 0):
+        self.k1 = k1
+        self.b = b
+        self.max_terms = max_terms
+        self.postings: Dict[str, Dict[int, int]] = {}
+        self.snippets: Dict[int, Snippet] = {}
+        self.terms: Dict[int, Tuple[str, ...]] = {}
+        self.lengths: Dict[int, int] = {}
+        self.total_length = 0
+        self.next_id = count(first_id)
+
+    def __len__(self) -> int:
+        return len(self.snippets)
+
+    def add(self, snippet: Snippet, terms: Dict[str, int]) -> int:
+        snippet_id = next(self.next_id)
+        self.snippets[snippet_id] = snippet
+        self.terms[snippet_id] = tuple(terms)
+        self.lengths[snippet_id] = length = sum(terms.values())
+        self.total_length += length
+        for term, freq in terms.items():
+            if (posting := self.postings.get(term)) is None:
+                self.postings[term] = posting = {}
+            posting[snippet_id] = freq
+        return snippet_id
+
+    def remove(self, snippet_id: int):
+        self.snippets.pop(snippet_id)
+        self.total_length -= self.lengths.pop(snippet_id)
+        for term in self.terms.pop(snippet_id):
+            posting = self.postings[term]
+            del posting[snippet_id]
+            if not posting:
+                del self.postings[term]
+
+    def idf(self, term: str) -> float:
+        df = len(self.postings.get(term, ()))
+        return log(1 + (len(self.snippets) - df + 0.5) / (df + 0.5))
+
+    def search(self, terms: Iterable[str], k: int,
+               exclude: Optional[str] = None) -> List[Snippet]:
+        if not self.snippets:
+            return []
+
+        # Rare terms are both the most discriminative and the cheapest to
+        # score since they have short posting lists.
+        query = Counter(term for term in terms if term in self.postings)
+        weights = nlargest(self.max_terms, ((self.idf(term), term)
+                                            for term in query))
+
+        avgdl = self.total_length / len(self.snippets)
+        scores: Dict[int, float] = {}
+        for idf, term in weights:
+            self.accumulate(term, idf, avgdl, scores)
+
+        result = []
+        for score, snippet_id in ranked(scores):
+            snippet = self.snippets[snippet_id]
+            if snippet.uri == exclude:
+                continue
+            result.append(Snippet(snippet.uri, snippet.line,
+                                  snippet.num_lines, score))
+            if len(result) == k:
+                break
+        return result
+
+    def accumulate(self, term: str, idf: float, avgdl: float,
+                   scores: Dict[int, float]):
+        """Method accumulate adds BM25 scores of a term to snippet scores.
+        """
+        k1, b = self.k1, self.b
+        for snippet_id, freq in self.postings.get(term, {}).items():
+            norm = k1 * (1 - b + b * self.lengths[snippet_id] / avgdl)
+            score = idf * freq * (k1 + 1) / (freq + norm)
+            scores[snippet_id] = scores.get(snippet_id, 0.0) + score
+
+
+def ranked(scores: Dict[int, float]) -> Iterator[Tuple[float, int]]:
+    """Function ranked yields snippets in descending order of scores. Heap
+    is built in linear time and popped lazily, so that a caller skips any
+    number of candidates (e.g. snippets of excluded document) and pays only
+    for candidates it takes.
+    """
+    heap = [(-score, snippet_id) for snippet_id, score in scores.items()]
+    heapify(heap)
+    while heap:
+        score, snippet_id = heappop(heap)
+        yield -score, snippet_id
+
+
+class WorkspaceIndex:
+    """Class WorkspaceIndex maintains inverted index over blocks of workspace
+    files. Index is built in parallel in background and it is updated
+    incrementally: only changed blocks are reindexed.
+
+    Index consists of read-only memory-mapped segment which is loaded from
+    cache and in-memory delta index. Files changed since the segment was
+    written are marked as dead in the segment and indexed to delta. On save
+    both of them are merged to a new segment.
+
+    Symbols of workspace files are indexed for workspace/symbol requests as
+    well and they are persisted in the same segment.
+
+    :param num_results: Number of snippets to retrieve.
+    :param num_workers: Number of processes to analyze files on build.
+    :param cache_path: Path to segment file to load and save index.
+    """
+
+    def __init__(self, num_results: int = 3, num_workers: int = 4,
+                 suffixes: Optional[Iterable[str]] = None,
+                 cache_path: Optional[Path] = None):
+        self.base: Optional[Segment] = None
+        self.base_dead: Set[int] = set()
+        self.base_meta: Dict[int, Meta] = {}
+        self.base_snippets = 0
+        self.base_length = 0
+        self.index = InvertedIndex()
+        self.files: Dict[str, Dict[int, int]] = {}
+        self.meta: Dict[str, Meta] = {}
+        self.versions: Dict[str, int] = {}
+        self.symbols = SymbolIndex()
+        self.lock = Lock()
+
+        # Lines of recently fetched files which are not opened in editor.
+        # Entry is dropped once a file is reindexed or removed.
+        self.lines: OrderedDict = OrderedDict()
+        self.lines_epoch = 0
+        self.lines_lock = Lock()
+        self.num_results = num_results
+        self.num_workers = num_workers
+        self.suffixes = frozenset(suffixes or ())
+        self.cache_path = cache_path
+
+    def __str__(self) -> str:
+        return (f'WorkspaceIndex(base={self.base}, '
+                f'nofiles={len(self.files)}, nosnippets={len(self.index)})')
+
+    def load(self):
+        """Method load maps index segment from cache if there is any.
+        """
+        if self.cache_path is None or not self.cache_path.exists():
+            return
+        started_at = perf_counter()
+        try:
+            base = Segment(self.cache_path)
+        except Exception:
+            logging.exception('failed to load index from %s', self.cache_path)
+            return
+        with self.lock:
+            self.set_base(base)
+        # Symbol index is in-memory so it is populated from segment.
+        for index in range(base.num_files):
+            self.symbols.replace(base.uri(index), base.symbols(index))
+        logging.info('load workspace index from %s in %.1f ms: %s, %s',
+                     self.cache_path, (perf_counter() - started_at) * 1e3,
+                     base, self.symbols)
+
+    def set_base(self, base: Optional[Segment]):
+        if self.base is not None:
+            self.base.close()
+        self.base = base
+        self.base_dead = set()
+        self.base_meta = {}
+        self.base_snippets = base.num_snippets if base else 0
+        self.base_length = base.total_length if base else 0
+        self.index = InvertedIndex(first_id=self.base_snippets)
+        self.files = {}
+        self.meta = {}
+
+    def save(self):
+        """Method save merges segment and delta index into a new segment and
+        writes it to cache.
+        """
+        if self.cache_path is None:
+            return
+        started_at = perf_counter()
+        self.cache_path.parent.mkdir(parents=True, exist_ok=True)
+        with self.lock:
+            records, postings = self.merge()
+            write_segment(self.cache_path, records, postings)
+            self.set_base(Segment(self.cache_path))
+        logging.info('save workspace index to %s in %.1f ms: %s',
+                     self.cache_path, (perf_counter() - started_at) * 1e3,
+                     self.base)
+
+    def merge(self):
+        records: List[FileRecord] = []
+        postings: Dict[str, List[Tuple[int, int]]] = {}
+        remap_base: Dict[int, int] = {}
+        remap_delta: Dict[int, int] = {}
+
+        if (base := self.base) is not None:
+            for index in range(base.num_files):
+                if index in self.base_dead:
+                    continue
+                snippets = []
+                for snippet_id in base.snippets(index):
+                    remap_base[snippet_id] = len(remap_base)
+                    snippets.append((base.snippet_hashes[snippet_id],
+                                     base.snippet_lines[snippet_id],
+                                     base.snippet_num_lines[snippet_id],
+                                     base.snippet_lengths[snippet_id]))
+                mtime, size, digest = self.base_meta.get(index, (
+                    base.file_mtimes[index], base.file_sizes[index],
+                    base.file_digests[index]))
+                uri = base.uri(index)
+                records.append(FileRecord(uri, mtime, size, digest, snippets,
+                                          self.symbols.get(uri)))
+
+        offset = len(remap_base)
+        for uri, blocks in self.files.items():
+            snippets = []
+            for block_hash, snippet_id in blocks.items():
+                snippet = self.index.snippets[snippet_id]
+                remap_delta[snippet_id] = offset + len(remap_delta)
+                snippets.append((block_hash, snippet.line, snippet.num_lines,
+                                 self.index.lengths[snippet_id]))
+            mtime, size, digest = self.meta.get(uri, NO_META)
+            records.append(FileRecord(uri, mtime, size, digest, snippets,
+                                      self.symbols.get(uri)))
+
+        if base is not None:
+            for term, index in base.iter_terms():
+                ids, freqs = base.postings(index)
+                posting = [(remap_base[i], f) for i, f in zip(ids, freqs)
+                           if i in remap_base]
+                if posting:
+                    postings[term] = posting
+        for term, delta in self.index.postings.items():
+            posting = postings.setdefault(term, [])
+            posting.extend((remap_delta[i], f) for i, f in delta.items())
+
+        return records, postings
+
+    def build(self, roots: Sequence[Path], batch_size: int = 64):
+        """Method build loads index from cache, validates it against files
+        in workspace folders, and indexes new or changed files in parallel.
+        Files are considered unchanged if their modification time and size or
+        content digest are the same.
+
+        Crawling, analysis, and merging to index are pipelined: crawler
+        threads read files while batches of already read files are analyzed
+        in a pool of processes and the current thread merges results.
+        """
+        logging.info('build workspace index for %s',
+                     ', '.join(str(root) for root in roots))
+        self.load()
+
+        # Crawler checks metadata before a file is read so that unchanged
+        # files cost only a stat call.
+        seen: Set[str] = set()
+
+        def accept(path: str, mtime: int, size: int) -> bool:
+            uri = Path(path).as_uri()
+            seen.add(uri)
+            return not self.is_fresh(uri, mtime, size)
+
+        crawler = Crawler(self.num_workers, self.suffixes, accept)
+        context = get_context('spawn')
+        num_changed = 0
+        with ProcessPoolExecutor(self.num_workers, context,
+                                 initializer=lower_priority) as pool:
+            pending: Deque[Future] = deque()
+            batch = []
+            for doc in crawler.crawl(roots):
+                checkpoint()
+                with self.lock:
+                    if self.is_same(Path(doc.path).as_uri(), doc.meta):
+                        continue
+                batch.append((doc.path, doc.meta, doc.text))
+                if len(batch) == batch_size:
+                    pending.append(pool.submit(analyze_texts, batch))
+                    batch = []
+                # Number of batches in flight is bounded in order to bound
+                # memory if crawler outruns analyzers.
+                while pending and (pending[0].done() or
+                                   len(pending) > 2 * self.num_workers):
+                    num_changed += self.commit(pending.popleft().result())
+            if batch:
+                pending.append(pool.submit(analyze_texts, batch))
+            while pending:
+                num_changed += self.commit(pending.popleft().result())
+
+        num_deleted = 0
+        if (base := self.base) is not None:
+            with self.lock:
+                for uri, index in base.file_index.items():
+                    if uri not in seen and index not in self.base_dead:
+                        self.kill(index)
+                        self.symbols.remove(uri)
+                        num_deleted += 1
+
+        logging.info('indexed %d new or changed files and %d deleted files',
+                     num_changed, num_deleted)
+        if num_changed or num_deleted or self.base_meta:
+            self.save()
+        logging.info('workspace index is built: %s', self)
+
+    def is_fresh(self, uri: str, mtime: int, size: int) -> bool:
+        if self.base is None:
+            return False
+        if (index := self.base.file_index.get(uri)) is None:
+            return False
+        return mtime == self.base.file_mtimes[index] and \
+            size == self.base.file_sizes[index]
+
+    def commit(self, result: List[Analysis]) -> int:
+        with self.lock:
+            for path, meta, blocks, symbols in result:
+                uri = Path(path).as_uri()
+                self.replace(uri, blocks, meta)
+                self.symbols.replace(uri, symbols)
+        return len(result)
+
+    def is_same(self, uri: str, meta: Meta) -> bool:
+        # File is touched but its content is the same so that only metadata
+        # should be updated.
+        if self.base is None or uri in self.files:
+            return False
+        if (index := self.base.file_index.get(uri)) is None:
+            return False
+        if index in self.base_dead or \
+                self.base.file_digests[index] != meta[2]:
+            return False
+        self.base_meta[index] = meta
+        return True
+
+    def update(self, uri: str, text: str, meta: Meta = NO_META,
+               version: Optional[int] = None):
+        """Method update reindexes blocks of a document which changed. If
+        metadata of file is unknown (e.g. document is not saved) then the
+        file is revalidated on the next build. Updates could run
+        concurrently in background, so an update of a document version
+        older than the indexed one is dropped.
+        """
+        with self.lock:
+            known = frozenset(self.files.get(uri, ()))
+        blocks = analyze(text, known)
+        with self.lock:
+            if version is not None:
+                if version < self.versions.get(uri, version):
+                    return
+                self.versions[uri] = version
+            # Another update of the document could replace blocks which are
+            # skipped as known while this one is analyzed. It is rare so the
+            # text is reanalyzed against the current blocks.
+            current = self.files.get(uri, {})
+            if any(terms is None and block_hash not in current
+                   for block_hash, _, _, terms in blocks):
+                blocks = analyze(text, current)
+            self.replace(uri, blocks, meta)
+
+    def update_file(self, uri: str):
+        """Method update_file reindexes a file from filesystem.
+        """
+        if (path := uri_to_path(uri)) is None:
+            return
+        for _, meta, blocks, symbols in analyze_files([str(path)]):
+            with self.lock:
+                if not self.is_same(uri, meta):
+                    self.replace(uri, blocks, meta)
+                    self.symbols.replace(uri, symbols)
+
+    def remove(self, uri: str):
+        with self.lock:
+            self.versions.pop(uri, None)
+            self.forget_lines(uri)
+            for snippet_id in self.files.pop(uri, {}).values():
+                self.index.remove(snippet_id)
+            self.meta.pop(uri, None)
+            if self.base is not None and \
+                    (index := self.base.file_index.get(uri)) is not None:
+                self.kill(index)
+        self.symbols.remove(uri)
+
+    def kill(self, index: int):
+        """Method kill marks file in segment as dead.
+        """
+        if index in self.base_dead:
+            return
+        self.base_dead.add(index)
+        self.base_meta.pop(index, None)
+        for snippet_id in self.base.snippets(index):
+            self.base_snippets -= 1
+            self.base_length -= self.base.snippet_lengths[snippet_id]
+
+    def replace(self, uri: str, blocks: List[Block], meta: Meta = NO_META):
+        # File in segment is superseded by its version in delta.
+        if self.base is not None and \
+                (index := self.base.file_index.get(uri)) is not None:
+            self.kill(index)
+
+        # Blocks are identified by their hashes. Unchanged blocks are only
+        # moved while new ones are tokenized and added to index.
+        old = self.files.get(uri, {})
+        new = {}
+        for block_hash, line, num_lines, terms in blocks:
+            if block_hash in new:
+                continue  # Duplicated block adds nothing to retrieval.
+            if (snippet_id := old.pop(block_hash, None)) is not None:
+                snippet = self.index.snippets[snippet_id]
+                snippet.line, snippet.num_lines = line, num_lines
+            elif terms is not None:
+                snippet = Snippet(uri, line, num_lines)
+                snippet_id = self.index.add(snippet, terms)
+            else:
+                continue  # Block is gone while it was analyzed.
+            new[block_hash] = snippet_id
+        for snippet_id in old.values():
+            self.index.remove(snippet_id)
+        self.files[uri] = new
+        self.meta[uri] = meta
+        self.forget_lines(uri)
+
+    def search(self, text: str, exclude: Optional[str] = None,
+               k: Optional[int] = None) -> List[Snippet]:
+        k = k or self.num_results
+        with self.lock:
+            if self.base is None:
+                return self.index.search(tokenize(text), k, exclude)
+            return self.search_merged(tokenize(text), k, exclude)
+
+    def search_merged(self, terms: List[str], k: int,
+                      exclude: Optional[str]) -> List[Snippet]:
+        base, delta = self.base, self.index
+        num_snippets = self.base_snippets + len(delta)
+        if num_snippets == 0:
+            return []
+        avgdl = (self.base_length + delta.total_length) / num_snippets
+
+        # Document frequencies of segment include dead snippets. It is a
+        # reasonable approximation since the most of segment is alive.
+        weights = []
+        for term in set(terms):
+            index = base.find(term)
+            df = len(delta.postings.get(term, ()))
+            if index is not None:
+                df += (base.posting_offsets[index + 1] -
+                       base.posting_offsets[index])
+            if df:
+                idf = log(1 + (num_snippets - df + 0.5) / (df + 0.5))
+                weights.append((idf, term, index))
+
+        k1, b = delta.k1, delta.b
+        scores: Dict[int, float] = {}
+        lengths = base.snippet_lengths
+        for idf, term, index in nlargest(delta.max_terms, weights):
+            delta.accumulate(term, idf, avgdl, scores)
+            if index is None:
+                continue
+            for snippet_id, freq in zip(*base.postings(index)):
+                norm = k1 * (1 - b + b * lengths[snippet_id] / avgdl)
+                score = idf * freq * (k1 + 1) / (freq + norm)
+                scores[snippet_id] = scores.get(snippet_id, 0.0) + score
+
+        result = []
+        dead, files = self.base_dead, base.snippet_files
+        # Snippets of dead files are skipped one by one, so that any number
+        # of them does not push alive snippets out of results.
+        for score, snippet_id in ranked(scores):
+            if snippet_id >= base.num_snippets:
+                snippet = delta.snippets[snippet_id]
+            elif files[snippet_id] in dead:
+                continue
+            else:
+                snippet = Snippet(base.uri(files[snippet_id]),
+                                  base.snippet_lines[snippet_id],
+                                  base.snippet_num_lines[snippet_id])
+            if snippet.uri == exclude:
+                continue
+            result.append(Snippet(snippet.uri, snippet.line,
+                                  snippet.num_lines, score))
+            if len(result) == k:
+                break
+        return result
+
+    def fetch(self, snippet: Snippet, corpus=None) -> str:
+        """Method fetch returns text of a snippet. It prefers text of opened
+        document to the file content. Lines of files are cached, so that
+        completion does not read files from disk on every request.
+        """
+        if corpus is not None and snippet.uri in corpus.docs:
+            doc = corpus.get(snippet.uri)
+            return doc.slice_lines(snippet.line, snippet.num_lines)
+        if (lines := self.read_lines(snippet.uri)) is None:
+            return ''
+        return ''.join(lines[snippet.line:snippet.line + snippet.num_lines])
+
+    def read_lines(self, uri: str) -> Optional[List[str]]:
+        with self.lines_lock:
+            if (lines := self.lines.get(uri)) is not None:
+                self.lines.move_to_end(uri)
+                return lines
+            epoch = self.lines_epoch
+        if (path := uri_to_path(uri)) is None:
+            return None
+        try:
+            with open(path, errors='ignore') as fin:
+                lines = fin.read().splitlines(keepends=True)
+        except OSError:
+            return None
+        with self.lines_lock:
+            # File could be reindexed while it was read.
+            if epoch != self.lines_epoch:
+                return lines
+            self.lines[uri] = lines
+            while len(self.lines) > MAX_CACHED_FILES:
+                self.lines.popitem(last=False)
+        return lines
+
+    def forget_lines(self, uri: str):
+        with self.lines_lock:
+            self.lines.pop(uri, None)
+            self.lines_epoch += 1
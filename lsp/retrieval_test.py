@@ -0,0 +1,107 @@
+#   encoding: utf8
+#   filename: retrieval_test.py
+
+from . import retrieval
+from .corpus import Corpus
+from .retrieval import WorkspaceIndex
+
+CURRENT = 'file:///cur.py'
+
+OTHER = 'file:///other.py'
+
+
+def make_text(name: str, num_blocks: int, body: str) -> str:
+    # Every block is distinct (duplicated blocks are indexed once) and
+    # matches query below.
+    return ''.join(f'def {name}_{i}(widget):\n'
+                   f'    {body}\n'
+                   f'\n\n' for i in range(num_blocks))
+
+
+def test_search_exclude():
+    # Current document has much more matching blocks than number of results
+    # and they score higher than blocks of other document. All of them are
+    # excluded but results are still found.
+    index = WorkspaceIndex(num_results=3)
+    index.update(OTHER, make_text('other', 20, 'return widget.total'))
+    index.update(CURRENT, make_text('current', 100,
+                                    'return widget.total + total * total'))
+    snippets = index.search('widget.total + total', exclude=CURRENT)
+    assert len(snippets) == 3
+    assert all(snippet.uri == OTHER for snippet in snippets)
+
+
+def test_fetch(tmp_path):
+    path = tmp_path / 'module.py'
+    path.write_text(make_text('func', 4, 'return widget.total'))
+    index = WorkspaceIndex()
+    index.update_file(path.as_uri())
+    snippet, *_ = index.search('func_2 widget')
+    assert index.fetch(snippet).startswith('def func_2(widget):')
+
+    # Cached lines are dropped on reindexing.
+    path.write_text(make_text('proc', 4, 'return widget.total'))
+    index.update_file(path.as_uri())
+    snippet, *_ = index.search('proc_2 widget')
+    assert index.fetch(snippet).startswith('def proc_2(widget):')
+
+
+def test_update_version():
+    # Updates run in background and could finish out of order.
+    corpus = Corpus()
+    corpus.open(CURRENT, make_text('newer', 4, 'return total'))
+    index = WorkspaceIndex()
+    index.update(CURRENT, make_text('newer', 4, 'return total'), version=2)
+    index.update(CURRENT, make_text('older', 4, 'return total'), version=1)
+    snippets = index.search('older_1 total')
+    assert snippets
+    assert all('newer' in index.fetch(snippet, corpus)
+               for snippet in snippets)
+
+
+def test_fetch_document():
+    corpus = Corpus()
+    corpus.open(CURRENT, make_text('func', 4, 'return widget.total'))
+    index = WorkspaceIndex()
+    index.update(CURRENT, corpus.get(CURRENT).text)
+    snippet, *_ = index.search('func_3 widget')
+    assert index.fetch(snippet, corpus) == \
+        ''.join(corpus.get(CURRENT).text.splitlines(keepends=True)
+                [snippet.line:snippet.line + snippet.num_lines])
+
+
+def test_search_dead(tmp_path):
+    # Removed file of segment has much more matching blocks than number of
+    # results. Its snippets are dead and they are skipped.
+    # Filler blocks keep query terms rare since document frequencies of
+    # segment include dead snippets.
+    index = WorkspaceIndex(num_results=3, cache_path=tmp_path / 'index.bin')
+    index.update(OTHER, make_text('other', 20, 'return widget.total') +
+                 make_text('filler', 200, 'return value'))
+    index.update(CURRENT, make_text('current', 30,
+                                    'return widget.total + total * total'))
+    index.save()
+    index.remove(CURRENT)
+    snippets = index.search('widget.total + total')
+    assert len(snippets) == 3
+    assert all(snippet.uri == OTHER for snippet in snippets)
+
+
+def test_update_concurrent(monkeypatch):
+    # Another update of the same document replaces blocks while the first
+    # one is analyzed. Blocks which the first one skips as known are kept.
+    index = WorkspaceIndex()
+    index.update(CURRENT, make_text('func', 4, 'return widget.total'))
+    analyze = retrieval.analyze
+
+    def interleave(text, known=()):
+        monkeypatch.setattr(retrieval, 'analyze', analyze)
+        index.update(CURRENT, make_text('proc', 4, 'return widget.total'))
+        return analyze(text, known)
+
+    monkeypatch.setattr(retrieval, 'analyze', interleave)
+    index.update(CURRENT, make_text('func', 4, 'return widget.total'))
+    assert len(index.files[CURRENT]) == 4
+    assert len(index.index) == 4
+    snippet, *_ = index.search('func_2 widget')
+    assert snippet.line == 8
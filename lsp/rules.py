@@ -0,0 +1,365 @@
+#   encoding: utf8
+#   filename: rules.py
+"""Rule engine for grammar and style diagnostics. Rule packs are plain text
+files with a rule per line: a phrase, a replacement (optional), and a message
+(optional) separated with tabs. Lines which start with # are comments.
+
+    could of    could have      Did you mean "could have"?
+    in order to to              Wordy phrase.
+
+Phrases are compiled into a single Aho-Corasick automaton over lowercased
+UTF-8 bytes with dense transition table over byte classes and written to a
+file which is memory-mapped on load. Text is prefiltered with vectorized
+lookup of byte bigrams which start phrases so that the automaton runs only
+over short windows around candidates. All integers are little-endian.
+
+    header      magic, counters, and table of sections
+    sections    byte classes, transitions, outputs, bigrams, and rules
+"""
+
+import logging
+
+import numpy as np
+
+from collections import deque
+from dataclasses import dataclass
+from mmap import ACCESS_READ, mmap
+from os import replace
+from pathlib import Path
+from struct import Struct
+from time import perf_counter
+from typing import Dict, List, Tuple
+
+from .corpus import positions
+from .diagnostics import Finding
+
+__all__ = ('RuleEngine', 'RulesReport', 'compile_rules', 'read_rules')
+
+
+MAGIC = b'LSPLMAC1'
+
+HEADER = Struct('<8s4Q')
+
+SECTIONS = (
+    ('classes', np.uint8),
+    ('transitions', np.int32),
+    ('out_offsets', np.uint32),
+    ('out_rules', np.uint32),
+    ('bigrams', np.uint8),
+    ('lengths', np.uint32),
+    ('messages', np.uint8),
+    ('message_offsets', np.uint64),
+    ('replacements', np.uint8),
+    ('replacement_offsets', np.uint64),
+)
+
+SECTION = Struct('<2Q')
+
+# Rule is a triple of phrase, replacement, and message.
+Rule = Tuple[str, str, str]
+
+# Match is a triple of byte offset, byte length, and rule index.
+Match = Tuple[int, int, int]
+
+
+@dataclass
+class RulesReport:
+    """Class RulesReport summarises compiled rule pack.
+    """
+
+    num_rules: int
+
+    num_states: int
+
+    num_classes: int
+
+    num_bytes: int
+
+    elapsed: float
+
+    def __str__(self) -> str:
+        return '\n'.join([
+            f'rules:          {self.num_rules}',
+            f'states:         {self.num_states}',
+            f'byte classes:   {self.num_classes}',
+            f'size:           {self.num_bytes / 2**20:.1f} MiB',
+            f'elapsed:        {self.elapsed:.1f} s',
+        ])
+
+
+def read_rules(paths: List[Path]) -> List[Rule]:
+    rules = []
+    for path in paths:
+        with open(path, encoding='utf-8') as fin:
+            for line in fin:
+                if not line.strip() or line.startswith('#'):
+                    continue
+                parts = line.rstrip('\r\n').split('\t')
+                phrase = ' '.join(parts[0].lower().split())
+                replacement = parts[1].strip() if len(parts) > 1 else ''
+                message = parts[2].strip() if len(parts) > 2 else ''
+                if not message:
+                    if replacement:
+                        message = f'Did you mean "{replacement}"?'
+                    else:
+                        message = f'Avoid "{phrase}".'
+                if phrase:
+                    rules.append((phrase, replacement, message))
+    return rules
+
+
+def compile_rules(paths: List[Path], output: Path) -> RulesReport:
+    """Function compile_rules is an entry point of offline rule pack
+    compilation. It reads rule packs, builds automaton, and writes it.
+    """
+    started_at = perf_counter()
+    rules = read_rules(paths)
+    logging.info('read %d rules from %d rule packs', len(rules), len(paths))
+    output.parent.mkdir(parents=True, exist_ok=True)
+    num_states, num_classes = write_rules(output, rules)
+    return RulesReport(num_rules=len(rules),
+                       num_states=num_states,
+                       num_classes=num_classes,
+                       num_bytes=output.stat().st_size,
+                       elapsed=perf_counter() - started_at)
+
+
+def write_rules(path: Path, rules: List[Rule]) -> Tuple[int, int]:
+    phrases = [phrase.encode('utf-8') for phrase, _, _ in rules]
+
+    # Bytes which do not occur in phrases share class 0 so that transition
+    # table is narrow.
+    alphabet = sorted({byte for phrase in phrases for byte in phrase})
+    classes = np.zeros(256, np.uint8)
+    classes[alphabet] = np.arange(1, len(alphabet) + 1)
+    num_classes = len(alphabet) + 1
+
+    # Build trie of phrases.
+    children: List[Dict[int, int]] = [{}]
+    outputs: List[List[int]] = [[]]
+    for index, phrase in enumerate(phrases):
+        state = 0
+        for byte in phrase:
+            label = int(classes[byte])
+            if (child := children[state].get(label)) is None:
+                child = len(children)
+                children[state][label] = child
+                children.append({})
+                outputs.append([])
+            state = child
+        outputs[state].append(index)
+
+    # Failure links are resolved in breadth-first order into a dense table
+    # of transitions. Outputs of a state include outputs of its suffixes.
+    transitions = np.zeros((len(children), num_classes), np.int32)
+    failures = [0] * len(children)
+    queue = deque()
+    for label, child in children[0].items():
+        transitions[0, label] = child
+        queue.append(child)
+    while queue:
+        state = queue.popleft()
+        outputs[state].extend(outputs[failures[state]])
+        transitions[state] = transitions[failures[state]]
+        for label, child in children[state].items():
+            failures[child] = int(transitions[failures[state], label])
+            transitions[state, label] = child
+            queue.append(child)
+
+    out_offsets = np.zeros(len(children) + 1, np.uint32)
+    out_offsets[1:] = np.cumsum([len(output) for output in outputs])
+    out_rules = np.array([i for output in outputs for i in output], np.uint32)
+
+    # Bigrams which start phrases are used to prefilter text. Single byte
+    # phrases are not prefiltered.
+    bigrams = np.zeros(1 << 16, np.uint8)
+    for phrase in phrases:
+        if len(phrase) >= 2:
+            bigrams[phrase[0] << 8 | phrase[1]] = 1
+        else:
+            bigrams[phrase[0] << 8:(phrase[0] + 1) << 8] = 1
+
+    messages = [message.encode('utf-8') for _, _, message in rules]
+    replacements = [replacement.encode('utf-8') for _, replacement, _ in rules]
+    columns = {
+        'classes': classes,
+        'transitions': transitions,
+        'out_offsets': out_offsets,
+        'out_rules': out_rules,
+        'bigrams': bigrams,
+        'lengths': np.array([len(phrase) for phrase in phrases], np.uint32),
+        'messages': np.frombuffer(b''.join(messages), np.uint8),
+        'message_offsets': np.cumsum([0] + [len(x) for x in messages]),
+        'replacements': np.frombuffer(b''.join(replacements), np.uint8),
+        'replacement_offsets': np.cumsum([0] + [len(x)
+                                                for x in replacements]),
+    }
+
+    # Sections are aligned to 8 bytes so that they could be mapped in-place.
+    offset = HEADER.size + SECTION.size * len(SECTIONS)
+    table = []
+    for name, dtype in SECTIONS:
+        size = columns[name].astype(dtype).nbytes
+        table.append((offset, size))
+        offset += (size + 7) & ~7
+
+    max_length = max((len(phrase) for phrase in phrases), default=0)
+    tmp_path = path.with_suffix('.tmp')
+    with open(tmp_path, 'wb') as fout:
+        fout.write(HEADER.pack(MAGIC, len(rules), len(children), num_classes,
+                               max_length))
+        for section in table:
+            fout.write(SECTION.pack(*section))
+        for (name, dtype), (_, size) in zip(SECTIONS, table):
+            fout.write(columns[name].astype(dtype).tobytes())
+            fout.write(b'\0' * (((size + 7) & ~7) - size))
+    replace(tmp_path, path)
+    return len(children), num_classes
+
+
+def is_word_byte(byte: int) -> bool:
+    # Non-ASCII bytes are parts of (likely alphabetic) multibyte characters.
+    return byte >= 0x80 or chr(byte).isalnum() or byte == 0x5f
+
+
+WORD_BYTES = np.array([is_word_byte(byte) for byte in range(256)])
+
+
+class RuleEngine:
+    """Class RuleEngine finds phrases of memory-mapped rule pack in text and
+    reports them as diagnostics.
+    """
+
+    def __init__(self, path: Path):
+        self.path = path
+        with open(path, 'rb') as fin:
+            self.mmap = mmap(fin.fileno(), 0, access=ACCESS_READ)
+
+        magic, num_rules, num_states, num_classes, max_length = \
+            HEADER.unpack_from(self.mmap)
+        if magic != MAGIC:
+            raise ValueError(f'Unexpected rule pack format: {path}.')
+        self.num_rules = num_rules
+        self.num_states = num_states
+        self.num_classes = num_classes
+        self.max_length = max_length
+
+        for index, (name, dtype) in enumerate(SECTIONS):
+            offset, size = SECTION.unpack_from(self.mmap, HEADER.size +
+                                               index * SECTION.size)
+            count = size // np.dtype(dtype).itemsize
+            setattr(self, name, np.frombuffer(self.mmap, dtype, count,
+                                              offset))
+        self.transitions = self.transitions.reshape(num_states, num_classes)
+
+        # Automaton is run byte by byte so that tables are accessed through
+        # memory views which are much faster to index than arrays.
+        self.table = memoryview(self.transitions.ravel())
+        self.outputs = memoryview(self.out_offsets)
+
+    def __len__(self) -> int:
+        return self.num_rules
+
+    def __str__(self) -> str:
+        return (f'RuleEngine(norules={self.num_rules}, '
+                f'nostates={self.num_states}, '
+                f'noclasses={self.num_classes})')
+
+    def close(self):
+        # Arrays should be released before memory map is closed.
+        self.table.release()
+        self.outputs.release()
+        for name, _ in SECTIONS:
+            setattr(self, name, None)
+        self.mmap.close()
+
+    def message(self, rule: int) -> str:
+        begin = int(self.message_offsets[rule])
+        end = int(self.message_offsets[rule + 1])
+        return self.messages[begin:end].tobytes().decode('utf-8')
+
+    def replacement(self, rule: int) -> str:
+        begin = int(self.replacement_offsets[rule])
+        end = int(self.replacement_offsets[rule + 1])
+        return self.replacements[begin:end].tobytes().decode('utf-8')
+
+    def windows(self, data: np.ndarray) -> List[Tuple[int, int]]:
+        """Method windows returns disjoint byte ranges of text which could
+        contain matches. Every match starts with a bigram of some phrase and
+        it is not longer than the longest phrase.
+        """
+        # Trailing separator makes a bigram of the last byte, so that a
+        # single-byte phrase at the end of text is found as well.
+        padded = np.append(data, np.uint8(ord(' ')))
+        codes = padded[:-1].astype(np.uint16) << 8 | padded[1:]
+        mask = self.bigrams[codes].astype(bool)
+        # Matches also start at word boundaries.
+        mask[1:] &= ~WORD_BYTES[data[:-1]]
+        starts = np.flatnonzero(mask)
+        result: List[Tuple[int, int]] = []
+        for start in starts.tolist():
+            end = min(start + self.max_length, len(data))
+            if result and start <= result[-1][1]:
+                result[-1] = (result[-1][0], end)
+            else:
+                result.append((start, end))
+        return result
+
+    def scan(self, text: bytes) -> List[Match]:
+        """Method scan returns matches of phrases at word boundaries in text
+        as tuples of byte offset, byte length, and rule.
+        """
+        lowered = text.lower()
+        data = np.frombuffer(lowered, np.uint8)
+        labels = self.classes[data].tolist()
+        table, outputs = self.table, self.outputs
+        num_classes = self.num_classes
+        matches = []
+        for begin, end in self.windows(data):
+            state = 0
+            for pos in range(begin, end):
+                state = table[state * num_classes + labels[pos]]
+                if (lo := outputs[state]) == (hi := outputs[state + 1]):
+                    continue
+                for rule in self.out_rules[lo:hi].tolist():
+                    length = int(self.lengths[rule])
+                    start = pos + 1 - length
+                    if start > 0 and is_word_byte(lowered[start - 1]):
+                        continue
+                    if pos + 1 < len(lowered) and \
+                            is_word_byte(lowered[pos + 1]):
+                        continue
+                    matches.append((start, length, rule))
+        matches.sort()
+        return matches
+
+    def diagnose(self, text: str) -> List[Finding]:
+        """Method diagnose reports phrases of rules in text as diagnostics.
+        Matches which span several lines are skipped.
+        """
+        encoded = text.encode('utf-8')
+        matches = []
+        for offset, length, rule in self.scan(encoded):
+            phrase = encoded[offset:offset + length].decode('utf-8')
+            if '\n' in phrase:
+                continue
+            if not text.isascii():  # Byte offsets differ from char ones.
+                offset = len(encoded[:offset].decode('utf-8'))
+            matches.append((offset, len(phrase), rule))
+        locations = positions(text, (offset for offset, _, _ in matches))
+        return [(line, char, length, 3, self.message(rule))
+                for (_, length, rule), (line, char)
+                in zip(matches, locations)]
+
+    def suggest(self, phrase: str) -> List[str]:
+        """Method suggest returns replacements of rules which match the whole
+        phrase.
+        """
+        encoded = phrase.encode('utf-8')
+        replacements = []
+        for offset, length, rule in self.scan(encoded):
+            if offset == 0 and length == len(encoded) and \
+                    (replacement := self.replacement(rule)):
+                replacements.append(replacement)
+        return replacements
+
@@ -0,0 +1,23 @@
+#   encoding: utf8
+#   filename: rules_test.py
+
+from .rules import RuleEngine, compile_rules
+
+
+def compile_engine(tmp_path, pack: str) -> RuleEngine:
+    path = tmp_path / 'rules.txt'
+    path.write_text(pack)
+    compile_rules([path], tmp_path / 'rules.bin')
+    return RuleEngine(tmp_path / 'rules.bin')
+
+
+def test_scan(tmp_path):
+    engine = compile_engine(tmp_path, 'x\ny\ncould of\tcould have\n')
+    assert engine.scan(b'zz x') == [(3, 1, 0)]
+    assert engine.scan(b'x') == [(0, 1, 0)]
+    assert engine.scan(b'x y') == [(0, 1, 0), (2, 1, 1)]
+    assert engine.scan(b'xx zx x1') == []
+    assert engine.scan(b'') == []
+    assert engine.scan(b'We Could of') == [(3, 8, 2)]
+    assert engine.replacement(2) == 'could have'
+    engine.close()
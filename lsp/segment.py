@@ -0,0 +1,237 @@
+#   encoding: utf8
+#   filename: segment.py
+"""Read-only on-disk segment of workspace index. Segment is a single file
+which is memory-mapped on load so that warm start does not require
+deserialization of postings. All integers are little-endian.
+
+    header      magic, counters, and table of sections (offset, size)
+    sections    arrays of fixed-size integers and blobs of UTF-8 strings
+
+Files, snippets, symbols, and terms are stored as columns. Snippets and
+symbols of a file are contiguous. Terms are sorted so that term lookup is a
+binary search.
+"""
+
+from array import array
+from dataclasses import dataclass, field
+from mmap import ACCESS_READ, mmap
+from os import replace
+from pathlib import Path
+from struct import Struct
+from typing import Dict, Iterator, List, Optional, Sequence, Tuple
+
+__all__ = ('FileRecord', 'Segment', 'write_segment')
+
+
+MAGIC = b'LSPLMIX2'
+
+HEADER = Struct('<8s5Q')
+
+# Sections are listed in order of appearance with their type codes.
+SECTIONS = (
+    ('file_uris', 'B'),
+    ('file_uri_offsets', 'Q'),
+    ('file_mtimes', 'q'),
+    ('file_sizes', 'q'),
+    ('file_digests', 'Q'),
+    ('file_snippets', 'I'),
+    ('snippet_files', 'I'),
+    ('snippet_lines', 'I'),
+    ('snippet_num_lines', 'I'),
+    ('snippet_lengths', 'I'),
+    ('snippet_hashes', 'Q'),
+    ('terms', 'B'),
+    ('term_offsets', 'Q'),
+    ('posting_offsets', 'Q'),
+    ('posting_snippets', 'I'),
+    ('posting_freqs', 'I'),
+    ('file_symbols', 'I'),
+    ('symbol_names', 'B'),
+    ('symbol_name_offsets', 'Q'),
+    ('symbol_lines', 'I'),
+    ('symbol_chars', 'I'),
+    ('symbol_kinds', 'B'),
+)
+
+SECTION = Struct('<2Q')
+
+
+@dataclass
+class FileRecord:
+    """Class FileRecord describes an indexed file, its snippets as tuples
+    of block hash, first line, number of lines, and length in terms, and its
+    symbols as tuples of name, line, character, and kind.
+    """
+
+    uri: str
+
+    mtime: int
+
+    size: int
+
+    digest: int
+
+    snippets: List[Tuple[int, int, int, int]]
+
+    symbols: List[Tuple[str, int, int, int]] = field(default_factory=list)
+
+
+def write_segment(path: Path, files: Sequence[FileRecord],
+                  postings: Dict[str, List[Tuple[int, int]]]):
+    """Function write_segment serializes files and postings to a segment file
+    atomically. Snippet identifiers in postings are positions of snippets in
+    order of files.
+    """
+    columns = {name: array(code) for name, code in SECTIONS}
+    columns['file_uri_offsets'].append(0)
+    columns['file_snippets'].append(0)
+    columns['file_symbols'].append(0)
+    columns['symbol_name_offsets'].append(0)
+    uris = bytearray()
+    names = bytearray()
+    total_length = 0
+    for index, record in enumerate(files):
+        uris += record.uri.encode('utf-8')
+        columns['file_uri_offsets'].append(len(uris))
+        columns['file_mtimes'].append(record.mtime)
+        columns['file_sizes'].append(record.size)
+        columns['file_digests'].append(record.digest)
+        for block_hash, line, num_lines, length in record.snippets:
+            columns['snippet_files'].append(index)
+            columns['snippet_lines'].append(line)
+            columns['snippet_num_lines'].append(num_lines)
+            columns['snippet_lengths'].append(length)
+            columns['snippet_hashes'].append(block_hash)
+            total_length += length
+        columns['file_snippets'].append(len(columns['snippet_files']))
+        for name, line, char, kind in record.symbols:
+            names += name.encode('utf-8')
+            columns['symbol_name_offsets'].append(len(names))
+            columns['symbol_lines'].append(line)
+            columns['symbol_chars'].append(char)
+            columns['symbol_kinds'].append(kind)
+        columns['file_symbols'].append(len(columns['symbol_lines']))
+    columns['file_uris'].frombytes(uris)
+    columns['symbol_names'].frombytes(names)
+
+    terms = bytearray()
+    columns['term_offsets'].append(0)
+    columns['posting_offsets'].append(0)
+    for term in sorted(postings):
+        terms += term.encode('utf-8')
+        columns['term_offsets'].append(len(terms))
+        for snippet_id, freq in sorted(postings[term]):
+            columns['posting_snippets'].append(snippet_id)
+            columns['posting_freqs'].append(freq)
+        columns['posting_offsets'].append(len(columns['posting_snippets']))
+    columns['terms'].frombytes(terms)
+
+    # Sections are aligned to 8 bytes so that they could be cast in-place.
+    offset = HEADER.size + SECTION.size * len(SECTIONS)
+    table = []
+    for name, _ in SECTIONS:
+        size = len(columns[name]) * columns[name].itemsize
+        table.append((offset, size))
+        offset += (size + 7) & ~7
+
+    tmp_path = path.with_suffix('.tmp')
+    with open(tmp_path, 'wb') as fout:
+        fout.write(HEADER.pack(MAGIC, len(files),
+                               len(columns['snippet_files']),
+                               len(postings),
+                               len(columns['posting_snippets']),
+                               total_length))
+        for section in table:
+            fout.write(SECTION.pack(*section))
+        for (name, _), (_, size) in zip(SECTIONS, table):
+            columns[name].tofile(fout)
+            fout.write(b'\0' * (((size + 7) & ~7) - size))
+    replace(tmp_path, path)
+
+
+class Segment:
+    """Class Segment provides read-only access to memory-mapped segment file.
+    """
+
+    def __init__(self, path: Path):
+        self.path = path
+        with open(path, 'rb') as fin:
+            self.mmap = mmap(fin.fileno(), 0, access=ACCESS_READ)
+        self.view = memoryview(self.mmap)
+
+        magic, num_files, num_snippets, num_terms, num_postings, \
+            total_length = HEADER.unpack_from(self.mmap)
+        if magic != MAGIC:
+            raise ValueError(f'Unexpected segment format: {path}.')
+
+        self.num_files = num_files
+        self.num_snippets = num_snippets
+        self.num_terms = num_terms
+        self.num_postings = num_postings
+        self.total_length = total_length
+
+        for index, (name, code) in enumerate(SECTIONS):
+            offset, size = SECTION.unpack_from(self.mmap, HEADER.size +
+                                               index * SECTION.size)
+            setattr(self, name, self.view[offset:offset + size].cast(code))
+
+        self.file_index: Dict[str, int] = {}
+        for index in range(num_files):
+            self.file_index[self.uri(index)] = index
+
+    def __str__(self) -> str:
+        return (f'Segment(nofiles={self.num_files}, '
+                f'nosnippets={self.num_snippets}, noterms={self.num_terms})')
+
+    def close(self):
+        # Memory views should be released before memory map is closed.
+        for name, _ in SECTIONS:
+            getattr(self, name).release()
+        self.view.release()
+        self.mmap.close()
+
+    def uri(self, index: int) -> str:
+        begin = self.file_uri_offsets[index]
+        end = self.file_uri_offsets[index + 1]
+        return bytes(self.file_uris[begin:end]).decode('utf-8')
+
+    def term(self, index: int) -> bytes:
+        begin = self.term_offsets[index]
+        return bytes(self.terms[begin:self.term_offsets[index + 1]])
+
+    def iter_terms(self) -> Iterator[Tuple[str, int]]:
+        for index in range(self.num_terms):
+            yield self.term(index).decode('utf-8'), index
+
+    def find(self, term: str) -> Optional[int]:
+        """Method find returns index of a term with binary search.
+        """
+        key = term.encode('utf-8')
+        lo, hi = 0, self.num_terms
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self.term(mid) < key:
+                lo = mid + 1
+            else:
+                hi = mid
+        if lo < self.num_terms and self.term(lo) == key:
+            return lo
+        return None
+
+    def postings(self, index: int) -> Tuple[memoryview, memoryview]:
+        begin = self.posting_offsets[index]
+        end = self.posting_offsets[index + 1]
+        return (self.posting_snippets[begin:end],
+                self.posting_freqs[begin:end])
+
+    def snippets(self, file_index: int) -> range:
+        return range(self.file_snippets[file_index],
+                     self.file_snippets[file_index + 1])
+
+    def symbols(self, file_index: int) -> Iterator[Tuple[str, int, int, int]]:
+        offsets = self.symbol_name_offsets
+        for index in range(self.file_symbols[file_index],
+                           self.file_symbols[file_index + 1]):
+            name = bytes(self.symbol_names[offsets[index]:offsets[index + 1]])
+            yield (name.decode('utf-8'), self.symbol_lines[index],
+                   self.symbol_chars[index], self.symbol_kinds[index])
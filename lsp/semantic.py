@@ -0,0 +1,219 @@
+#   encoding: utf8
+#   filename: semantic.py
+"""Semantic completion source. Identifiers of workspace are embedded with
+language model and indexed with HNSW so that identifiers related to context
+around cursor are proposed alongside predictions of language model.
+"""
+
+import logging
+
+import numpy as np
+import torch as T
+
+from hashlib import blake2b
+from itertools import chain
+from pathlib import Path
+from re import compile as compile_regex
+from threading import Lock
+from time import perf_counter
+from typing import Dict, List, Optional, Sequence
+
+from .corpus import Document
+from .background import checkpoint
+from .crawler import lower_priority
+from .hnsw import HNSW, build_hnsw, write_hnsw
+
+__all__ = ('SemanticIndex', )
+
+
+WORD_REGEX = compile_regex(r'[^\W\d]\w+')
+
+PARTIAL_REGEX = compile_regex(r'\w*$')
+
+POOLINGS = ('embedding', 'encoder')
+
+
+class SemanticIndex:
+    """Class SemanticIndex embeds workspace identifiers and searches nearest
+    neighbours of context around cursor among them.
+
+    Embedding of an identifier is either mean of rows of input embedding table
+    which correspond to its subword tokens (cheap) or mean-pooled last hidden
+    states of encoder (expensive but contextual). Index is persisted and it
+    is reused on the next start unless workspace vocabulary changed
+    significantly.
+
+    :param tokenizer: HuggingFace tokenizer.
+    :param model: HuggingFace model.
+    :param pooling: Either embedding or encoder.
+    :param cache_path: Path to file to persist HNSW index.
+    :param max_terms: Maximal number of identifiers to index.
+    :param num_context: Number of identifiers before cursor to make a query.
+    """
+
+    def __init__(self, tokenizer, model, pooling: str = 'embedding',
+                 cache_path: Optional[Path] = None, num_results: int = 5,
+                 max_terms: int = 32768, num_context: int = 8,
+                 batch_size: int = 4096):
+        if pooling not in POOLINGS:
+            raise ValueError(f'Unknown pooling: {pooling}.')
+        self.tokenizer = tokenizer
+        self.model = model
+        self.pooling = pooling
+        self.cache_path = cache_path
+        self.num_results = num_results
+        self.max_terms = max_terms
+        self.num_context = num_context
+        self.batch_size = batch_size
+        self.table = model.get_input_embeddings().weight.detach().numpy()
+        self.index: Optional[HNSW] = None
+        self.nodes: Dict[str, int] = {}
+        self.lock = Lock()
+
+        # Index is bound to model and pooling.
+        name = getattr(model, 'name_or_path', '') + '\0' + pooling
+        digest = blake2b(name.encode('utf-8'), digest_size=8).digest()
+        self.digest = int.from_bytes(digest, 'little')
+
+    def __str__(self) -> str:
+        return (f'SemanticIndex(pooling={self.pooling}, '
+                f'index={self.index})')
+
+    def build(self, terms: Sequence[str], max_stale: float = 0.1):
+        """Method build loads persisted index if it has the same model and
+        covers all but max_stale share of terms. Otherwise, it embeds terms and
+        builds a new index.
+        """
+        lower_priority()
+        terms = list(terms)[:self.max_terms]
+        if self.load(terms, max_stale):
+            return
+        if not terms:
+            return
+
+        started_at = perf_counter()
+        vectors = self.embed(terms)
+        elapsed_embed = perf_counter() - started_at
+        graph = build_hnsw(vectors)
+        logging.info('build semantic index of %d terms in %.1f s (%.1f s to '
+                     'embed)', len(terms), perf_counter() - started_at,
+                     elapsed_embed)
+
+        if self.cache_path is None:
+            return
+        self.cache_path.parent.mkdir(parents=True, exist_ok=True)
+        write_hnsw(self.cache_path, vectors, graph, terms, self.digest)
+        self.load(terms, max_stale)
+
+    def load(self, terms: Sequence[str], max_stale: float) -> bool:
+        if self.cache_path is None or not self.cache_path.exists():
+            return False
+        try:
+            index = HNSW(self.cache_path)
+        except Exception:
+            logging.exception('failed to load semantic index from %s',
+                              self.cache_path)
+            return False
+
+        nodes = {index.label(node): node for node in range(len(index))}
+        num_stale = sum(1 for term in terms if term not in nodes)
+        if index.digest != self.digest or num_stale > max_stale * len(terms):
+            logging.info('semantic index in %s is stale: %d of %d terms are '
+                         'missing', self.cache_path, num_stale, len(terms))
+            index.close()
+            return False
+
+        with self.lock:
+            prev, self.index = self.index, index
+            self.nodes = nodes
+        if prev is not None:
+            prev.close()
+        logging.info('load semantic index from %s: %s', self.cache_path,
+                     index)
+        return True
+
+    def embed(self, terms: Sequence[str]) -> np.ndarray:
+        """Method embed returns unit embedding vectors of terms.
+        """
+        batches = []
+        for begin in range(0, len(terms), self.batch_size):
+            checkpoint()
+            batch = terms[begin:begin + self.batch_size]
+            if self.pooling == 'embedding':
+                batches.append(self.embed_table(batch))
+            else:
+                batches.append(self.embed_encoder(batch))
+        vectors = np.concatenate(batches).astype(np.float32)
+        norms = np.linalg.norm(vectors, axis=1, keepdims=True)
+        return vectors / np.maximum(norms, 1e-12)
+
+    def embed_table(self, terms: Sequence[str]) -> np.ndarray:
+        ids = self.tokenizer(list(terms), add_special_tokens=False)
+        ids = [row or [self.tokenizer.unk_token_id]
+               for row in ids['input_ids']]
+        lengths = np.array([len(row) for row in ids])
+        flat = np.fromiter(chain.from_iterable(ids), np.int64)
+        starts = np.cumsum(lengths) - lengths
+        sums = np.add.reduceat(self.table[flat], starts)
+        return sums / lengths[:, None]
+
+    def embed_encoder(self, terms: Sequence[str],
+                      batch_size: int = 256) -> np.ndarray:
+        batches = []
+        encoder = self.model.base_model
+        for begin in range(0, len(terms), batch_size):
+            inputs = self.tokenizer(list(terms[begin:begin + batch_size]),
+                                    padding=True, return_tensors='pt')
+            with T.no_grad():
+                hidden = encoder(**inputs).last_hidden_state
+            mask = inputs['attention_mask'].unsqueeze(-1).to(hidden.dtype)
+            pooled = (hidden * mask).sum(1) / mask.sum(1)
+            batches.append(pooled.numpy())
+        return np.concatenate(batches)
+
+    def embed_context(self, index: HNSW,
+                      context: Sequence[str]) -> Optional[np.ndarray]:
+        """Method embed_context returns unit query vector of identifiers.
+        Vectors of indexed identifiers are taken from index. The others are
+        embedded with embedding table if pooling is embedding and skipped
+        otherwise since encoder is too slow for completion.
+        """
+        known = [self.nodes[word] for word in context if word in self.nodes]
+        vectors = [index.vectors[known]]
+        if self.pooling == 'embedding':
+            unknown = [word for word in context if word not in self.nodes]
+            if unknown:
+                vectors.append(self.embed(unknown))
+        if not (query := np.concatenate(vectors)).size:
+            return None
+        query = query.mean(axis=0)
+        return query / max(np.linalg.norm(query), 1e-12)
+
+    def suggest(self, doc: Document, line: int, char: int) -> List[str]:
+        """Method suggest returns identifiers which are the nearest to the
+        identifiers preceding cursor.
+        """
+        if (index := self.index) is None:
+            return []
+        prefix, _ = doc.window(line, char, 256)
+        # Partially typed identifier is not a part of context.
+        partial = PARTIAL_REGEX.search(prefix)[0]
+        words = WORD_REGEX.findall(prefix[:len(prefix) - len(partial)])
+        if not (context := words[-self.num_context:]):
+            return []
+        partial = partial.lower()
+
+        with self.lock:
+            if self.index is not index:
+                return []
+            if (query := self.embed_context(index, context)) is None:
+                return []
+            neighbours = index.search(query, self.num_results +
+                                      len(context))
+            labels = [index.label(node) for _, node in neighbours]
+
+        # Identifiers which match partially typed one go first.
+        seen = set(context)
+        labels = [label for label in labels if label not in seen]
+        labels.sort(key=lambda x: not x.lower().startswith(partial))
+        return labels[:self.num_results]
@@ -0,0 +1,426 @@
+#   encoding: utf8
+#   filename: spelling.py
+"""Spelling checker based on symmetric delete algorithm (SymSpell). Dictionary
+and index of deletes are built offline and memory-mapped on load.
+
+Dictionary is a perfect hash table: words are grouped into buckets by hash
+and every bucket has a displacement which places its words to distinct slots
+so that lookup takes exactly one probe. Every dictionary word produces all its
+deletes (strings with at most max_distance characters removed from its
+prefix). Hashes of deletes are sorted so that suggestions for a misspelled
+word are found by binary search of its own deletes. All integers are
+little-endian.
+
+    header      magic, counters, and table of sections
+    sections    perfect hash table of words, and sorted deletes
+"""
+
+import logging
+import sys
+
+import numpy as np
+
+from collections import Counter
+from dataclasses import dataclass
+from hashlib import blake2b
+from itertools import combinations
+from mmap import ACCESS_READ, mmap
+from os import replace
+from pathlib import Path
+from re import compile as compile_regex
+from struct import Struct
+from time import perf_counter
+from typing import Callable, Dict, List, Optional, Set, Tuple
+
+from .corpus import positions
+from .diagnostics import Finding
+from .prune import read_corpus
+
+__all__ = ('DictionaryReport', 'SpellChecker', 'build_dictionary',
+           'extract_words')
+
+
+MAGIC = b'LSPLMSP1'
+
+HEADER = Struct('<8s5Q')
+
+SECTIONS = (
+    ('displacements', np.uint32),
+    ('words', np.uint8),
+    ('word_offsets', np.uint64),
+    ('freqs', np.uint32),
+    ('delete_hashes', np.uint64),
+    ('delete_words', np.uint32),
+)
+
+SECTION = Struct('<2Q')
+
+# Average number of words in a bucket of perfect hash table.
+BUCKET_SIZE = 4
+
+MAX_DISPLACEMENT = 1 << 24
+
+# Words are sequences of letters with optional apostrophes (e.g. don't).
+WORD_REGEX = compile_regex(r"[^\W\d_]+(?:'[^\W\d_]+)*")
+
+# Bytes which separate words are all ASCII bytes but letters and apostrophe.
+SEPARATORS = bytes(ch if chr(ch).isalpha() or ch == ord("'") or ch >= 0x80
+                   else ord(' ') for ch in range(256))
+
+# Spelling diagnostic is an occurrence of a word as offset and length.
+Misspelling = Tuple[int, int]
+
+
+@dataclass
+class DictionaryReport:
+    """Class DictionaryReport summarises built dictionary.
+    """
+
+    num_words: int
+
+    num_deletes: int
+
+    num_bytes: int
+
+    elapsed: float
+
+    def __str__(self) -> str:
+        return '\n'.join([
+            f'words:          {self.num_words}',
+            f'deletes:        {self.num_deletes}',
+            f'size:           {self.num_bytes / 2**20:.1f} MiB',
+            f'elapsed:        {self.elapsed:.1f} s',
+        ])
+
+
+def fingerprint(value: bytes) -> int:
+    return int.from_bytes(blake2b(value, digest_size=8).digest(), 'little')
+
+
+def probe(key: int, displacement: int, num_slots: int) -> int:
+    # Step is odd and number of slots is a power of two so that displacements
+    # enumerate all slots.
+    step = (key >> 32) | 1
+    return (key + displacement * step) & (num_slots - 1)
+
+
+def deletes(word: str, max_distance: int, prefix_length: int) -> Set[str]:
+    """Function deletes returns all strings which are obtained from prefix of
+    a word by deletion of at most max_distance characters.
+    """
+    prefix = word[:prefix_length]
+    result = {prefix}
+    for distance in range(1, min(max_distance, len(prefix) - 1) + 1):
+        for drop in combinations(range(len(prefix)), distance):
+            result.add(''.join(ch for i, ch in enumerate(prefix)
+                               if i not in drop))
+    return result
+
+
+def distance(lhs: str, rhs: str, max_distance: int) -> int:
+    """Function distance returns Damerau-Levenshtein distance (optimal string
+    alignment) of two strings or max_distance + 1 if it is larger.
+    """
+    if abs(len(lhs) - len(rhs)) > max_distance:
+        return max_distance + 1
+    prev2: List[int] = []
+    prev = list(range(len(rhs) + 1))
+    for i, a in enumerate(lhs, 1):
+        curr = [i] + [0] * len(rhs)
+        for j, b in enumerate(rhs, 1):
+            curr[j] = min(prev[j] + 1, curr[j - 1] + 1,
+                          prev[j - 1] + (a != b))
+            if i > 1 and j > 1 and a == rhs[j - 2] and lhs[i - 2] == b:
+                curr[j] = min(curr[j], prev2[j - 2] + 1)
+        if min(curr) > max_distance:
+            return max_distance + 1
+        prev2, prev = prev, curr
+    return min(prev[-1], max_distance + 1)
+
+
+def extract_words(text: str, min_length: int = 3) -> Set[str]:
+    """Function extract_words returns distinct words of text which are
+    subject of spell checking. Acronyms and words in camel case are skipped
+    since they are likely identifiers.
+    """
+    # Text is split in bytes since translation and splitting of bytes are an
+    # order of magnitude faster than regular expression. Non-ASCII tokens are
+    # split with regular expression afterwards.
+    tokens = text.encode('utf-8').translate(SEPARATORS).split()
+    words = set()
+    for token in set(tokens):
+        if token.isascii():
+            candidates = [token.decode('ascii').strip("'")]
+        else:
+            candidates = WORD_REGEX.findall(token.decode('utf-8', 'ignore'))
+        for word in candidates:
+            if len(word) < min_length or word.isupper():
+                continue
+            if not word[1:].islower():
+                continue
+            words.add(word)
+    return words
+
+
+def is_boundary(text: str, pos: int) -> bool:
+    return not (0 <= pos < len(text) and (text[pos].isalnum() or
+                                          text[pos] in "_'"))
+
+
+def build_dictionary(corpus: List[Path], output: Path, max_distance: int = 2,
+                     prefix_length: int = 7, min_freq: int = 1,
+                     max_words: Optional[int] = None,
+                     suffixes: Optional[Set[str]] = None) -> DictionaryReport:
+    """Function build_dictionary is an entry point of offline dictionary
+    build. Corpus is either frequency lists (a word and its count per line)
+    or plain text files where words are counted.
+    """
+    started_at = perf_counter()
+    counter: Counter = Counter()
+    for chunk in read_corpus(corpus, suffixes):
+        for line in chunk.splitlines():
+            parts = line.split()
+            if len(parts) == 2 and parts[1].isdigit():
+                counter[parts[0].lower()] += int(parts[1])
+            else:
+                counter.update(word.lower()
+                               for word in WORD_REGEX.findall(line))
+    freqs = {word: freq for word, freq in counter.most_common(max_words)
+             if freq >= min_freq and WORD_REGEX.fullmatch(word)}
+    logging.info('collected %d words of %d distinct ones', len(freqs),
+                 len(counter))
+
+    output.parent.mkdir(parents=True, exist_ok=True)
+    num_deletes = write_dictionary(output, freqs, max_distance,
+                                   prefix_length)
+    return DictionaryReport(num_words=len(freqs),
+                            num_deletes=num_deletes,
+                            num_bytes=output.stat().st_size,
+                            elapsed=perf_counter() - started_at)
+
+
+def write_dictionary(path: Path, freqs: Dict[str, int], max_distance: int,
+                     prefix_length: int) -> int:
+    words = sorted(freqs)
+    encoded = [word.encode('utf-8') for word in words]
+    keys = [fingerprint(word) for word in encoded]
+
+    # Buckets are placed in order of decreasing size since large buckets are
+    # the hardest to place.
+    num_slots = 1 << max(1, (len(words) - 1).bit_length())
+    num_buckets = max(1, len(words) // BUCKET_SIZE)
+    buckets: List[List[int]] = [[] for _ in range(num_buckets)]
+    for index, key in enumerate(keys):
+        buckets[key % num_buckets].append(index)
+    displacements = np.zeros(num_buckets, np.uint32)
+    slots = [-1] * num_slots
+    for bucket in sorted(range(num_buckets), key=lambda x: -len(buckets[x])):
+        if not (members := buckets[bucket]):
+            break
+        for displacement in range(MAX_DISPLACEMENT):
+            placed = {probe(keys[i], displacement, num_slots)
+                      for i in members}
+            if len(placed) == len(members) and \
+                    all(slots[slot] < 0 for slot in placed):
+                break
+        else:
+            raise RuntimeError('Failed to build perfect hash table.')
+        displacements[bucket] = displacement
+        for i in members:
+            slots[probe(keys[i], displacement, num_slots)] = i
+
+    # Words are laid out in order of slots. Empty slots have empty words.
+    order = slots
+    lengths = [len(encoded[i]) if i >= 0 else 0 for i in order]
+    word_offsets = np.zeros(num_slots + 1, np.uint64)
+    word_offsets[1:] = np.cumsum(lengths)
+    blob = b''.join(encoded[i] for i in order if i >= 0)
+    slot_freqs = np.array([min(freqs[words[i]], 0xffffffff) if i >= 0 else 0
+                           for i in order], np.uint32)
+
+    logging.info('generate deletes of %d words', len(words))
+    pairs = []
+    for slot, i in enumerate(order):
+        if i >= 0:
+            pairs.extend((fingerprint(delete.encode('utf-8')), slot)
+                         for delete in deletes(words[i], max_distance,
+                                               prefix_length))
+    pairs.sort()
+
+    columns = {
+        'displacements': displacements,
+        'words': np.frombuffer(blob, np.uint8),
+        'word_offsets': word_offsets,
+        'freqs': slot_freqs,
+        'delete_hashes': np.array([key for key, _ in pairs], np.uint64),
+        'delete_words': np.array([slot for _, slot in pairs], np.uint32),
+    }
+
+    # Sections are aligned to 8 bytes so that they could be mapped in-place.
+    offset = HEADER.size + SECTION.size * len(SECTIONS)
+    table = []
+    for name, dtype in SECTIONS:
+        size = columns[name].astype(dtype).nbytes
+        table.append((offset, size))
+        offset += (size + 7) & ~7
+
+    tmp_path = path.with_suffix('.tmp')
+    with open(tmp_path, 'wb') as fout:
+        fout.write(HEADER.pack(MAGIC, len(words), num_slots, num_buckets,
+                               max_distance, prefix_length))
+        for section in table:
+            fout.write(SECTION.pack(*section))
+        for (name, dtype), (_, size) in zip(SECTIONS, table):
+            fout.write(columns[name].astype(dtype).tobytes())
+            fout.write(b'\0' * (((size + 7) & ~7) - size))
+    replace(tmp_path, path)
+    return len(pairs)
+
+
+class SpellChecker:
+    """Class SpellChecker finds unknown words in text with memory-mapped
+    dictionary and suggests corrections for them on demand.
+
+    :param known: Predicate for words which are known besides dictionary
+                  (e.g. workspace identifiers).
+    """
+
+    def __init__(self, path: Path,
+                 known: Optional[Callable[[str], bool]] = None):
+        self.path = path
+        self.known = known
+        with open(path, 'rb') as fin:
+            self.mmap = mmap(fin.fileno(), 0, access=ACCESS_READ)
+
+        magic, num_words, num_slots, num_buckets, max_distance, \
+            prefix_length = HEADER.unpack_from(self.mmap)
+        if magic != MAGIC:
+            raise ValueError(f'Unexpected dictionary format: {path}.')
+        self.num_words = num_words
+        self.num_slots = num_slots
+        self.num_buckets = num_buckets
+        self.max_distance = max_distance
+        self.prefix_length = prefix_length
+
+        for index, (name, dtype) in enumerate(SECTIONS):
+            offset, size = SECTION.unpack_from(self.mmap, HEADER.size +
+                                               index * SECTION.size)
+            count = size // np.dtype(dtype).itemsize
+            setattr(self, name, np.frombuffer(self.mmap, dtype, count,
+                                              offset))
+
+        # Verdicts on words are cached since vocabulary of a document is
+        # mostly stable between edits.
+        self.cache: Dict[str, bool] = {}
+
+    def __len__(self) -> int:
+        return self.num_words
+
+    def __str__(self) -> str:
+        return (f'SpellChecker(nowords={self.num_words}, '
+                f'nodeletes={len(self.delete_hashes)}, '
+                f'max_distance={self.max_distance})')
+
+    def close(self):
+        # Arrays should be released before memory map is closed.
+        for name, _ in SECTIONS:
+            setattr(self, name, None)
+        self.mmap.close()
+
+    def word(self, slot: int) -> str:
+        begin = int(self.word_offsets[slot])
+        end = int(self.word_offsets[slot + 1])
+        return self.words[begin:end].tobytes().decode('utf-8')
+
+    def lookup(self, word: str) -> Optional[int]:
+        """Method lookup returns slot of a word in dictionary or None.
+        """
+        encoded = word.encode('utf-8')
+        key = fingerprint(encoded)
+        displacement = int(self.displacements[key % self.num_buckets])
+        slot = probe(key, displacement, self.num_slots)
+        begin = int(self.word_offsets[slot])
+        end = int(self.word_offsets[slot + 1])
+        if self.words[begin:end].tobytes() == encoded:
+            return slot
+        return None
+
+    def is_correct(self, word: str) -> bool:
+        if (verdict := self.cache.get(word)) is not None:
+            return verdict
+        lower = word.lower()
+        verdict = self.lookup(lower) is not None or \
+            (self.known is not None and self.known(word))
+        if len(self.cache) >= 1 << 16:
+            self.cache.clear()
+        self.cache[word] = verdict
+        return verdict
+
+    def evict(self, nbytes: int) -> int:
+        """Method evict drops cached verdicts and returns number of released
+        bytes (verdicts are cheap to recompute, so cache is dropped at once).
+        """
+        released = sys.getsizeof(self.cache) + \
+            sum(sys.getsizeof(word) for word in list(self.cache))
+        self.cache = {}
+        return released
+
+    def check(self, text: str) -> List[Misspelling]:
+        """Method check returns offsets and lengths of unknown words in text.
+        Distinct words are looked up first and only unknown ones are located
+        in text.
+        """
+        unknown = [word for word in extract_words(text)
+                   if not self.is_correct(word)]
+        result = []
+        for word in unknown:
+            pos = 0
+            while (pos := text.find(word, pos)) >= 0:
+                end = pos + len(word)
+                if is_boundary(text, pos - 1) and is_boundary(text, end):
+                    result.append((pos, len(word)))
+                pos = end
+        result.sort()
+        return result
+
+    def diagnose(self, text: str) -> List[Finding]:
+        """Method diagnose reports unknown words of text as diagnostics.
+        """
+        misspellings = self.check(text)
+        locations = positions(text, (offset for offset, _ in misspellings))
+        return [(line, char, length, 3,
+                 f'Unknown word: {text[offset:offset + length]}.')
+                for (offset, length), (line, char)
+                in zip(misspellings, locations)]
+
+    def suggest(self, word: str, k: int = 5) -> List[str]:
+        """Method suggest returns at most k dictionary words ordered by edit
+        distance to a word and then by frequency. Case of the first letter is
+        preserved.
+        """
+        lower = word.lower()
+        queries = np.array([fingerprint(delete.encode('utf-8'))
+                            for delete in deletes(lower, self.max_distance,
+                                                  self.prefix_length)],
+                           np.uint64)
+        begins = np.searchsorted(self.delete_hashes, queries, 'left')
+        ends = np.searchsorted(self.delete_hashes, queries, 'right')
+        slots = set()
+        for begin, end in zip(begins.tolist(), ends.tolist()):
+            slots.update(self.delete_words[begin:end].tolist())
+
+        scored = []
+        for slot in slots:
+            candidate = self.word(slot)
+            if (dist := distance(lower, candidate, self.max_distance)) <= \
+                    self.max_distance and candidate != lower:
+                scored.append((dist, -int(self.freqs[slot]), candidate))
+        scored.sort()
+
+        result = []
+        for _, _, candidate in scored[:k]:
+            if word[:1].isupper():
+                candidate = candidate[:1].upper() + candidate[1:]
+            result.append(candidate)
+        return result
+
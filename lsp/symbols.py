@@ -0,0 +1,334 @@
+#   encoding: utf8
+#   filename: symbols.py
+"""Symbol index for workspace/symbol requests. Identifiers and words of
+workspace files are indexed by their trigrams so that substring and fuzzy
+(typo-tolerant) queries are answered without scanning of vocabulary.
+
+Every term has an integer identifier. Identifiers are assigned in increasing
+order so that posting list of a trigram is sorted by construction and it is
+stored as a byte string of delta-encoded varints. Posting lists are decoded
+with numpy in a vectorized way.
+"""
+
+import numpy as np
+
+from array import array
+from math import ceil
+from re import compile as compile_regex
+from threading import Lock
+from typing import Dict, Iterable, Iterator, List, Set, Tuple
+
+__all__ = ('Symbol', 'SymbolIndex', 'extract_symbols')
+
+
+WORD_REGEX = compile_regex(r'[^\W\d]\w+')
+
+DEF_REGEX = compile_regex(r'\b(class|def|enum|fn|func|function|interface|'
+                          r'module|namespace|struct|trait|type)\s+'
+                          r'([^\W\d]\w*)')
+
+# Mapping from keywords to LSP symbol kinds. Kind 0 means that term is just
+# a word (not a definition).
+KINDS = {
+    'class': 5,
+    'def': 12,
+    'enum': 10,
+    'fn': 12,
+    'func': 12,
+    'function': 12,
+    'interface': 11,
+    'module': 2,
+    'namespace': 3,
+    'struct': 23,
+    'trait': 11,
+    'type': 5,
+}
+
+KIND_VARIABLE = 13
+
+# Symbol is a tuple of name, line, character, and kind.
+Symbol = Tuple[str, int, int, int]
+
+# Start of term marker which makes prefix trigrams distinguishable.
+PAD = '\x02\x02'
+
+
+def extract_symbols(text: str) -> List[Symbol]:
+    """Function extract_symbols returns distinct identifiers of text with
+    location of their first occurrence. Definition sites take precedence over
+    other occurrences.
+    """
+    symbols: Dict[str, Symbol] = {}
+    for lineno, line in enumerate(text.splitlines()):
+        for match in DEF_REGEX.finditer(line):
+            name = match[2]
+            if name not in symbols or not symbols[name][3]:
+                symbols[name] = (name, lineno, match.start(2),
+                                 KINDS[match[1]])
+        for match in WORD_REGEX.finditer(line):
+            if (name := match[0]) not in symbols:
+                symbols[name] = (name, lineno, match.start(), 0)
+    return list(symbols.values())
+
+
+def trigrams(term: str) -> Set[str]:
+    text = PAD + term.lower()
+    return {text[i:i + 3] for i in range(len(text) - 2)}
+
+
+def encode(postings: bytearray, delta: int):
+    while delta >= 0x80:
+        postings.append(delta & 0x7f | 0x80)
+        delta >>= 7
+    postings.append(delta)
+
+
+def decode(postings: bytes) -> np.ndarray:
+    """Function decode decodes delta-encoded varints to term identifiers.
+    """
+    data = np.frombuffer(postings, np.uint8)
+    if not data.size:
+        return np.empty(0, np.int64)
+    ends = np.flatnonzero(data < 0x80)
+    starts = np.empty_like(ends)
+    starts[0] = 0
+    starts[1:] = ends[:-1] + 1
+    shifts = 7 * (np.arange(data.size) - np.repeat(starts, ends - starts + 1))
+    values = (data & 0x7f).astype(np.int64) << shifts
+    return np.cumsum(np.add.reduceat(values, starts))
+
+
+def search_quads(quads: array, term_id: int) -> int:
+    """Function search_quads returns index of the first quad (term, line,
+    character, kind) of a term in quads sorted by term. It runs binary search
+    in-place since slice of array is a copy.
+    """
+    lo, hi = 0, len(quads) // 4
+    while lo < hi:
+        mid = (lo + hi) // 2
+        if quads[4 * mid] < term_id:
+            lo = mid + 1
+        else:
+            hi = mid
+    return lo
+
+
+class SymbolIndex:
+    """Class SymbolIndex maps trigrams of terms to sorted posting lists of
+    term identifiers and terms to files where they occur. The index is
+    updated incrementally on per-file basis. Terms which no longer occur are
+    kept until there are too many of them and then index is compacted.
+
+    :param max_candidates: Number of candidates which are scored exactly.
+    """
+
+    def __init__(self, max_candidates: int = 256):
+        self.max_candidates = max_candidates
+        self.lock = Lock()
+        self.reset()
+
+    def __len__(self) -> int:
+        return len(self.terms) - self.num_dead
+
+    def __contains__(self, name: str) -> bool:
+        term_id = self.term_ids.get(name)
+        return term_id is not None and self.refs[term_id] > 0
+
+    def __str__(self) -> str:
+        return (f'SymbolIndex(nofiles={len(self.files)}, noterms={len(self)}, '
+                f'notrigrams={len(self.postings)})')
+
+    def reset(self):
+        self.terms: List[str] = []
+        self.term_ids: Dict[str, int] = {}
+        self.lengths = array('I')
+        # Number of files which reference a term.
+        self.refs = array('I')
+        self.num_dead = 0
+        self.term_files: List[array] = []
+        self.postings: Dict[str, bytearray] = {}
+        self.last_ids: Dict[str, int] = {}
+        # File identifiers and flat arrays of (term, line, char, kind).
+        self.files: Dict[str, Tuple[int, array]] = {}
+        self.uris: Dict[int, str] = {}
+        self.next_file_id = 0
+
+    def get(self, uri: str) -> List[Symbol]:
+        with self.lock:
+            if (entry := self.files.get(uri)) is None:
+                return []
+            _, quads = entry
+            return [(self.terms[quads[i]], quads[i + 1], quads[i + 2],
+                     quads[i + 3]) for i in range(0, len(quads), 4)]
+
+    def vocabulary(self, max_terms: int, min_length: int = 3) -> List[str]:
+        """Method vocabulary returns at most max_terms terms which occur in
+        the largest number of files.
+        """
+        with self.lock:
+            terms = [(refs, term) for term, refs in zip(self.terms, self.refs)
+                     if refs and len(term) >= min_length]
+        terms.sort(key=lambda x: x[0], reverse=True)
+        return [term for _, term in terms[:max_terms]]
+
+    def replace(self, uri: str, symbols: Iterable[Symbol]):
+        with self.lock:
+            self.drop(uri)
+            self.insert(uri, symbols)
+            self.maybe_compact()
+
+    def remove(self, uri: str):
+        with self.lock:
+            self.drop(uri)
+            self.maybe_compact()
+
+    def insert(self, uri: str, symbols: Iterable[Symbol]):
+        file_id = self.next_file_id
+        self.next_file_id += 1
+        # Symbols of a file are sorted by term identifier so that location of
+        # a term is found with binary search.
+        quads = array('I')
+        for term_id, line, char, kind in sorted(
+                (self.intern(name), line, char, kind)
+                for name, line, char, kind in symbols):
+            self.refs[term_id] += 1
+            # Files where a term is defined precede the other ones.
+            if kind:
+                self.term_files[term_id].insert(0, file_id)
+            else:
+                self.term_files[term_id].append(file_id)
+            quads.extend((term_id, line, char, kind))
+        self.files[uri] = (file_id, quads)
+        self.uris[file_id] = uri
+
+    def drop(self, uri: str):
+        if (entry := self.files.pop(uri, None)) is None:
+            return
+        file_id, quads = entry
+        del self.uris[file_id]
+        for term_id in quads[::4]:
+            self.term_files[term_id].remove(file_id)
+            self.refs[term_id] -= 1
+            if not self.refs[term_id]:
+                self.num_dead += 1
+
+    def intern(self, name: str) -> int:
+        if (term_id := self.term_ids.get(name)) is not None:
+            if not self.refs[term_id]:
+                self.num_dead -= 1
+            return term_id
+        term_id = len(self.terms)
+        self.terms.append(name)
+        self.term_ids[name] = term_id
+        self.lengths.append(len(name))
+        self.refs.append(0)
+        self.term_files.append(array('I'))
+        for gram in trigrams(name):
+            if (postings := self.postings.get(gram)) is None:
+                self.postings[gram] = postings = bytearray()
+            encode(postings, term_id - self.last_ids.get(gram, 0))
+            self.last_ids[gram] = term_id
+        return term_id
+
+    def maybe_compact(self):
+        # Dead terms are dropped once they make up a half of vocabulary.
+        if self.num_dead < 1024 or 2 * self.num_dead < len(self.terms):
+            return
+        files = [(uri, [(self.terms[quads[i]], *quads[i + 1:i + 4])
+                        for i in range(0, len(quads), 4)])
+                 for uri, (_, quads) in self.files.items()]
+        self.reset()
+        for uri, symbols in files:
+            self.insert(uri, symbols)
+
+    def search(self, query: str, k: int = 64
+               ) -> List[Tuple[str, float, str, int, int, int]]:
+        """Method search returns at most k symbols ranked by similarity of
+        their names to query as tuples of name, score, uri, line, character,
+        and kind. Exact matches go first, then prefix matches, substring
+        matches, and finally fuzzy matches which share enough trigrams.
+        """
+        if not (query := query.strip().lower()):
+            return []
+        if len(query) < 3:
+            grams = {(PAD + query)[-3:]}
+        else:
+            grams = {query[i:i + 3] for i in range(len(query) - 2)}
+
+        with self.lock:
+            candidates, counts = self.candidates(grams)
+            scored = []
+            for term_id, count in zip(candidates.tolist(), counts.tolist()):
+                term = self.terms[term_id]
+                score = similarity(query, term.lower(), count / len(grams))
+                scored.append((score, term_id))
+            scored.sort(reverse=True)
+
+            result = []
+            for score, term_id in scored:
+                for uri, line, char, kind in self.locate(term_id):
+                    result.append((self.terms[term_id], score, uri, line,
+                                   char, kind))
+                    if len(result) == k:
+                        return result
+            return result
+
+    def find(self, name: str) -> List[Tuple[str, int, int, int]]:
+        """Method find returns locations of a term with exact name as tuples
+        of uri, line, character, and kind.
+        """
+        with self.lock:
+            if (term_id := self.term_ids.get(name)) is None or \
+                    not self.refs[term_id]:
+                return []
+            return list(self.locate(term_id))
+
+    def locate(self, term_id: int) -> Iterator[Tuple[str, int, int, int]]:
+        # A term is reported at its definition sites or at its first
+        # occurrence if it is not defined anywhere.
+        for index, file_id in enumerate(self.term_files[term_id]):
+            uri = self.uris[file_id]
+            _, quads = self.files[uri]
+            i = 4 * search_quads(quads, term_id)
+            kind = quads[i + 3]
+            if index and not kind:
+                break
+            yield uri, quads[i + 1], quads[i + 2], kind
+            if not kind:
+                break
+
+    def candidates(self, grams: Set[str]) -> Tuple[np.ndarray, np.ndarray]:
+        lists = [decode(self.postings[gram]) for gram in grams
+                 if gram in self.postings]
+        if not lists:
+            return np.empty(0, np.int64), np.empty(0, np.int64)
+        counts = np.bincount(np.concatenate(lists), minlength=len(self.terms))
+
+        # Fuzzy match requires at least a half of query trigrams.
+        alive = np.frombuffer(self.refs, np.uint32)[:len(counts)] > 0
+        threshold = max(1, ceil(len(grams) / 2))
+        candidates = np.flatnonzero((counts >= threshold) & alive)
+        counts = counts[candidates]
+
+        # Preselect candidates with a cheap score: the more trigrams shared
+        # and the shorter term is the better.
+        if len(candidates) > self.max_candidates:
+            lengths = np.frombuffer(self.lengths, np.uint32)[candidates]
+            cheap = counts.astype(np.int64) * 4096 - lengths
+            top = np.argpartition(-cheap, self.max_candidates)
+            top = top[:self.max_candidates]
+            candidates, counts = candidates[top], counts[top]
+        return candidates, counts
+
+
+def similarity(query: str, term: str, overlap: float) -> float:
+    if term == query:
+        score = 4.0
+    elif term.startswith(query):
+        score = 3.0
+    elif query in term:
+        score = 2.0
+    else:
+        score = overlap
+    # Shorter terms are preferred among matches of the same kind.
+    return score + 0.5 / (1 + abs(len(term) - len(query)))
@@ -0,0 +1,174 @@
+#   encoding: utf8
+#   filename: syntax.py
+"""Optional syntax layer based on incremental tree-sitter parsing. It is used
+to select compact context around cursor: enclosing scopes, relevant imports,
+and nearby lines.
+"""
+
+import logging
+
+from functools import lru_cache
+from re import compile as compile_regex
+from typing import List, Optional, Set, Tuple
+
+__all__ = ('SyntaxTree', 'make_syntax_tree')
+
+
+# Node types which introduce a scope (function, class, etc.) in some of
+# grammars supported by tree-sitter.
+SCOPE_TYPES = frozenset([
+    'class_declaration',
+    'class_definition',
+    'class_specifier',
+    'function_declaration',
+    'function_definition',
+    'function_item',
+    'impl_item',
+    'method_declaration',
+    'method_definition',
+    'namespace_definition',
+    'struct_specifier',
+])
+
+# Node types which import names to a module.
+IMPORT_TYPES = frozenset([
+    'future_import_statement',
+    'import_declaration',
+    'import_from_statement',
+    'import_statement',
+    'preproc_include',
+    'use_declaration',
+    'using_declaration',
+])
+
+# Words in import statements which are not names.
+IMPORT_KEYWORDS = frozenset(['as', 'from', 'import', 'include', 'use',
+                             'using', 'namespace'])
+
+# Map LSP language identifiers to tree-sitter grammar names.
+LANGUAGES = {
+    'c': 'c',
+    'cpp': 'cpp',
+    'go': 'go',
+    'java': 'java',
+    'javascript': 'javascript',
+    'python': 'python',
+    'ruby': 'ruby',
+    'rust': 'rust',
+    'typescript': 'typescript',
+}
+
+WORD_REGEX = compile_regex(r'\w+')
+
+MAX_HEADER_LINES = 4
+
+
+@lru_cache(maxsize=None)
+def load_parser(language: str):
+    try:
+        from tree_sitter_languages import get_parser
+    except ImportError:
+        try:
+            from tree_sitter_language_pack import get_parser
+        except ImportError:
+            logging.warning('no tree-sitter grammars found: syntax layer is '
+                            'disabled')
+            return None
+    return get_parser(language)
+
+
+def make_syntax_tree(language_id: Optional[str],
+                     text: str) -> Optional['SyntaxTree']:
+    """Function make_syntax_tree creates syntax tree for a document in a
+    language identified by LSP language identifier if there is a suitable
+    grammar.
+    """
+    if not (language := LANGUAGES.get(language_id or '')):
+        return None
+    try:
+        if (parser := load_parser(language)) is None:
+            return None
+    except Exception:
+        logging.exception('failed to load tree-sitter grammar for %s',
+                          language)
+        return None
+    return SyntaxTree(parser, text)
+
+
+class SyntaxTree:
+    """Class SyntaxTree maintains UTF-8 encoded copy of a document and its
+    parse tree which is updated incrementally on every edit.
+    """
+
+    def __init__(self, parser, text: str):
+        self.parser = parser
+        self.reset(text)
+
+    def reset(self, text: str):
+        self.data = text.encode('utf-8')
+        self.tree = self.parser.parse(self.data)
+
+    def edit(self, start_byte: int, old_end_byte: int, text: bytes,
+             start_point: Tuple[int, int], old_end_point: Tuple[int, int]):
+        """Method edit applies replacement of bytes in range [start_byte,
+        old_end_byte) with text and reparses document incrementally. Points
+        are rows and byte columns of range ends, so that nothing but the
+        edit is encoded.
+        """
+        new_end_byte = start_byte + len(text)
+        if (num_lines := text.count(b'\n')):
+            last_line = len(text) - text.rindex(b'\n') - 1
+            new_end_point = (start_point[0] + num_lines, last_line)
+        else:
+            new_end_point = (start_point[0], start_point[1] + len(text))
+
+        self.data = b''.join([self.data[:start_byte], text,
+                              self.data[old_end_byte:]])
+        self.tree.edit(start_byte=start_byte,
+                       old_end_byte=old_end_byte,
+                       new_end_byte=new_end_byte,
+                       start_point=start_point,
+                       old_end_point=old_end_point,
+                       new_end_point=new_end_point)
+        self.tree = self.parser.parse(self.data, self.tree)
+
+    def outline(self, pos: int, begin: int, window: str) -> str:
+        """Method outline returns text of import statements relevant to window
+        text and headers (signatures) of scopes enclosing cursor. Both of them
+        are taken only if they precede window beginning. Positions pos and
+        begin are byte offsets of cursor and window beginning.
+        """
+        root = self.tree.root_node
+        names = set(WORD_REGEX.findall(window))
+        lines = [self.slice_node(node) for node in root.children
+                 if node.type in IMPORT_TYPES and node.start_byte < begin and
+                 self.is_relevant(node, names)]
+
+        scopes: List[str] = []
+        node = root.descendant_for_byte_range(pos, pos)
+        while node is not None:
+            if node.type in SCOPE_TYPES and node.start_byte < begin:
+                scopes.append(self.slice_header(node))
+            node = node.parent
+        lines.extend(reversed(scopes))
+
+        return '\n'.join(lines) + '\n' if lines else ''
+
+    def is_relevant(self, node, names: Set[str]) -> bool:
+        words = WORD_REGEX.findall(self.slice_node(node))
+        return any(word in names for word in words
+                   if word not in IMPORT_KEYWORDS)
+
+    def slice_node(self, node) -> str:
+        return self.data[node.start_byte:node.end_byte].decode('utf-8')
+
+    def slice_header(self, node) -> str:
+        # Header starts at the beginning of line and ends right before body.
+        line_start = node.start_byte - node.start_point[1]
+        if (body := node.child_by_field_name('body')) is not None:
+            end = body.start_byte
+        else:
+            end = self.data.find(b'\n', node.start_byte)
+            end = node.end_byte if end == -1 else end
+        header = self.data[line_start:end].decode('utf-8').rstrip()
+        return '\n'.join(header.splitlines()[:MAX_HEADER_LINES])
@@ -0,0 +1,367 @@
+#   encoding: utf8
+#   filename: thesaurus.py
+"""Thesaurus over word embeddings. Embedding table is compressed with product
+quantization (PQ): a vector is split into subvectors and every subvector is
+replaced with index of the nearest centroid (one byte). Vectors are
+partitioned into inverted lists by a coarse quantizer (IVF) so that only a few
+lists are scanned on query. Similarities between query and codes are computed
+asymmetrically: query is not quantized and it is compared to centroids via
+lookup tables.
+
+Thesaurus is built offline and it is memory-mapped on load. All integers are
+little-endian.
+
+    header      magic, counters, and table of sections
+    sections    codebooks, coarse centroids, inverted lists, and words
+"""
+
+import logging
+
+import numpy as np
+
+from dataclasses import dataclass
+from mmap import ACCESS_READ, mmap
+from os import replace
+from pathlib import Path
+from struct import Struct
+from time import perf_counter
+from typing import List, Optional, Tuple
+
+__all__ = ('Thesaurus', 'ThesaurusReport', 'build_thesaurus')
+
+
+MAGIC = b'LSPLMPQ1'
+
+HEADER = Struct('<8s5Q')
+
+SECTIONS = (
+    ('codebooks', np.float32),
+    ('coarse', np.float32),
+    ('list_offsets', np.uint64),
+    ('codes', np.uint8),
+    ('words', np.uint8),
+    ('word_offsets', np.uint64),
+    ('word_order', np.uint32),
+)
+
+SECTION = Struct('<2Q')
+
+NUM_CENTROIDS = 256
+
+
+@dataclass
+class ThesaurusReport:
+
+    num_words: int
+
+    dim: int
+
+    num_subspaces: int
+
+    num_lists: int
+
+    table_bytes: int
+
+    thesaurus_bytes: int
+
+    recall: float
+
+    elapsed: float
+
+    def __str__(self) -> str:
+        ratio = self.table_bytes / max(1, self.thesaurus_bytes)
+        return '\n'.join([
+            f'words:          {self.num_words}',
+            f'dimension:      {self.dim}',
+            f'subspaces:      {self.num_subspaces}',
+            f'lists:          {self.num_lists}',
+            f'size:           {self.table_bytes / 2**20:.1f} MiB -> '
+            f'{self.thesaurus_bytes / 2**20:.1f} MiB ({ratio:.1f}x)',
+            f'recall@10:      {self.recall:.3f}',
+            f'elapsed:        {self.elapsed:.1f} s',
+        ])
+
+
+def read_vectors(path: Path, max_words: Optional[int] = None
+                 ) -> Tuple[List[str], np.ndarray]:
+    """Function read_vectors reads word vectors in text format of word2vec,
+    GloVe, or fastText (a word and its components per line; optional header
+    line with counts is skipped).
+    """
+    words: List[str] = []
+    rows: List[np.ndarray] = []
+    with open(path, encoding='utf-8', errors='ignore') as fin:
+        for line in fin:
+            parts = line.rstrip().split(' ')
+            if len(parts) <= 2:
+                continue  # Header of word2vec format.
+            if rows and len(parts) - 1 != len(rows[0]):
+                continue
+            words.append(parts[0])
+            rows.append(np.array(parts[1:], np.float32))
+            if max_words and len(words) == max_words:
+                break
+    return words, np.stack(rows)
+
+
+def assign(points: np.ndarray, centroids: np.ndarray,
+           block_size: int = 16384) -> np.ndarray:
+    """Function assign returns indices of the nearest (in L2) centroids.
+    """
+    norms = (centroids ** 2).sum(axis=1) / 2
+    result = np.empty(len(points), np.int64)
+    for begin in range(0, len(points), block_size):
+        sims = points[begin:begin + block_size] @ centroids.T - norms
+        result[begin:begin + block_size] = sims.argmax(axis=1)
+    return result
+
+
+def kmeans(points: np.ndarray, k: int, num_iters: int,
+           rng: np.random.Generator) -> np.ndarray:
+    """Function kmeans clusters points with Lloyd algorithm. Empty clusters
+    are reseeded with random points.
+    """
+    k = min(k, len(points))
+    centroids = points[rng.choice(len(points), k, replace=False)].copy()
+    for _ in range(num_iters):
+        labels = assign(points, centroids)
+        counts = np.bincount(labels, minlength=k)
+        sums = np.zeros_like(centroids)
+        for dim in range(points.shape[1]):
+            sums[:, dim] = np.bincount(labels, points[:, dim], minlength=k)
+        empty = counts == 0
+        centroids[~empty] = sums[~empty] / counts[~empty, None]
+        if (num_empty := int(empty.sum())):
+            centroids[empty] = points[rng.choice(len(points), num_empty)]
+    return centroids
+
+
+def build_thesaurus(vectors_path: Path, output: Path, num_subspaces: int = 16,
+                    num_lists: int = 1024, num_iters: int = 16,
+                    max_words: Optional[int] = None,
+                    sample_size: int = 65536, seed: int = 42
+                    ) -> ThesaurusReport:
+    """Function build_thesaurus is an entry point of offline thesaurus build.
+    It reads word vectors, trains coarse quantizer and PQ codebooks on a
+    sample, encodes all vectors, writes thesaurus, and measures recall of
+    approximate search against exact one.
+    """
+    started_at = perf_counter()
+    rng = np.random.default_rng(seed)
+
+    logging.info('read word vectors from %s', vectors_path)
+    words, vectors = read_vectors(vectors_path, max_words)
+    table_bytes = vectors.nbytes + sum(len(word) for word in words)
+
+    # Vectors are normalized so that inner product is cosine similarity and
+    # padded so that they could be split into equal subvectors.
+    vectors /= np.maximum(np.linalg.norm(vectors, axis=1, keepdims=True),
+                          1e-12)
+    num_words, dim = vectors.shape
+    padded_dim = -(-dim // num_subspaces) * num_subspaces
+    vectors = np.pad(vectors, ((0, 0), (0, padded_dim - dim)))
+    logging.info('read %d words of dimension %d', num_words, dim)
+
+    sample = vectors[rng.choice(num_words, min(sample_size, num_words),
+                                replace=False)]
+    num_lists = max(1, min(num_lists, len(sample) // 16))
+    logging.info('train coarse quantizer with %d lists', num_lists)
+    coarse = kmeans(sample, num_lists, num_iters, rng)
+
+    logging.info('train codebooks for %d subspaces', num_subspaces)
+    dsub = padded_dim // num_subspaces
+    codebooks = np.zeros((num_subspaces, NUM_CENTROIDS, dsub), np.float32)
+    for m in range(num_subspaces):
+        subspace = sample[:, m * dsub:(m + 1) * dsub]
+        centroids = kmeans(subspace, NUM_CENTROIDS, num_iters, rng)
+        codebooks[m, :len(centroids)] = centroids
+
+    logging.info('encode %d vectors', num_words)
+    lists = assign(vectors, coarse)
+    codes = np.empty((num_words, num_subspaces), np.uint8)
+    for m in range(num_subspaces):
+        codes[:, m] = assign(vectors[:, m * dsub:(m + 1) * dsub],
+                             codebooks[m])
+
+    # Inverted lists are contiguous so that words are reordered by list.
+    order = np.argsort(lists, kind='stable')
+    list_offsets = np.zeros(num_lists + 1, np.uint64)
+    list_offsets[1:] = np.cumsum(np.bincount(lists, minlength=num_lists))
+    words = [words[i] for i in order]
+    codes = codes[order]
+    vectors = vectors[order]
+
+    output.parent.mkdir(parents=True, exist_ok=True)
+    write_thesaurus(output, words, codebooks, coarse, list_offsets, codes)
+
+    logging.info('evaluate recall of thesaurus')
+    thesaurus = Thesaurus(output)
+    recall = 0.0
+    queries = rng.choice(num_words, min(100, num_words), replace=False)
+    for index in queries.tolist():
+        exact = np.argsort(-(vectors @ vectors[index]))[1:11]
+        approx = thesaurus.neighbours(words[index], 10)
+        recall += len({words[i] for i in exact} & set(approx)) / 10
+    thesaurus.close()
+
+    return ThesaurusReport(num_words=num_words,
+                           dim=dim,
+                           num_subspaces=num_subspaces,
+                           num_lists=num_lists,
+                           table_bytes=table_bytes,
+                           thesaurus_bytes=output.stat().st_size,
+                           recall=recall / max(1, len(queries)),
+                           elapsed=perf_counter() - started_at)
+
+
+def write_thesaurus(path: Path, words: List[str], codebooks: np.ndarray,
+                    coarse: np.ndarray, list_offsets: np.ndarray,
+                    codes: np.ndarray):
+    encoded = [word.encode('utf-8') for word in words]
+    word_offsets = np.zeros(len(encoded) + 1, np.uint64)
+    word_offsets[1:] = np.cumsum([len(word) for word in encoded])
+    columns = {
+        'codebooks': codebooks,
+        'coarse': coarse,
+        'list_offsets': list_offsets,
+        'codes': codes,
+        'words': np.frombuffer(b''.join(encoded), np.uint8),
+        'word_offsets': word_offsets,
+        # Order of words by value makes word lookup a binary search.
+        'word_order': np.array(sorted(range(len(encoded)),
+                                      key=encoded.__getitem__), np.uint32),
+    }
+
+    # Sections are aligned to 8 bytes so that they could be mapped in-place.
+    offset = HEADER.size + SECTION.size * len(SECTIONS)
+    table = []
+    for name, dtype in SECTIONS:
+        size = columns[name].astype(dtype).nbytes
+        table.append((offset, size))
+        offset += (size + 7) & ~7
+
+    num_subspaces, _, dsub = codebooks.shape
+    tmp_path = path.with_suffix('.tmp')
+    with open(tmp_path, 'wb') as fout:
+        fout.write(HEADER.pack(MAGIC, len(words), num_subspaces * dsub,
+                               num_subspaces, len(coarse), dsub))
+        for section in table:
+            fout.write(SECTION.pack(*section))
+        for (name, dtype), (_, size) in zip(SECTIONS, table):
+            fout.write(columns[name].astype(dtype).tobytes())
+            fout.write(b'\0' * (((size + 7) & ~7) - size))
+    replace(tmp_path, path)
+
+
+class Thesaurus:
+    """Class Thesaurus provides read-only access to memory-mapped PQ
+    embedding table and finds the nearest words to a word.
+
+    :param num_probes: Number of inverted lists to scan on query.
+    """
+
+    def __init__(self, path: Path, num_probes: int = 8):
+        self.path = path
+        self.num_probes = num_probes
+        with open(path, 'rb') as fin:
+            self.mmap = mmap(fin.fileno(), 0, access=ACCESS_READ)
+
+        magic, num_words, dim, num_subspaces, num_lists, dsub = \
+            HEADER.unpack_from(self.mmap)
+        if magic != MAGIC:
+            raise ValueError(f'Unexpected thesaurus format: {path}.')
+        self.num_words = num_words
+        self.dim = dim
+        self.num_subspaces = num_subspaces
+        self.num_lists = num_lists
+
+        for index, (name, dtype) in enumerate(SECTIONS):
+            offset, size = SECTION.unpack_from(self.mmap, HEADER.size +
+                                               index * SECTION.size)
+            count = size // np.dtype(dtype).itemsize
+            setattr(self, name, np.frombuffer(self.mmap, dtype, count,
+                                              offset))
+        self.codebooks = self.codebooks.reshape(num_subspaces,
+                                                NUM_CENTROIDS, dsub)
+        self.coarse = self.coarse.reshape(num_lists, dim)
+        self.codes = self.codes.reshape(num_words, num_subspaces)
+        self.subspaces = np.arange(num_subspaces)
+
+    def __len__(self) -> int:
+        return self.num_words
+
+    def __str__(self) -> str:
+        return (f'Thesaurus(nowords={self.num_words}, dim={self.dim}, '
+                f'nosubspaces={self.num_subspaces}, '
+                f'nolists={self.num_lists})')
+
+    def close(self):
+        # Arrays should be released before memory map is closed.
+        for name, _ in SECTIONS:
+            setattr(self, name, None)
+        self.mmap.close()
+
+    def word(self, index: int) -> str:
+        begin = int(self.word_offsets[index])
+        end = int(self.word_offsets[index + 1])
+        return self.words[begin:end].tobytes().decode('utf-8')
+
+    def find(self, word: str) -> Optional[int]:
+        """Method find returns index of a word with binary search.
+        """
+        key = word.encode('utf-8')
+        lo, hi = 0, self.num_words
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self.word(int(self.word_order[mid])).encode('utf-8') < key:
+                lo = mid + 1
+            else:
+                hi = mid
+        if lo < self.num_words:
+            index = int(self.word_order[lo])
+            if self.word(index) == word:
+                return index
+        return None
+
+    def vector(self, index: int) -> np.ndarray:
+        """Method vector reconstructs a vector from its PQ codes.
+        """
+        vector = self.codebooks[self.subspaces, self.codes[index]].ravel()
+        return vector / max(np.linalg.norm(vector), 1e-12)
+
+    def neighbours(self, word: str, k: int = 10) -> List[str]:
+        """Method neighbours returns at most k the most similar words to a
+        word. Lowercase form of a word is looked up if the word is missing.
+        """
+        if (index := self.find(word)) is None and \
+                (index := self.find(word.lower())) is None:
+            return []
+        query = self.vector(index)
+
+        # Scan inverted lists which are the closest to query.
+        probes = np.argsort(-(self.coarse @ query))[:self.num_probes]
+        ranges = [(int(self.list_offsets[p]), int(self.list_offsets[p + 1]))
+                  for p in probes.tolist()]
+        ids = np.concatenate([np.arange(b, e) for b, e in ranges])
+        codes = np.concatenate([self.codes[b:e] for b, e in ranges])
+
+        # Asymmetric distance computation: similarities of query subvectors
+        # to all centroids are looked up and summed up over subspaces.
+        dsub = self.codebooks.shape[2]
+        lut = np.einsum('mcd,md->mc', self.codebooks,
+                        query.reshape(self.num_subspaces, dsub))
+        sims = lut[self.subspaces, codes].sum(axis=1)
+
+        num_candidates = min(len(sims), 2 * k + 1)
+        top = np.argpartition(-sims, num_candidates - 1)[:num_candidates]
+        top = top[np.argsort(-sims[top])]
+        result = []
+        lower = word.lower()
+        for candidate in ids[top].tolist():
+            if (neighbour := self.word(candidate)).lower() == lower:
+                continue
+            if neighbour.lower() not in (w.lower() for w in result):
+                result.append(neighbour)
+            if len(result) == k:
+                break
+        return result